@@ -27,6 +27,7 @@
 
 
 #include "db/lds_io.h"
+#include "db/lds_trace.h"
 
 extern  std::string dev_name;
 extern  int flash_using_exist;//0 is write 1 is read
@@ -53,7 +54,7 @@ class LDS_WritableSlot : public WritableFile {
 			//1.for regual write, LDS just append the data at the current offset. However, LDS must be informed if the write is the tail, so that LDS can align the tail to the right end of the slot.
 			//2. an alternate way is using the last block of the slot as slot meta. But LDS still needs to be informed for the last write of the slot, so that it can update the meta.
 			//3. LDS_Slot can maintain logical offset to provide compatible read function.
-		size_t r=Slot_write(data.data(), 1, data.size(), slot_);
+		size_t r=Slot_append(data.data(), data.size(), slot_);
 		return Status::OK();
 	}
 
@@ -88,6 +89,10 @@ class LDS_WritableLog : public WritableFile {
 		LDS_WritableLog(const std::string& name_, LDS_Log* log) : log_name_(name_), log_(log) { 
 
 		}
+
+		virtual ~LDS_WritableLog(){
+			Log_close(log_);//gives its ring back to the memory budget
+		}
 		
 
 	virtual Status Append(const Slice& data) {//called by log_writer。
@@ -157,10 +162,54 @@ class LDS_MmapedSlot : public RandomAccessFile {
 	std::string name_;
 	void* mmapped_region_;
 	size_t length_;
+	LDS_Device *dev_;
+	size_t extents_length_;//not 0 if the table spans several slots and was mapped with MapExtents
+	LDS_MetaCache *cache_;
+	LDS_TableMeta *meta_;//pinned tail of the table (index, filter, footer), or NULL
+	LDS_MemBudget *memory_;//the mapping is counted in it, or NULL
+	LDS_SealedCache *sealed_cache_;
+	LDS_SealedTable *sealed_;//the table is read from this entry instead of a mapping, or NULL
 
 	public:
-		LDS_MmapedSlot(const std::string& name, void* base, size_t length): name_(name), mmapped_region_(base), length_(length) {
+		LDS_MmapedSlot(const std::string& name, void* base, size_t length, LDS_Device *dev, size_t extents_length=0): name_(name), mmapped_region_(base), length_(length), dev_(dev), extents_length_(extents_length), cache_(NULL), meta_(NULL), memory_(NULL), sealed_cache_(NULL), sealed_(NULL) {
+
+		}
+
+		void Pin(LDS_MetaCache *cache, uint64_t number){
+			meta_=cache->Lookup(number);
+			if(meta_!=NULL && meta_->size!=length_){//not this table
+				cache->Release(meta_);
+				meta_=NULL;
+			}
+			cache_=cache;
+		}
 
+		void PinSealed(LDS_SealedCache *cache, LDS_SealedTable *table){
+			sealed_cache_=cache;
+			sealed_=table;
+		}
+
+		void Account(LDS_MemBudget *memory){
+			memory_=memory;
+			memory_->Charge(LDS_MEM_TABLE_MAP, extents_length_>0 ? extents_length_ : length_);
+		}
+
+		virtual ~LDS_MmapedSlot(){
+			if(meta_!=NULL){
+				cache_->Release(meta_);
+			}
+			if(memory_!=NULL){
+				memory_->Release(LDS_MEM_TABLE_MAP, extents_length_>0 ? extents_length_ : length_);
+			}
+			if(sealed_!=NULL){
+				sealed_cache_->Release(sealed_);
+			}
+			else if(extents_length_>0){
+				dev_->UnmapExtents(mmapped_region_, extents_length_);
+			}
+			else{
+				dev_->Unmap(mmapped_region_, length_);
+			}
 		}
 
 		virtual Status Read(uint64_t offset, size_t n, Slice* result,char* scratch) const {
@@ -170,6 +219,10 @@ class LDS_MmapedSlot : public RandomAccessFile {
 			//printf("env_lds.cc, LDS_MmapedSlot, length_=%d, offset=%d,n=%d\n",length_,offset,n );
 
 			
+			if(meta_!=NULL && offset>=meta_->offset && offset+n<=meta_->size){//the footer, index and filter, no fault on the mapping
+				*result = Slice(meta_->data.data() + (offset - meta_->offset), n);
+				return Status::OK();
+			}
 			*result = Slice(reinterpret_cast<char*>(mmapped_region_) + offset, n);
 
 			//printf("env_lds.cc, LDS_MmapedSlot, mmapped_region_=%s\n",mmapped_region_+offset);
@@ -196,6 +249,10 @@ class LDS_SequantialLog : public SequentialFile {
 
 		}
 
+		virtual ~LDS_SequantialLog(){
+			Log_close(log_);//unmaps the area
+		}
+
 		virtual Status Read(size_t n, Slice* result, char* scratch) {
 			Status s;
 				//here we will decide the valid version logs for manifest. the content returned to leveldb is like a whole file.
@@ -220,6 +277,97 @@ class LDS_SequantialLog : public SequentialFile {
 		}
 };
 
+class LDS_SequentialSlot : public SequentialFile {
+	//a table read from start to end in large aligned reads, the bytes past the request stay
+	//in the buffer for the next Reads
+	std::string name_;
+	LDS_Device *dev_;
+	std::vector<std::pair<uint64_t, size_t> > extents_;//device extents of the table data, in order
+	uint64_t size_;
+	uint64_t pos_;//of the next byte of the table to return
+	bool direct_;
+	LDS_MemBudget *memory_;
+
+	char *buf_;
+	uint64_t buf_size_;
+	uint64_t buf_start_;//table offset of the first valid byte of buf_
+	uint64_t buf_skip_;//where that byte is in buf_
+	uint64_t buf_len_;//valid bytes
+
+	Status Fill(){
+		//read from pos_ to at most the end of its extent, the read starts at the 4KB page of pos_
+		uint64_t skip=pos_;
+		size_t i=0;
+		while(skip>=extents_[i].second){
+			skip-=extents_[i].second;
+			i++;
+		}
+		uint64_t offset=extents_[i].first+ skip;
+		uint64_t avail=extents_[i].second- skip;
+		uint64_t aligned=offset/4096*4096;
+		uint64_t n=(offset-aligned+ avail+ 4095)/4096*4096;
+		if(n>buf_size_){
+			n=buf_size_;
+		}
+		ssize_t r= direct_ ? dev_->ReadUncached(aligned, buf_, n) : dev_->Read(aligned, buf_, n);
+		if(r<=(ssize_t)(offset-aligned)){
+			buf_len_=0;
+			return Status::IOError(name_, "read error");
+		}
+		buf_start_=pos_;
+		buf_skip_=offset-aligned;
+		buf_len_=r- buf_skip_;
+		if(buf_len_>avail){
+			buf_len_=avail;
+		}
+		return Status::OK();
+	}
+
+	public:
+		LDS_SequentialSlot(const std::string& name, LDS_Device *dev, const std::vector<std::pair<uint64_t, size_t> >& extents, uint64_t size,
+			uint64_t readahead, bool direct, LDS_MemBudget *memory)
+			: name_(name), dev_(dev), extents_(extents), size_(size), pos_(0), direct_(direct), memory_(memory),
+			  buf_start_(0), buf_skip_(0), buf_len_(0) {
+			buf_size_= readahead<4096 ? 4096 : (readahead+4095)/4096*4096;
+			posix_memalign((void**)&buf_, 4096, buf_size_);//in order for direct IO
+			memory_->Charge(LDS_MEM_SLOT_BUFFER, buf_size_);
+		}
+
+		virtual ~LDS_SequentialSlot(){
+			memory_->Release(LDS_MEM_SLOT_BUFFER, buf_size_);
+			free(buf_);
+		}
+
+		virtual Status Read(size_t n, Slice* result, char* scratch) {
+			if(n>size_-pos_){
+				n=size_-pos_;//the table ends here, not the slot
+			}
+			size_t done=0;
+			while(done<n){
+				if(pos_<buf_start_ || pos_>=buf_start_+buf_len_){
+					Status s=Fill();
+					if(!s.ok()){
+						*result=Slice(scratch, done);
+						return s;
+					}
+				}
+				uint64_t off=pos_-buf_start_;
+				size_t len= n-done < buf_len_-off ? n-done : buf_len_-off;
+				memcpy(scratch+done, buf_+buf_skip_+off, len);
+				done+=len;
+				pos_+=len;
+			}
+			*result=Slice(scratch, done);
+			return Status::OK();
+		}
+
+		virtual Status Skip(uint64_t n) {
+			//the buffer stays valid if pos_ is still in it
+			pos_= n < size_-pos_ ? pos_+n : size_;
+			return Status::OK();
+		}
+};
+
 class LDS_SequentialOthers : public SequentialFile {
 
 	std::string name_;
@@ -270,6 +418,7 @@ class LDS_SequentialOthers : public SequentialFile {
 class LDSEnv : public Env {
  public:
 	 LDSEnv();
+	 explicit LDSEnv(const std::string& path);//e.g. a namespace, "/dev/nvme0n1#shard7"
 	virtual ~LDSEnv(){
 
 
@@ -280,18 +429,23 @@ class LDSEnv : public Env {
 		Status s;
 		printf("env_lds, NewSequentialFile, fname=%s\n", fname.c_str());
 		if(fname.find(".ldb")!=-1){//this is ldb request.
-			printf("env_lds, NewSequentialFile, no implementation, exit(9)\n");
-			exit(9);
-			//LDS_Slot *slot=lds->alloc_slot(fname);
-
-			//*result = new LDS_WritableSlot(fname, slot);
+			uint64_t number=strtoull(BaseName(fname).c_str(), NULL, 10);
+			uint64_t size;
+			std::vector<std::pair<uint64_t, size_t> > extents;
+			if(lds->meta_cache==NULL || lds->is_quarantined(number) || !lds->meta_cache->Locate(number, &extents, &size)){
+				s=LocateTable(fname, &number, &extents, &size);//no slot header read for a cached table
+				if(!s.ok()){
+					return s;
+				}
+			}
+			*result = new LDS_SequentialSlot(fname, lds->dev, extents, size, lds->options.seq_readahead_bytes, lds->options.seq_read_direct, lds->memory);
 		}
 		else if(fname.find("MANIFEST")!=-1){//this is manifest reqeust
 			//new LDS_VersionLog;
 			printf("env_lds,NewSequentialFile, for manifest\n");
 			
 			//LDS_Log *manifest_ = lds->manifest;
-			LDS_Log *manifest_ =lds->alloc_log(fname);
+			LDS_Log *manifest_ =lds->alloc_log(fname, false);
 
 			*result = new LDS_SequantialLog(fname, manifest_);
 		}
@@ -318,16 +472,46 @@ class LDSEnv : public Env {
 		//printf("env_lds, NewRandomAccessFile\n");
 		if(fname.find(".ldb")!=-1){//this is ldb request.
 				//exit(9);
-			LDS_Slot *slot =lds->alloc_slot(fname);
-			
-			uint64_t  size;
-			size= read_chunk_size(slot);
-			
-			//printf("env_lds, NewRandomAccessFile,.ldb, file=%s size=%llu\n",fname.c_str(), size);
-			//exit(0);
-
-			void *base=mmap(NULL, size, PROT_READ, MAP_SHARED, slot->fd, slot->phy_offset);
-			*result = new LDS_MmapedSlot(fname, base, size);
+			if(lds->sealed_cache!=NULL){
+				//a table sealed a moment ago, still in its slot buffer
+				uint64_t number=strtoull(BaseName(fname).c_str(), NULL, 10);
+				LDS_SealedTable *table= lds->is_quarantined(number) ? NULL : lds->sealed_cache->Lookup(number);
+				if(table!=NULL){
+					LDS_MmapedSlot *file=new LDS_MmapedSlot(fname, (void*)table->data, table->size, lds->dev);
+					file->PinSealed(lds->sealed_cache, table);
+					*result = file;
+					return s;
+				}
+			}
+			uint64_t number;
+			uint64_t size;
+			std::vector<std::pair<uint64_t, size_t> > extents;
+			s=LocateTable(fname, &number, &extents, &size);
+			if(!s.ok()){
+				return s;
+			}
+			LDS_MmapedSlot *file;
+			if(extents.size()>1){//a table larger than a slot, present its slots as one region
+				size_t total;
+				LDS_TRACE_BEGIN(t_map);
+				void *base=lds->dev->MapExtents(extents, &total);
+				LDS_TRACE(LDS_TRACE_TABLE_MMAP, LDS_AREA_SLOT, extents[0].first, size, t_map);
+				if(base==NULL){
+					return Status::IOError(fname, "cannot map the slot chain");
+				}
+				file=new LDS_MmapedSlot(fname, base, size, lds->dev, total);
+			}
+			else{
+				LDS_TRACE_BEGIN(t_map);
+				void *base=lds->dev->Map(extents[0].first, size);
+				LDS_TRACE(LDS_TRACE_TABLE_MMAP, LDS_AREA_SLOT, extents[0].first, size, t_map);
+				file=new LDS_MmapedSlot(fname, base, size, lds->dev);
+			}
+			file->Account(lds->memory);
+			if(lds->meta_cache!=NULL){
+				file->Pin(lds->meta_cache, number);
+			}
+			*result = file;
 			
 		}
 		else{
@@ -347,6 +531,7 @@ class LDSEnv : public Env {
 		if(fname.find(".ldb")!=-1){//this is ldb request.
 				//exit(9);
 			LDS_Slot *slot=lds->alloc_slot(fname);
+			lds->add_file(BaseName(fname));
 
 			*result = new LDS_WritableSlot(fname, slot);
 		}
@@ -355,6 +540,7 @@ class LDSEnv : public Env {
 			//printf("env_lds,NewWritableFile, for manifest\n");
 			//LDS_Log *manifest_ = lds->manifest;
 			LDS_Log *manifest_ =lds->alloc_log(fname);
+			lds->add_file(BaseName(fname));
 			*result = new LDS_WritableLog(fname, manifest_);
 		}
 		else if(fname.find(".log")!=-1){//this is backup log request
@@ -362,6 +548,7 @@ class LDSEnv : public Env {
 			//printf("env_lds,NewWritableFile, for log\n");
 
 			LDS_Log *log_ =lds->alloc_log(fname);
+			lds->add_file(BaseName(fname));
 			*result = new LDS_WritableLog(fname, log_);
 			//exit(9);//to implement
 
@@ -395,13 +582,14 @@ class LDSEnv : public Env {
 		printf("LDSEnv, GetChildren, name=%s\n", name.c_str());
 
 		result->clear();
+		lds->list_files(result);//so that leveldb deletes the obsolete files and LDS gets their slots back
 		return Status::OK();
    
 	}
 
 	virtual Status DeleteFile(const std::string& name) {
 		printf("LDSEnv, DeleteFile, name=%s\n", name.c_str());
-		//
+		lds->delete_file(BaseName(name));
 
 		return Status::OK();
 	}
@@ -457,15 +645,144 @@ class LDSEnv : public Env {
 	}
 
 	virtual uint64_t NowMicros() {
-    
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
 	}
 
 	virtual void SleepForMicroseconds(int micros) {
 		usleep(micros);
 	}
 
+	bool GetProperty(const std::string& property, std::string* value) {
+		return lds->get_property(property, value);
+	}
+
+	int IngestTable(const std::string& src_path, const std::string& fname, int level, uint64_t *size) {
+		return lds->ingest_table(src_path, fname, level, size);
+	}
+
+	int WarmTable(const std::string& fname, uint64_t *bytes) {
+		//the tail of the table (filter, metaindex, index, footer) in a few large reads from its
+		//end, instead of the page faults of Table::Open on the mapping. It goes to the metadata
+		//cache, which the open then reads from, or without one stays in the OS buffer.
+		*bytes=0;
+		uint64_t number=strtoull(BaseName(fname).c_str(), NULL, 10);
+		if(lds->meta_cache!=NULL){
+			LDS_TableMeta *meta=lds->meta_cache->Lookup(number);
+			if(meta!=NULL){
+				lds->meta_cache->Release(meta);
+				return 0;
+			}
+		}
+		uint64_t size;
+		std::vector<std::pair<uint64_t, size_t> > extents;
+		if(!LocateTable(fname, &number, &extents, &size).ok()){
+			return -1;
+		}
+		std::string tail;
+		uint64_t start=size, meta_start;
+		bool complete=false;
+		uint64_t want=LDS_WARM_READ;
+		do{
+			//the footer locates the metaindex block, which locates the filter block; read further
+			//back until they are all in
+			uint64_t from= start>want ? start-want : 0;
+			std::string piece(start-from, 0);
+			if(ReadTable(extents, from, &piece)!=0){
+				return -1;
+			}
+			tail.insert(0, piece);
+			*bytes+=piece.size();
+			start=from;
+			want*=2;
+		}while((!LDS_MetaCache::MetaStart(tail.data(), start, size, &meta_start, &complete) || !complete) && start>0);
+		if(lds->meta_cache!=NULL){
+			lds->meta_cache->Insert(number, tail.data(), start, size, extents);
+		}
+		return 0;
+	}
+
+	uint64_t AllocSlot(uint64_t next_file_number, LDS_AllocHint *hint) {
+		return Alloc_slot_in(&lds->slots, next_file_number, hint);
+	}
+
+	void FreeSlot(uint64_t number) {
+		Free_slot_in(&lds->slots, lds->home_slot(number));
+	}
+
+	int Grow(uint64_t bytes) {
+		return lds->grow(bytes);
+	}
+
  private:
 	LDS *lds;
+	static std::string BaseName(const std::string& fname) {
+		size_t found=fname.find_last_of("/");
+		return found==std::string::npos ? fname : fname.substr(found+1);
+	}
+	//buf->size() bytes of the table from offset, read from its extents
+	int ReadTable(const std::vector<std::pair<uint64_t, size_t> >& extents, uint64_t offset, std::string *buf) {
+		uint64_t pos=0, done=0;
+		for(size_t i=0; i<extents.size() && done<buf->size(); i++){
+			uint64_t end= pos+extents[i].second;
+			if(offset+done<end){
+				uint64_t skip= offset+done-pos;
+				size_t n= end-(offset+done) < buf->size()-done ? end-(offset+done) : buf->size()-done;
+				if(lds->dev->Read(extents[i].first+skip, &(*buf)[done], n)!=(ssize_t)n){
+					return -1;
+				}
+				done+=n;
+			}
+			pos=end;
+		}
+		return done==buf->size() ? 0 : -1;
+	}
+	//the device extents of the data of table fname, in table order, and its size
+	Status LocateTable(const std::string& fname, uint64_t *number, std::vector<std::pair<uint64_t, size_t> > *extents, uint64_t *size) {
+		LDS_Slot *slot =lds->alloc_slot(fname, false);//only used to locate the slot
+		*number=slot->number;
+		if(lds->is_quarantined(slot->number)){//found bad by the scrubber, keep it out of compactions
+			Slot_close(slot);
+			return Status::Corruption(fname, "quarantined by the scrubber");
+		}
+		extents->clear();
+		uint64_t offset;
+		if(lds->locate_packed(slot->number, &offset, size)){
+			extents->push_back(std::make_pair(offset, (size_t)*size));
+			Slot_close(slot);
+			return Status::OK();
+		}
+		//a table in its own slot
+		*size= read_chunk_size(slot);
+		offset= slot->phy_offset+ slot->data_offset;
+		if(*size==0){
+			Slot_close(slot);
+			return Status::Corruption(fname, "bad slot header");
+		}
+		std::vector<uint64_t> chain;
+		int n=read_chain(slot, *size, &chain);
+		if(n<0){
+			Slot_close(slot);
+			return Status::Corruption(fname, "bad slot size");
+		}
+		if(n==0){
+			extents->push_back(std::make_pair(offset, (size_t)*size));
+		}
+		else{
+			//the first slot holds the data after its header
+			uint64_t first= SLOT_SIZE-slot->data_offset;
+			extents->push_back(std::make_pair(offset, (size_t)first));
+			uint64_t left= *size-first;
+			for(size_t i=0; i<chain.size(); i++){
+				size_t len= left < SLOT_SIZE ? left : SLOT_SIZE;
+				extents->push_back(std::make_pair(lds->slot_offset(chain[i]), len));
+				left-=len;
+			}
+		}
+		Slot_close(slot);
+		return Status::OK();
+	}
 	void PthreadCall(const char* label, int result) {
 		if (result != 0) {
 		  fprintf(stderr, "pthread %s: %s\n", label, strerror(result));
@@ -515,9 +832,17 @@ LDSEnv::LDSEnv() : started_bgthread_(false) {
 	//printf("env_lds, LDSEnv is called, dev_name=%s\n",dev_name.c_str());
 	//exit(9);
 	std::string path=dev_name;
+	pthread_mutex_init(&mu_, NULL);
+	pthread_cond_init(&bgsignal_, NULL);
 	lds =new LDS(path, flash_using_exist); 
 }
 
+LDSEnv::LDSEnv(const std::string& path) : started_bgthread_(false) {
+	pthread_mutex_init(&mu_, NULL);
+	pthread_cond_init(&bgsignal_, NULL);
+	lds =new LDS(path, flash_using_exist);
+}
+
 void LDSEnv::Schedule(void (*function)(void*), void* arg) {
 	  PthreadCall("lock", pthread_mutex_lock(&mu_));
 	//printf("env_lds.cc Schedule, begin,started_bgthread_=%d\n",started_bgthread_);
@@ -586,4 +911,32 @@ Env* Env::Default() {
   return default_env;
 }
 
+bool LDS_GetProperty(Env *env, const std::string& property, std::string* value) {
+  return static_cast<LDSEnv*>(env)->GetProperty(property, value);
+}
+
+Env *LDS_NewEnv(const std::string& path) {
+  return new LDSEnv(path);
+}
+
+uint64_t LDS_AllocSlot(Env *env, uint64_t next_file_number, LDS_AllocHint *hint) {
+  return static_cast<LDSEnv*>(env)->AllocSlot(next_file_number, hint);
+}
+
+void LDS_FreeSlot(Env *env, uint64_t number) {
+  static_cast<LDSEnv*>(env)->FreeSlot(number);
+}
+
+int LDS_WarmTable(Env *env, const std::string& fname, uint64_t *bytes) {
+  return static_cast<LDSEnv*>(env)->WarmTable(fname, bytes);
+}
+
+int LDS_GrowStorage(Env *env, uint64_t bytes) {
+  return static_cast<LDSEnv*>(env)->Grow(bytes);
+}
+
+int LDS_IngestTable(Env *env, const std::string& src_path, const std::string& fname, int level, uint64_t *size) {
+  return static_cast<LDSEnv*>(env)->IngestTable(src_path, fname, level, size);
+}
+
 }  // namespace leveldb
@@ -2,7 +2,263 @@
 
 uint64_t  VersionSet::NewFileNumber() {
 	
-		uint64_t finalNumber = Alloc_slot(next_file_number_);
+		uint64_t finalNumber = LDS_AllocSlot(env_, next_file_number_);//the slots of the Env of this db (its namespace)
 		next_file_number_ = finalNumber+1;
 		return finalNumber;
-}
\ No newline at end of file
+}
+//version_set.h: declare  uint64_t NewFileNumber(LDS_AllocHint* hint);
+uint64_t  VersionSet::NewFileNumber(LDS_AllocHint* hint) {
+	
+		uint64_t finalNumber = LDS_AllocSlot(env_, next_file_number_, hint);//the slot continues the run of the hint
+		next_file_number_ = finalNumber+1;
+		return finalNumber;
+}
+//version_set.h: declare void ReuseFileNumber(uint64_t file_number); instead of the inline one
+void VersionSet::ReuseFileNumber(uint64_t file_number) {
+		if (next_file_number_ == file_number + 1) {
+			next_file_number_ = file_number;
+		}
+		LDS_FreeSlot(env_, file_number);//NewFileNumber took its slot, the file was not created
+}
+
+//db_impl.cc, struct DBImpl::CompactionState: add
+//	LDS_AllocHint alloc_hint;//the outputs of the compaction take adjacent slots
+//
+//db_impl.cc, DBImpl::DoCompactionWork, before the input loop: size the run by the expected outputs
+//	uint64_t input_bytes=0;
+//	for (int which = 0; which < 2; which++) {
+//		for (int i = 0; i < compact->compaction->num_input_files(which); i++) {
+//			input_bytes += compact->compaction->input(which, i)->file_size;
+//		}
+//	}
+//	compact->alloc_hint.run = input_bytes / options_.max_file_size + 1;
+//
+//db_impl.cc, DBImpl::OpenCompactionOutputFile: replace versions_->NewFileNumber() with
+//	file_number = versions_->NewFileNumber(&compact->alloc_hint);
+//
+//db_impl.cc, DBImpl::WriteLevel0Table: level-0 tables of successive flushes follow each other
+//	(DBImpl member: LDS_AllocHint flush_hint_; set flush_hint_.run to e.g. 16 in the constructor)
+//	meta.number = versions_->NewFileNumber(&flush_hint_);
+
+//db_impl.cc, DBImpl::DoCompactionWork: the outputs are sealed without waiting, one barrier for all of them
+//	(after "mutex_.Unlock();" at the start of the compaction loop)
+//	LDS_SealBatch seal_batch;//FinishCompactionOutputFile -> outfile->Sync() joins the batch of this thread
+//	...
+//	(before "mutex_.Lock();" that precedes InstallCompactionResults)
+//	if (status.ok() && seal_batch.Wait() != 0) {
+//		status = Status::IOError("sealing the compaction outputs");
+//	}
+//	(in the loop, "Prioritize immutable compaction work": the level-0 table of CompactMemTable is
+//	logged right after it is written, so it is synced at once rather than with the outputs)
+//	if (imm_ != NULL) {
+//		LDS_SealBatchDetach detach;
+//		CompactMemTable();
+//		bg_cv_.SignalAll();
+//	}
+
+//db_impl.cc, the level in the slot header of the tables a thread seals
+//	DBImpl::DoCompactionWork, next to "LDS_SealBatch seal_batch;":
+//	LDS_TableLevelScope table_level(compact->compaction->level() + 1);
+//	DBImpl::WriteLevel0Table, before BuildTable (the table may be placed above level 0 later,
+//	the header records where it was written for):
+//	LDS_TableLevelScope table_level(0);
+//	(the scope puts the previous level of the thread back, a CompactMemTable nested in the loop of
+//	DoCompactionWork then returns to the level of the compaction)
+
+//db.h: declare in class DB (with an implementation returning Status::NotSupported in the other DBs)
+//	virtual Status IngestTables(const std::vector<std::string>& paths) = 0;
+//db_impl.h: declare in class DBImpl
+//	virtual Status IngestTables(const std::vector<std::string>& paths);
+//	bool ingesting_;//an ingest checks and installs its tables, no compaction is scheduled (mutex_, false in the constructor)
+//db_impl.cc, DBImpl::MaybeScheduleCompaction: before "} else if (imm_ == NULL &&"
+//	} else if (ingesting_) {
+//		// IngestTables schedules the compactions again once its tables are installed
+//
+//db_impl.cc: bulk load of tables built outside the db, with leveldb::TableBuilder over internal keys of
+//sequence 0 (InternalKey(user_key, 0, kTypeValue).Encode()), sorted and not overlapping each other.
+//They are copied into slots and added to the last level; the memtable, the WAL and the compactions do
+//not see the data. Sequence 0 is older than everything in the db, so the last level is the only level
+//where they do not shadow newer data after a compaction: a table overlapping it is refused. A compaction
+into the last level installs outputs picked before the ingest, so the check and the edit wait for the
+running compaction and keep the next ones out.
+Status DBImpl::IngestTables(const std::vector<std::string>& paths) {
+	const int level = config::kNumLevels - 1;
+	std::vector<FileMetaData> files;
+	Status s;
+
+	MutexLock l(&mutex_);
+	for (size_t i = 0; i < paths.size() && s.ok(); i++) {
+		FileMetaData f;
+		f.number = versions_->NewFileNumber();
+		pending_outputs_.insert(f.number);
+		files.push_back(f);
+		mutex_.Unlock();
+		FileMetaData& out = files.back();
+		if (LDS_IngestTable(env_, paths[i], TableFileName(dbname_, out.number), level, &out.file_size) != 0) {
+			s = Status::InvalidArgument(paths[i], "cannot be ingested");
+		} else {
+			//the key range, read through the table cache like for any table
+			Iterator* it = table_cache_->NewIterator(ReadOptions(), out.number, out.file_size);
+			it->SeekToFirst();
+			if (it->Valid()) {
+				out.smallest.DecodeFrom(it->key());
+				it->SeekToLast();
+				out.largest.DecodeFrom(it->key());
+			} else {
+				s = it->status().ok() ? Status::InvalidArgument(paths[i], "empty table") : it->status();
+			}
+			delete it;
+		}
+		mutex_.Lock();
+	}
+
+	while (ingesting_ || bg_compaction_scheduled_) {//another ingest, or a compaction whose outputs could overlap
+		bg_cv_.Wait();
+	}
+	ingesting_ = true;
+	const Comparator* ucmp = internal_comparator_.user_comparator();
+	Version* current = versions_->current();
+	for (size_t i = 0; i < files.size() && s.ok(); i++) {
+		Slice smallest = files[i].smallest.user_key();
+		Slice largest = files[i].largest.user_key();
+		if (current->OverlapInLevel(level, &smallest, &largest)) {
+			s = Status::InvalidArgument(paths[i], "overlaps the last level");
+		}
+		for (size_t j = 0; j < i && s.ok(); j++) {
+			if (ucmp->Compare(smallest, files[j].largest.user_key()) <= 0 &&
+				ucmp->Compare(files[j].smallest.user_key(), largest) <= 0) {
+				s = Status::InvalidArgument(paths[i], "overlaps " + paths[j]);
+			}
+		}
+	}
+	if (s.ok()) {
+		VersionEdit edit;
+		for (size_t i = 0; i < files.size(); i++) {
+			edit.AddFile(level, files[i].number, files[i].file_size, files[i].smallest, files[i].largest);
+		}
+		s = versions_->LogAndApply(&edit, &mutex_);
+	}
+	for (size_t i = 0; i < files.size(); i++) {
+		pending_outputs_.erase(files[i].number);
+		if (!s.ok()) {
+			env_->DeleteFile(TableFileName(dbname_, files[i].number));//gives the slots back
+		}
+	}
+	ingesting_ = false;
+	MaybeScheduleCompaction();
+	bg_cv_.SignalAll();//a waiting ingest
+	return s;
+}
+
+//db.h: declare in class DB (with an implementation returning Status::NotSupported in the other DBs)
+//	virtual Status WarmTables(const std::vector<int>& levels, int threads, bool wait) = 0;
+//db_impl.h: declare in class DBImpl
+//	virtual Status WarmTables(const std::vector<int>& levels, int threads, bool wait);
+//	struct WarmState;
+//	static void WarmWorker(void* arg);
+//	WarmState* warm_;//the warmup running, or NULL (mutex_)
+//	uint64_t warm_total_, warm_done_, warm_errors_, warm_bytes_, warm_micros_;//of the last warmup (mutex_)
+//	(all set to 0/NULL in the constructor)
+//db_impl.cc, DBImpl::~DBImpl: after "while (bg_compaction_scheduled_) { bg_cv_.Wait(); }"
+//	while (warm_ != NULL) { bg_cv_.Wait(); }//the workers stop at the next table once shutting_down_ is set
+//db_impl.cc, DBImpl::GetProperty: progress of the warmup
+//	} else if (in == "warmup") {
+//		char buf[200];
+//		snprintf(buf, sizeof(buf), "tables=%llu done=%llu errors=%llu bytes=%llu micros=%llu running=%d\n",
+//			(unsigned long long)warm_total_, (unsigned long long)warm_done_, (unsigned long long)warm_errors_,
+//			(unsigned long long)warm_bytes_, (unsigned long long)warm_micros_, warm_ != NULL);
+//		value->append(buf);
+//		return true;
+//
+//db_impl.cc: after a restart the first read of every table pays for its open (locating the table,
+//the mapping, the faults on the footer and the index). The warmup opens the live tables of the
+//given levels into the table cache on threads workers: LDS_WarmTable reads the tail of each table
+//from its end in one large read into the LDS metadata cache, then the open reads it from memory.
+//With wait the call returns when all are open (before serving traffic), else it returns at once and
+//the warmup runs alongside; "leveldb.warmup" reports the progress, the info log every tenth of it.
+//The tables beyond the capacity of the table cache are not opened, they would evict the first ones.
+struct DBImpl::WarmState {
+	DBImpl* db;
+	Version* version;//Ref'd until the last worker is done, so its tables are not deleted
+	std::vector<FileMetaData*> files;
+	size_t next;//(db->mutex_)
+	int running;//(db->mutex_)
+	uint64_t start_micros;
+};
+
+Status DBImpl::WarmTables(const std::vector<int>& levels, int threads, bool wait) {
+	MutexLock l(&mutex_);
+	if (warm_ != NULL) {
+		return Status::InvalidArgument("a warmup is running");
+	}
+	WarmState* w = new WarmState;
+	w->db = this;
+	w->version = versions_->current();
+	w->version->Ref();
+	const size_t capacity = options_.max_open_files > 10 ? options_.max_open_files - 10 : 1;//TableCacheSize()
+	for (size_t i = 0; i < levels.size(); i++) {
+		if (levels[i] < 0 || levels[i] >= config::kNumLevels) {
+			continue;
+		}
+		std::vector<FileMetaData*> inputs;
+		w->version->GetOverlappingInputs(levels[i], NULL, NULL, &inputs);
+		for (size_t j = 0; j < inputs.size() && w->files.size() < capacity; j++) {
+			w->files.push_back(inputs[j]);
+		}
+	}
+	w->next = 0;
+	w->running = threads < 1 ? 1 : threads > (int)w->files.size() ? (int)w->files.size() : threads;
+	w->start_micros = env_->NowMicros();
+	warm_ = w;
+	warm_total_ = w->files.size();
+	warm_done_ = warm_errors_ = warm_bytes_ = warm_micros_ = 0;
+	if (w->files.empty()) {
+		w->version->Unref();
+		delete w;
+		warm_ = NULL;
+		return Status::OK();
+	}
+	Log(options_.info_log, "warmup: %llu tables on %d threads", (unsigned long long)warm_total_, w->running);
+	for (int i = 0; i < w->running; i++) {
+		env_->StartThread(&DBImpl::WarmWorker, w);
+	}
+	while (wait && warm_ != NULL) {
+		bg_cv_.Wait();
+	}
+	return Status::OK();
+}
+
+void DBImpl::WarmWorker(void* arg) {
+	WarmState* w = reinterpret_cast<WarmState*>(arg);
+	DBImpl* db = w->db;
+	MutexLock l(&db->mutex_);
+	while (w->next < w->files.size() && !db->shutting_down_.Acquire_Load()) {
+		FileMetaData* f = w->files[w->next++];
+		db->mutex_.Unlock();
+		uint64_t bytes = 0;
+		LDS_WarmTable(db->env_, TableFileName(db->dbname_, f->number), &bytes);
+		//opens the table into the table cache, the iterator reads no data block
+		Iterator* it = db->table_cache_->NewIterator(ReadOptions(), f->number, f->file_size);
+		Status s = it->status();
+		delete it;
+		db->mutex_.Lock();
+		db->warm_done_++;
+		db->warm_bytes_ += bytes;
+		if (!s.ok()) {
+			db->warm_errors_++;
+		}
+		if (db->warm_done_ * 10 / db->warm_total_ != (db->warm_done_ - 1) * 10 / db->warm_total_) {
+			Log(db->options_.info_log, "warmup: %llu/%llu tables, %llu bytes read", (unsigned long long)db->warm_done_,
+				(unsigned long long)db->warm_total_, (unsigned long long)db->warm_bytes_);
+		}
+	}
+	if (--w->running == 0) {
+		db->warm_micros_ = db->env_->NowMicros() - w->start_micros;
+		Log(db->options_.info_log, "warmup: done, %llu tables (%llu errors) in %llu ms", (unsigned long long)db->warm_done_,
+			(unsigned long long)db->warm_errors_, (unsigned long long)(db->warm_micros_ / 1000));
+		w->version->Unref();
+		db->warm_ = NULL;
+		delete w;
+		db->bg_cv_.SignalAll();
+	}
+}
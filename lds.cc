@@ -1,24 +1,42 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "db/lds_io.h"
+#include "db/lds_trace.h"
+#include "db/lds_scrub.h"
+#include "db/lds_ns.h"
+#include "util/coding.h" //in LevelDB
+#include "util/crc32c.h" //in LevelDB
 
 extern int  is_storage_inited;
 
+//the slots of the first LDS (LDS::slots), for the callers of Alloc_slot without an LDS
 char * OnlineMap;
 uint64_t SlotTotal;
+uint64_t SlotBase=VERSION_LOG_SIZE + BACKUP_SIZE;//device offset of slot 0, 0 when the logs have their own device
 
 namespace leveldb{
 
+LDS_Options lds_options;
 
-LDS::LDS(const std::string& storage_path){
+LDS::LDS(const std::string& storage_path) : options(lds_options) {
+	if(!options.trace_path.empty() && lds_tracer==NULL){
+		LDS_TraceStart(options.trace_path);
+	}
 	int res=Storage_init(storage_path);//
 
 }
 
-LDS::LDS(const std::string& storage_path, int flash_using_exist){
+LDS::LDS(const std::string& storage_path, int flash_using_exist) : options(lds_options) {
 	int res;
 
+	if(!options.trace_path.empty() && lds_tracer==NULL){
+		LDS_TraceStart(options.trace_path);
+	}
+
 	res=Storage_init(storage_path);//
 	//if(flash_using_exist==0){
 	//	res=Storage_init(storage_path);//
@@ -34,28 +52,55 @@ LDS::LDS(const std::string& storage_path, int flash_using_exist){
 
 }
 
-LDS_Log::LDS_Log(std::string name){
+LDS::~LDS(){
+	delete scrubber;//stops and joins its threads before what they read goes away
+	delete sealed_cache;
+	delete meta_cache;
+	delete limiter;
+	delete memory;
+	if(dev_read_only!=NULL && dev_read_only!=MAP_FAILED){
+		dev->Unmap(dev_read_only, size);
+	}
+	Slot_map_free(&slots);
+	pthread_mutex_destroy(&mu);
+}
+
+LDS_Log::LDS_Log(std::string name, uint64_t ring_bytes){
 		write_head=0;//indicates the current position to append in LDS buffer
+		reserve_head=0;
 		flush_offset= 0;//indicates the current position from which (until ot the write_head) needs to be flush to OS buffer
 		sync_offset=0;//indicates the current position from which (until the flush_offset) needs to be flush to the disk
+		pthread_mutex_init(&flush_mu, NULL);
 		file_name=name;
 		size=0;		
+		sn=0;
 		
 		read_buf=NULL;
 		read_offset=0;
+		payload_pos=0;
+		payload_left=0;
+		lds=NULL;
+		dev=NULL;
 		
 
 
 
-		//this->buffer=(char *)malloc(SEGMENT_BYTES);
+		//only the device holds the whole area, a writer keeps a small ring of it
+		buffer=NULL;
+		tail_page=NULL;
+		polled=false;
+		ring_size=0;
+		if(ring_bytes>0){
+			ring_size= ring_bytes<LOG_RING_MIN ? LOG_RING_MIN : (ring_bytes+4095)/4096*4096;
+			posix_memalign(&(this->buffer),4096,ring_size);//in order for direct IO.
+			posix_memalign(&(this->tail_page),4096,4096);
+		}
 		if(name.find("MANIFEST")!=-1){
-			posix_memalign(&(this->buffer),512,VERSION_LOG_SIZE);//in order for direct IO.
 			phy_offset=0;
 			load_size=VERSION_LOG_SIZE;
 			
 		}
 		else if(name.find(".log")!=-1){
-			posix_memalign(& (this->buffer) ,512, BACKUP_SIZE);//in order for direct IO.
 			phy_offset= VERSION_LOG_SIZE;
 
 			load_size=BACKUP_SIZE;
@@ -64,18 +109,28 @@ LDS_Log::LDS_Log(std::string name){
 
 }
 
-LDS_Slot::LDS_Slot(std::string name){
+LDS_Slot::LDS_Slot(std::string name, bool buffered){
 		write_head=0;
 		flush_offset= 0;
 		sync_offset=0;	
 		file_name=name;
 		size=0;
 		
-		posix_memalign(&(this->buffer),512,SLOT_SIZE);//in order for direct IO.
+		buffer=NULL;
+		map=NULL;
+		if(buffered){
+			//page aligned for direct IO, and mapped rather than allocated: LDS_SealedCache may map
+			//the device over the pages of a buffer it evicts
+			buffer=mmap(NULL, SLOT_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+			if(buffer==MAP_FAILED){
+				fprintf(stderr,"lds.cc, LDS_Slot, cannot allocate the slot buffer of %s, exit\n", name.c_str());
+				exit(9);
+			}
+		}
 		
 		std::string short_file_name=name;
 		//printf("in tools.c 111 short_file_name=%s\n",short_file_name.c_str());
-		if(short_file_name.find("/dev/")!=-1){		
+		if(short_file_name.find("/")!=-1){//the db name is a device path, a file or a simulated device spec
 			int found=name.find_last_of("/");
 			//printf("%s ,%s \n",long_file_name.c_str(),long_file_name.substr(found+1).c_str());
 			 short_file_name=name.substr(found+1);
@@ -84,37 +139,82 @@ LDS_Slot::LDS_Slot(std::string name){
 		
 		//printf("lds.cc LDS_Slot, short_file_name=%s\n",short_file_name.c_str());
 		//exit(9);
-		uint64_t number=atoi(short_file_name.c_str());
+		number=atoi(short_file_name.c_str());
+		lds=NULL;
 		
 		
-		phy_offset = VERSION_LOG_SIZE + BACKUP_SIZE+ number * SLOT_SIZE;
+		//the file number is mapped to its slot by modulo, see Alloc_slot
+		phy_offset = SlotBase+ (number % SlotTotal) * SLOT_SIZE;
+		seg_offset = phy_offset;
+
+		//the slot header goes in front of the data, the buffer has room for it
+		data_offset=SLOT_HEADER_SIZE;
+		write_head=SLOT_HEADER_SIZE;
+		flush_offset=SLOT_HEADER_SIZE;
+		crc=0;
+		level=-1;
+		gathered=false;
+		charged=false;
+		sealed=false;
 
 }
 
-LDS_Slot * LDS::alloc_slot(const std::string& chunk_name){
+LDS_Slot * LDS::alloc_slot(const std::string& chunk_name, bool writer){
 
-	LDS_Slot *slot=new LDS_Slot(chunk_name);
+	//a writer gets a slot buffer if the memory budget has room for it, else it streams
+	//the table through a mapping of its slots like the mmap write mode
+	bool mapped= writer && options.mmap_writes;
+	bool charged=false;
+	if(writer && !mapped){
+		if(sealed_cache!=NULL && !memory->Fits(SLOT_SIZE)){
+			sealed_cache->Evict(SLOT_SIZE);//fresh tables are only kept while memory is left
+		}
+		charged=memory->Reserve(LDS_MEM_SLOT_BUFFER, SLOT_SIZE);
+		if(!charged){
+			mapped=true;
+			memory->NoteStreamed();
+		}
+	}
+	LDS_Slot *slot=new LDS_Slot(chunk_name, writer && !mapped);
+	slot->charged=charged;
 	
 	
 	
 
-	slot->fd=this->slot_fd;
+	slot->dev=this->dev;
+	slot->lds=this;
+	slot->phy_offset=slot_offset(home_slot(slot->number));//in the slots of this LDS
+	slot->seg_offset=slot->phy_offset;
+	if(writer){
+		reserve_slot(home_slot(slot->number));
+	}
+
+	if(mapped){
+		//the table bytes go straight to the page cache of the slot, Slot_flush has nothing to copy
+		slot->map=(char*)dev->MapWritable(slot->phy_offset, SLOT_SIZE);
+		if(slot->map==NULL){
+			fprintf(stderr,"lds.cc, alloc_slot, cannot map slot of %s, exit\n", chunk_name.c_str());
+			exit(9);
+		}
+		slot->buffer=slot->map;
+	}
 	
 	return slot;
 
 }
 
-LDS_Log * LDS::alloc_log(const std::string& name){
+LDS_Log * LDS::alloc_log(const std::string& name, bool writer){
 
-	LDS_Log *log=new LDS_Log(name);
+	LDS_Log *log=new LDS_Log(name, !writer ? 0 : options.log_ring_bytes>0 ? options.log_ring_bytes : LOG_RING_MIN);
 	//printf("lds.cc, alloc_log, dev_fd=%d\n", this->dev_fd);
 	//exit(9);
-	if(name.find("MANIFEST")!=-1){
-		log->fd=this->version_fd;
-	}	
-	else if(name.find(".log")!=-1){
-		log->fd=this->backup_fd;
-	}	
+	log->dev=this->log_dev;//both the version area and the backup area are on the log device
+	log->phy_offset+=log_base;
+	log->lds=this;
+	log->polled= writer && options.wal_polled_io && name.find(".log")!=-1;
+	if(log->buffer!=NULL){
+		memory->Charge(LDS_MEM_LOG_RING, log->ring_size+ 4096);//and the tail page, released by Log_close
+	}
 	return log;
 
 
@@ -143,61 +243,564 @@ LDS_Log * LDS::alloc_log(const std::string& name){
 
 int LDS:: Storage_init(const std::string& storage_path){
 
-	int fd=-1;
-	int fd1=-1;
-	int fd2=-1;
-	int fd3=-1;
-	fd=open(storage_path.c_str(),O_RDWR);
-	fd1=open(storage_path.c_str(),O_RDWR);
-	fd2=open(storage_path.c_str(),O_RDWR);
-	fd3=open(storage_path.c_str(),O_RDWR);
-
-	printf("lds.cc, Storage_init, fd=%d,fd2=%d.fd3=%d\n",fd,fd2,fd3);
-	//exit(9);
+	pthread_mutex_init(&mu, NULL);
+	current_pack=-1;
 
-	if(fd<0){
-		printf("lds.cc, Storage_init, open error,exit\n");
-		exit(0);
+	limiter=NULL;
+	if(options.compaction_rate_bytes>0 || options.io_priority){
+		limiter=new LDS_RateLimiter(options.compaction_rate_bytes, options.io_priority, options.rate_auto_tune, options.foreground_latency_us);
+	}
+	memory=new LDS_MemBudget(options.memory_budget_bytes);
+	meta_cache= options.meta_cache_bytes>0 ? new LDS_MetaCache(options.meta_cache_bytes, memory) : NULL;
+
+	//"path#name" is the namespace name of the device at path (lds_ns.h)
+	std::string path=storage_path;
+	size_t hash=storage_path.find('#');
+	if(hash!=std::string::npos){
+		path=storage_path.substr(0, hash);
+		ns_name=storage_path.substr(hash+1);
 	}
-	uint64_t blk64;
+	this->dev=LDS_SharedDevice(path);//real device, pre-allocated file or simulated device
+	sealed_cache= options.sealed_cache_bytes>0 ? new LDS_SealedCache(options.sealed_cache_bytes, memory, dev) : NULL;
+	uint64_t blk64=dev->Size();
 	
-	if(storage_path.find("/dev/")!=-1){//the path is the raw device
-		ioctl(fd, BLKGETSIZE64, &blk64);//reture the size in bytes . This result is real
+	printf("lds.cc, Storage_init, %s, device size=【%llu GB】\n",dev->Name().c_str(),blk64/1024/1024/1024);
+
+	//the region of the device this LDS uses
+	LDS_Namespace ns;
+	ns.offset=0;
+	ns.size=blk64;
+	ns.index=0;
+	if(!ns_name.empty()){
+		LDS_Device *ns_log_dev= options.log_path.empty() ? NULL : LDS_SharedDevice(options.log_path);
+		if(LDS_OpenNamespace(dev, ns_name, options.namespace_bytes, &ns, ns_log_dev)!=0){
+			fprintf(stderr,"lds.cc, Storage_init, cannot open namespace %s, exit\n", ns_name.c_str());
+			exit(9);
+		}
+		printf("lds.cc, Storage_init, namespace %s at %llu MB\n", ns_name.c_str(), (unsigned long long)(ns.offset>>20));
 	}
-	else{//the path should be a pre-allocated file
-		blk64=lseek(fd, 0, SEEK_END)+1;
-		lseek(fd, 0, SEEK_SET)+1;	
+	else if(LDS_HasNamespaces(dev)){
+		fprintf(stderr,"lds.cc, Storage_init, %s holds namespaces, open one with %s#<name>, exit\n", path.c_str(), path.c_str());
+		exit(9);
+	}
+
+	if(options.log_path.empty()){
+		this->log_dev=dev;
+		this->log_base=ns.offset;
+		this->slot_base=ns.offset+ VERSION_LOG_SIZE + BACKUP_SIZE;
+	}
+	else{
+		//a small low-latency device for the MANIFEST and the WAL, its syncs never wait behind slot writes
+		this->log_dev=LDS_SharedDevice(options.log_path);
+		this->log_base=(uint64_t)ns.index*(VERSION_LOG_SIZE + BACKUP_SIZE);//the areas of the namespaces follow each other
+		if(log_dev->Size() < log_base+ VERSION_LOG_SIZE + BACKUP_SIZE){
+			fprintf(stderr,"lds.cc, Storage_init, log device %s is smaller than %llu MB, exit\n", log_dev->Name().c_str(),
+				(unsigned long long)((log_base+ VERSION_LOG_SIZE + BACKUP_SIZE)>>20));
+			exit(9);
+		}
+		printf("lds.cc, Storage_init, log device %s\n",log_dev->Name().c_str());
+		this->slot_base=ns.offset;
+	}
+	if(ns.offset+ns.size < slot_base+ SLOT_SIZE){
+		fprintf(stderr,"lds.cc, Storage_init, no room for slots in %s, exit\n", storage_path.c_str());
+		exit(9);
 	}
 	
-	
-	printf("lds.cc, Storage_init,, device size=【%llu GB】\n",blk64/1024/1024/1024);
-	
-	this->dev_read_only=( char *)mmap(NULL,blk64 ,PROT_READ, MAP_SHARED,fd,0);
+	this->size=blk64;//of the device at open, the extent of dev_read_only
+	this->dev_read_only=( char *)dev->Map(0, blk64);
 	printf("lds.cc, Storage_init, dev_read_only=%p\n",dev_read_only);
 
-	this->version_fd=fd1;
-	this->backup_fd=fd2;
-	this->slot_fd=fd3;
-
-	this->slot_amount = ( (blk64) - VERSION_LOG_SIZE - BACKUP_SIZE) /SLOT_SIZE ;
-
-	//printf("lds.cc, Storage_init, slot_amount=%d %d %d\n",this->slot_amount,(blk64/1024/1024),( (VERSION_LOG_SIZE + BACKUP_SIZE)/1024/1024/SLOT_SIZE ));
+	this->slot_amount = ( ns.offset+ns.size - slot_base) /SLOT_SIZE ;
 
 	printf("lds.cc, Storage_init, slot_amount=%llu\n",this->slot_amount);
 
-	SlotTotal= this->slot_amount;
-	//exit(9);
-	OnlineMap = (char*) malloc(slot_amount);//now we use one byte for a slot, but one bit is enough
-	memset(OnlineMap, 0, slot_amount);
+	Slot_map_init(&slots, slot_amount, slot_base);//the first LDS also serves Alloc_slot
+
+	if(ns_name.empty() && dynamic_cast<LDS_FileDevice*>(dev)!=NULL){
+		//a file can grow, the slot counts it went through are kept next to it
+		if(Slot_map_load(&slots, dev->Name()+".slots", slot_amount)!=0){
+			fprintf(stderr,"lds.cc, Storage_init, cannot load the slot epochs of %s, exit\n", dev->Name().c_str());
+			exit(9);
+		}
+		if(slots.total!=slot_amount){
+			printf("lds.cc, Storage_init, %d slot epochs, %llu slots in use, %llu after the pending grow\n",
+				slots.epoch_count.load(), (unsigned long long)slots.total, (unsigned long long)slot_amount);
+			slot_amount=slots.total;
+		}
+	}
 
 	//exit(0);
 
+	LDS_recover(storage_path);//before any slot is handed out
+
+	scrubber=NULL;
+	if(options.scrub_threads>0){
+		scrubber=new LDS_Scrubber(this, options.scrub_threads, options.scrub_rate_bytes, options.scrub_quarantine);
+		scrubber->Start(options.scrub_interval_sec);
+	}
+
+	return 0;
 	
-	
+}
+
+//the headers of a range of slots, read by one thread of LDS_recover
+struct LDS_RecoverPart{
+	LDS *lds;
+	uint64_t begin, end;
+	std::vector<std::pair<uint64_t, LDS_SlotHeader> > tables;//home slot and header of the tables found
+	std::map<uint64_t, LDS_PackedTable> packed;
+	std::map<uint64_t, LDS_PackSlot> pack_slots;
+};
+
+static void *LDS_RecoverMain(void *arg){
+	LDS_RecoverPart *part=(LDS_RecoverPart*)arg;
+	LDS *lds=part->lds;
+	void *header;
+	posix_memalign(&header, PACK_ALIGN, PACK_HEADER_SIZE);
+	for(uint64_t i=part->begin; i<part->end; i++){
+		if(lds->dev->Read(lds->slot_offset(i), header, PACK_HEADER_SIZE)!=PACK_HEADER_SIZE){
+			continue;
+		}
+		const char *h=(const char*)header;
+		LDS_SlotHeader sh;
+		if(Slot_decode_header(h, &sh)==0 && lds->home_slot(sh.number)==i){
+			part->tables.push_back(std::make_pair(i, sh));
+			continue;
+		}
+		LDS_PackSlot ps;
+		if(memcmp(h, PACK_MAGIC, 4)==0 && lds->scan_pack_slot(i, header, &part->packed, &ps)){
+			part->pack_slots[i]=ps;
+		}
+	}
+	free(header);
+	return NULL;
 }
 
 int LDS:: LDS_recover(const std::string& storage_path){
+	//rebuild the online map: the tables with a slot header in their home slot and its chain, and the pack slots with
+	//their live tables. The slots are not recorded elsewhere, so every slot is checked: the reads are spread over
+	//LDS_RECOVER_THREADS threads, each on a range of slots, so the device sees many of them at once.
+	uint64_t threads= slot_amount < LDS_RECOVER_THREADS ? slot_amount : LDS_RECOVER_THREADS;
+	std::vector<LDS_RecoverPart> parts(threads);
+	std::vector<pthread_t> workers(threads);
+	for(uint64_t t=0; t<threads; t++){
+		parts[t].lds=this;
+		parts[t].begin=slot_amount*t/threads;
+		parts[t].end=slot_amount*(t+1)/threads;
+		pthread_create(&workers[t], NULL, &LDS_RecoverMain, &parts[t]);
+	}
+
+	uint64_t found=0, tables=0;
+	for(uint64_t t=0; t<threads; t++){
+		pthread_join(workers[t], NULL);
+		LDS_RecoverPart& part=parts[t];
+		for(size_t k=0; k<part.tables.size(); k++){
+			const LDS_SlotHeader& sh=part.tables[k].second;
+			slots.online[part.tables[k].first]=1;
+			for(size_t c=0; c<sh.chain.size(); c++){//its continuation slots, before Slot_extend can take them
+				if(sh.chain[c]<slots.total){
+					slots.online[sh.chain[c]]=1;
+				}
+			}
+			char name[32];
+			snprintf(name, sizeof(name), "%06llu.ldb", (unsigned long long)sh.number);
+			files.insert(name);//listed by GetChildren, so the db deletes it if it is not live any more
+			tables++;
+		}
+		for(std::map<uint64_t, LDS_PackedTable>::iterator it=part.packed.begin(); it!=part.packed.end(); ++it){
+			packed[it->first]=it->second;
+			char name[32];
+			snprintf(name, sizeof(name), "%06llu.ldb", (unsigned long long)it->first);
+			files.insert(name);
+		}
+		for(std::map<uint64_t, LDS_PackSlot>::iterator it=part.pack_slots.begin(); it!=part.pack_slots.end(); ++it){
+			pack_slots[it->first]=it->second;
+			slots.online[it->first]=1;
+			found+=it->second.live;
+		}
+	}
+	printf("lds.cc, LDS_recover, %llu tables with a slot header, %llu packed tables in %zu pack slots\n",
+		(unsigned long long)tables, (unsigned long long)found, pack_slots.size());
+	return 0;
+}
+
+bool LDS::scan_pack_slot(uint64_t slot_index, void *page, std::map<uint64_t, LDS_PackedTable> *live, LDS_PackSlot *ps){
+	uint64_t generation=0, off=0;
+	ps->live=0;
+	while(off + PACK_HEADER_SIZE <= SLOT_SIZE){
+		if(dev->Read(slot_offset(slot_index)+off, page, PACK_HEADER_SIZE)!=PACK_HEADER_SIZE){
+			break;
+		}
+		const char *h=(const char*)page;
+		if(memcmp(h, PACK_MAGIC, 4)!=0){
+			break;
+		}
+		if(off==0){
+			generation=DecodeFixed64(h+8);
+		}
+		else if(DecodeFixed64(h+8)!=generation){
+			break;//left from an earlier use of the slot
+		}
+		uint64_t number=DecodeFixed64(h+16);
+		uint64_t size=DecodeFixed64(h+24);
+		if(DecodeFixed32(h+4)==PACK_LIVE){
+			LDS_PackedTable t;
+			t.slot=slot_index;
+			t.offset=off+PACK_HEADER_SIZE;
+			t.size=size;
+			(*live)[number]=t;
+			ps->live++;
+		}
+		off+= PACK_HEADER_SIZE + (size+PACK_ALIGN-1)/PACK_ALIGN*PACK_ALIGN;
+	}
+	ps->generation=generation;
+	ps->write_offset=off;
+	return ps->live>0;
+}
+
+static void encode_pack_header(char *h, uint32_t state, uint64_t generation, uint64_t number, uint64_t size, uint32_t crc){
+	memset(h, 0, PACK_HEADER_SIZE);
+	memcpy(h, PACK_MAGIC, 4);
+	EncodeFixed32(h+4, state);
+	EncodeFixed64(h+8, generation);
+	EncodeFixed64(h+16, number);
+	EncodeFixed64(h+24, size);
+	EncodeFixed32(h+32, crc!=0 ? crc32c::Mask(crc) : 0);//of the table data, 0 if not known
+}
+
+int LDS::pack_table(LDS_Slot *slot){
+	uint64_t need= PACK_HEADER_SIZE + (slot->size+PACK_ALIGN-1)/PACK_ALIGN*PACK_ALIGN;
+
+	pthread_mutex_lock(&mu);
+	if(current_pack==(uint64_t)-1 || pack_slots[current_pack].write_offset + need > SLOT_SIZE){
+		if(current_pack!=(uint64_t)-1 && pack_slots[current_pack].live==0){//all its tables were deleted while it was filled
+			release_slot(current_pack);
+			pack_slots.erase(current_pack);
+		}
+		int64_t idx=Alloc_free_slot_in(&slots, -1);
+		if(idx<0){
+			fprintf(stderr,"lds.cc, pack_table, storage full,exit!\n");
+			exit(9);
+		}
+		reserve_slot(idx);
+		LDS_PackSlot ps;
+		ps.generation=slot->number;
+		ps.write_offset=0;
+		ps.live=0;
+		pack_slots[idx]=ps;
+		current_pack=idx;
+	}
+	LDS_PackSlot& ps=pack_slots[current_pack];
+	uint64_t off=ps.write_offset;
+	uint64_t generation=ps.generation;
+	ps.write_offset+=need;
+	ps.live++;
+
+	LDS_PackedTable t;
+	t.slot=current_pack;
+	t.offset=off+PACK_HEADER_SIZE;
+	t.size=slot->size;
+	packed[slot->number]=t;
+	pthread_mutex_unlock(&mu);
+
+	//the space is reserved, write outside the lock
+	uint64_t base=slot_offset(t.slot)+off;
+	void *header;
+	posix_memalign(&header, PACK_ALIGN, PACK_HEADER_SIZE);
+	encode_pack_header((char*)header, PACK_LIVE, generation, slot->number, slot->size, slot->crc);
+
+	if(limiter!=NULL){
+		limiter->Request(PACK_HEADER_SIZE+slot->size);
+	}
+	LDS_TRACE_BEGIN(t_write);
+	dev->Write(base, header, PACK_HEADER_SIZE);
+	dev->Write(base+PACK_HEADER_SIZE, (char*)slot->buffer+ slot->data_offset, slot->size);
+	LDS_TRACE(LDS_TRACE_SLOT_FLUSH, LDS_AREA_SLOT, base, PACK_HEADER_SIZE+slot->size, t_write);
+	free(header);
+
+	slot->flush_offset=slot->write_head;
+	int res;
+	if(limiter!=NULL){
+		limiter->Request(0);
+	}
+	res=Sync_range(dev, base, PACK_HEADER_SIZE+slot->size);//now, or with the seal batch of the thread
+	if(res!=0){
+		fprintf(stderr,"lds.cc, pack_table, sync error, exit\n");
+		exit(3);
+	}
+
+	Free_slot_in(&slots, home_slot(slot->number));//the table does not use its own slot
+	return res;
+}
+
+bool LDS::locate_packed(uint64_t number, uint64_t *offset, uint64_t *size){
+	pthread_mutex_lock(&mu);
+	std::map<uint64_t, LDS_PackedTable>::iterator it=packed.find(number);
+	bool found= it!=packed.end();
+	if(found){
+		*offset=slot_offset(it->second.slot)+it->second.offset;
+		*size=it->second.size;
+	}
+	pthread_mutex_unlock(&mu);
+	return found;
+}
+
+void LDS::free_file(uint64_t number, bool table){
+	if(table && meta_cache!=NULL){
+		meta_cache->Erase(number);
+	}
+	if(table && sealed_cache!=NULL){
+		sealed_cache->Erase(number);
+	}
+	if(table && is_quarantined(number)){
+		fprintf(stderr,"lds.cc, free_file, table %llu is quarantined, its slots are not reused\n", (unsigned long long)number);
+		return;
+	}
+	pthread_mutex_lock(&mu);
+	std::map<uint64_t, LDS_PackedTable>::iterator it=packed.find(number);
+	if(it==packed.end()){
+		pthread_mutex_unlock(&mu);
+		if(table){//give back the continuation slots of a large table as well
+			LDS_Slot slot(std::string("0"), false);//only the footer is read
+			slot.phy_offset=slot_offset(home_slot(number));
+			slot.number=number;
+			slot.dev=dev;
+			std::vector<uint64_t> chain;
+			if(read_chain(&slot, read_chunk_size(&slot), &chain)>0){
+				for(size_t i=0; i<chain.size(); i++){
+					release_slot(chain[i]);
+				}
+			}
+		}
+		if(table){
+			clear_header(home_slot(number));
+			release_slot(home_slot(number));
+		}
+		else{
+			Free_slot_in(&slots, home_slot(number));
+		}
+		return;
+	}
+
+	LDS_PackedTable t=it->second;
+	packed.erase(it);
+	LDS_PackSlot& ps=pack_slots[t.slot];
+	ps.live--;
+
+	void *header;
+	posix_memalign(&header, PACK_ALIGN, PACK_HEADER_SIZE);
+	if(ps.live==0 && t.slot!=current_pack){
+		//the whole pack slot is free, invalidate its first header so recovery skips it
+		memset(header, 0, PACK_HEADER_SIZE);
+		dev->Write(slot_offset(t.slot), header, PACK_HEADER_SIZE);
+		pack_slots.erase(t.slot);
+		release_slot(t.slot);
+	}
+	else{
+		encode_pack_header((char*)header, PACK_DEAD, ps.generation, number, t.size, 0);
+		dev->Write(slot_offset(t.slot)+t.offset-PACK_HEADER_SIZE, header, PACK_HEADER_SIZE);
+	}
+	free(header);
+	pthread_mutex_unlock(&mu);
+}
+
+uint64_t LDS::home_slot(uint64_t number){
+	return Home_slot(&slots, number);
+}
+
+void LDS::clear_header(uint64_t slot_index){
+	//a deleted table must not be found again by LDS_recover, its slots may go to other tables
+	void *page;
+	posix_memalign(&page, PACK_ALIGN, SLOT_HEADER_SIZE);
+	memset(page, 0, SLOT_HEADER_SIZE);
+	uint64_t off=slot_offset(slot_index);
+	if(dev->Write(off, page, SLOT_HEADER_SIZE)!=SLOT_HEADER_SIZE || dev->Sync(off, SLOT_HEADER_SIZE)!=0){//not left to a seal batch
+		fprintf(stderr,"lds.cc, clear_header, cannot clear the header of slot %llu, exit\n", (unsigned long long)slot_index);
+		exit(3);
+	}
+	free(page);
+}
+
+void LDS::reserve_slot(uint64_t slot_index){
+	//a slot punched out when it was freed gets its blocks back before a table is written to it,
+	//so the writes never allocate and a full file system shows here rather than as a write error
+	if(options.file_punch_holes && dev->Reserve(slot_offset(slot_index), SLOT_SIZE)!=0){
+		fprintf(stderr,"lds.cc, reserve_slot, cannot reserve slot %llu of %s (%s), exit\n", (unsigned long long)slot_index,
+			dev->Name().c_str(), strerror(errno));
+		exit(9);
+	}
+}
+
+void LDS::release_slot(uint64_t slot_index){
+	//the blocks go back to the file system before the slot can be taken again
+	if(options.file_punch_holes){
+		dev->Discard(slot_offset(slot_index), SLOT_SIZE);
+	}
+	Free_slot_in(&slots, slot_index);
+}
+
+int LDS::grow(uint64_t bytes){
+	if(!ns_name.empty() || slots.epoch_path.empty()){
+		fprintf(stderr,"lds.cc, grow, only a file-backed LDS without namespaces grows\n");
+		return -1;
+	}
+	uint64_t size= dev->Size()+ bytes/SLOT_SIZE*SLOT_SIZE;
+	if(bytes<SLOT_SIZE || dev->Grow(size)!=0){
+		fprintf(stderr,"lds.cc, grow, cannot grow %s by %llu bytes\n", dev->Name().c_str(), (unsigned long long)bytes);
+		return -1;
+	}
+	//the new slots are taken from the next file number allocated on
+	return Slot_map_grow(&slots, (size- slot_base)/SLOT_SIZE);
+}
+
+void LDS::add_file(const std::string& name){
+	pthread_mutex_lock(&mu);
+	files.insert(name);
+	pthread_mutex_unlock(&mu);
+}
+
+void LDS::list_files(std::vector<std::string>* result){
+	pthread_mutex_lock(&mu);
+	result->assign(files.begin(), files.end());
+	pthread_mutex_unlock(&mu);
+}
+
+void LDS::delete_file(const std::string& name){
+	pthread_mutex_lock(&mu);
+	bool known= files.erase(name)>0;
+	pthread_mutex_unlock(&mu);
+	if(!known){
+		return;
+	}
+	//tables, logs and manifests all got their numbers (and slots) from Alloc_slot
+	size_t digits=name.find_first_of("0123456789");
+	if(digits!=std::string::npos){
+		free_file(strtoull(name.c_str()+digits, NULL, 10), name.find(".ldb")!=std::string::npos);
+	}
+}
+
+int LDS::ingest_table(const std::string& src_path, const std::string& fname, int level, uint64_t *size){
+	int fd=open(src_path.c_str(), O_RDONLY);
+	if(fd<0){
+		fprintf(stderr,"lds.cc, ingest_table, cannot open %s\n", src_path.c_str());
+		return -1;
+	}
+	//a table ends with the footer of LevelDB, do not take anything else
+	struct stat st;
+	char footer[LDS_TABLE_FOOTER_SIZE];
+	if(fstat(fd, &st)!=0 || st.st_size<LDS_TABLE_FOOTER_SIZE ||
+		pread(fd, footer, LDS_TABLE_FOOTER_SIZE, st.st_size-LDS_TABLE_FOOTER_SIZE)!=LDS_TABLE_FOOTER_SIZE ||
+		((uint64_t)DecodeFixed32(footer+40) | ((uint64_t)DecodeFixed32(footer+44) << 32))!=LDS_TABLE_MAGIC){
+		fprintf(stderr,"lds.cc, ingest_table, %s is not a table\n", src_path.c_str());
+		close(fd);
+		return -1;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	//slot sized reads, Slot_append writes them from the read buffer in slot aligned pieces
+	void *buf;
+	posix_memalign(&buf, 4096, INGEST_CHUNK);
+	LDS_Slot *slot=alloc_slot(fname);
+	std::string name= fname.find_last_of("/")==std::string::npos ? fname : fname.substr(fname.find_last_of("/")+1);
+	add_file(name);
+	ssize_t n;
+	uint64_t done=0;
+	while(done<(uint64_t)st.st_size && (n=read(fd, buf, INGEST_CHUNK))>0){
+		Slot_append(buf, n, slot);
+		done+=n;
+	}
+	free(buf);
+	close(fd);
+
+	{
+		LDS_TableLevelScope table_level(level);
+		Slot_sync(slot);//sealed even when the read failed, so that delete_file finds all of its slots
+	}
+	Slot_close(slot);
+	if(done!=(uint64_t)st.st_size){
+		fprintf(stderr,"lds.cc, ingest_table, read error of %s\n", src_path.c_str());
+		delete_file(name);
+		return -1;
+	}
+	*size=done;
+	return 0;
+}
+
+bool LDS::get_property(const std::string& property, std::string* value){
+	value->clear();
+	if(property=="lds.io-throttle"){
+		if(limiter==NULL){
+			value->append("disabled\n");
+		}
+		else{
+			limiter->Report(value);
+		}
+		return true;
+	}
+	if(property=="lds.meta-cache"){
+		if(meta_cache==NULL){
+			value->append("disabled\n");
+		}
+		else{
+			meta_cache->Report(value);
+		}
+		return true;
+	}
+	if(property=="lds.sealed-cache"){
+		if(sealed_cache==NULL){
+			value->append("disabled\n");
+		}
+		else{
+			sealed_cache->Report(value);
+		}
+		return true;
+	}
+	if(property=="lds.memory"){
+		memory->Report(value);
+		return true;
+	}
+	if(property=="lds.slots"){
+		char buf[128];
+		pthread_mutex_lock(&slots.mu);
+		uint64_t used=0;
+		for(uint64_t i=0; i<slots.total; i++){
+			used+= slots.online[i]!=0;
+		}
+		snprintf(buf, sizeof(buf), "slots=%llu used=%llu pending=%llu\n", (unsigned long long)slots.total,
+			(unsigned long long)used, (unsigned long long)(slots.grow_to>slots.total ? slots.grow_to-slots.total : 0));
+		value->append(buf);
+		int count=slots.epoch_count.load();
+		for(int i=0; i<count; i++){
+			snprintf(buf, sizeof(buf), "epoch %d: numbers from %llu, %llu slots\n", i,
+				(unsigned long long)slots.epochs[i].first_number, (unsigned long long)slots.epochs[i].amount);
+			value->append(buf);
+		}
+		pthread_mutex_unlock(&slots.mu);
+		return true;
+	}
+	if(property=="lds.scrub"){
+		if(scrubber==NULL){
+			value->append("disabled\n");
+		}
+		else{
+			scrubber->Report(value);
+		}
+		return true;
+	}
+	return false;
+}
+
+void LDS::quarantine(uint64_t number){
+	pthread_mutex_lock(&mu);
+	quarantined.insert(number);
+	pthread_mutex_unlock(&mu);
+}
 
+bool LDS::is_quarantined(uint64_t number){
+	pthread_mutex_lock(&mu);
+	bool res= quarantined.count(number)>0;
+	pthread_mutex_unlock(&mu);
+	return res;
 }
 
 
@@ -18,6 +18,16 @@
 #include <vector>
 #include <list>
 #include <set>
+#include <map>
+
+#include <pthread.h>
+
+#include <atomic>
+
+#include "db/lds_dev.h"
+#include "db/lds_ratelimit.h"
+#include "db/lds_cache.h"
+#include "db/lds_mem.h"
 
 // #define OPEN_ARG
 
@@ -46,9 +56,102 @@
 #define VERSION_LOG_SIZE 0x4000000 //100 0000 0000 0000 0000 0000 0000 //64MB
 #define SLOT_SIZE 4194304	//4MB
 #define BACKUP_SIZE (SLOT_SIZE*4)
+#define LOG_RING_MIN (64*1024) //smallest write ring of a log
+#define INGEST_CHUNK SLOT_SIZE //read size of ingest_table, written out from the read buffer
+#define LDS_WARM_READ (256*1024) //first read of LDS_WarmTable from the end of the table, doubled until the tail is in
+#define LDS_RECOVER_THREADS 16 //LDS_recover reads the slot headers with this many threads, to keep the device queue full
+
+//a pack slot holds several small tables, each one is [PACK_HEADER_SIZE header][table data, padded to PACK_ALIGN]
+#define PACK_HEADER_SIZE 4096
+#define PACK_ALIGN 4096
+#define PACK_MAGIC "LDSP"
+#define PACK_LIVE 1
+#define PACK_DEAD 2
+//the pack header: magic[4], state[4], generation[8], number[8], size[8], data crc[4] (0 if not recorded)
+
+//a table starts with the slot header, written with the table data in one I/O when the table is sealed:
+//magic[4], version[4], number[8], size[8], level[4], count[4], data crc[4], header crc[4], slot index[8]*count
+//A table larger than a slot continues in other slots, the header lists them.
+#define SLOT_HEADER_SIZE 4096
+#define SLOT_HEADER_MAGIC "LDSH"
+#define SLOT_HEADER_VERSION 1
+#define CHAIN_MAX ((SLOT_HEADER_SIZE-40)/8)
+//slots written before the slot header hold a table of at most SLOT_SIZE-8 bytes and end with its
+//8-byte size. They are still read.
 
 namespace leveldb {
 
+class LDS;
+class LDS_Scrubber;
+
+//Options of LDS. LDSEnv uses the global lds_options (lds.cc), set it before the Env is created.
+struct LDS_Options{
+	std::string trace_path;//if not empty, LDS operations are traced to this file (see lds_trace.h)
+
+	std::string log_path;//if not empty, the version (MANIFEST) and backup (.log) areas live on this device,
+	                     //and the slots start at offset 0 of the db device
+
+	uint64_t pack_threshold;//tables up to this size share pack slots, 0 gives every table its own slot
+
+	//compaction I/O (slot flushes and syncs) against foreground I/O (WAL and MANIFEST), see lds_ratelimit.h
+	uint64_t compaction_rate_bytes;//bytes per second of slot writes, 0 is unlimited
+	bool rate_auto_tune;//adjust the rate to keep the foreground latency near the target
+	uint64_t foreground_latency_us;//the target of the auto tuning
+	bool io_priority;//slot I/O waits while WAL or MANIFEST I/O is in flight
+
+	bool mmap_writes;//tables are written straight into a shared writable mapping of their slots, no slot buffer
+
+	uint64_t meta_cache_bytes;//memory for the index/filter/footer of sealed tables (see lds_cache.h), 0 disables it
+
+	uint64_t log_ring_bytes;//write buffer of a MANIFEST or WAL writer, recycled once flushed (multiple of 4KB)
+	bool wal_polled_io;//WAL flushes and syncs go around the OS buffer and poll for their completion (LDS_Device::WritePolled)
+
+	//background verification of the tables and the log areas, see lds_scrub.h
+	int scrub_threads;//0 disables the scrubber
+	uint64_t scrub_rate_bytes;//bytes per second read by all the scrub threads, 0 is unlimited
+	uint64_t scrub_interval_sec;//between the starts of two passes
+	bool scrub_quarantine;//tables found bad cannot be opened, and their slots are not reused
+
+	uint64_t namespace_bytes;//size of a namespace created by its first open ("path#name", see lds_ns.h), 0 creates none
+
+	uint64_t memory_budget_bytes;//slot buffers, log rings and caches of one LDS, mappings only reported (see lds_mem.h), 0 only counts
+
+	//tables read from start to end (NewSequentialFile, for repair and dump tools)
+	uint64_t seq_readahead_bytes;//size of each device read, multiple of 4KB
+	bool seq_read_direct;//the reads bypass the OS buffer (O_DIRECT on a block device)
+
+	uint64_t sealed_cache_bytes;//slot buffers of freshly sealed tables kept to serve their reads (see lds_cache.h), 0 disables it, at least 8MB
+
+	bool file_punch_holes;//the slots a file-backed LDS frees are punched out of the file (LDS_Device::Discard), and reserved again when taken
+
+	LDS_Options() : pack_threshold(0), compaction_rate_bytes(0), rate_auto_tune(false), foreground_latency_us(2000), io_priority(false),
+		mmap_writes(false), meta_cache_bytes(0), log_ring_bytes(1<<20), wal_polled_io(false), scrub_threads(0), scrub_rate_bytes(16<<20), scrub_interval_sec(3600), scrub_quarantine(false),
+		namespace_bytes(0), memory_budget_bytes(0), seq_readahead_bytes(2<<20), seq_read_direct(false),
+		sealed_cache_bytes(0), file_punch_holes(true) { }
+};
+
+extern LDS_Options lds_options;
+
+class Env;
+
+//LDS::get_property of the LDS of env, an Env of LDS_NewEnv or Env::Default() (env_lds.cc)
+bool LDS_GetProperty(Env *env, const std::string& property, std::string* value);
+
+//an Env of its own on path, e.g. "/dev/nvme0n1#shard7" for a namespace of the device (env_lds.cc).
+//Env::Default() is the one on dev_name.
+Env *LDS_NewEnv(const std::string& path);
+
+//LDS::ingest_table of the LDS of env, the Env the table number was allocated from (env_lds.cc)
+int LDS_IngestTable(Env *env, const std::string& src_path, const std::string& fname, int level, uint64_t *size);
+
+//reads the tail of table fname (filter, metaindex, index, footer) of the LDS of env into its metadata
+//cache, or into the OS buffer without one, so that opening the table does not fault it in; *bytes read.
+//0, or -1 if the table cannot be located or read (env_lds.cc)
+int LDS_WarmTable(Env *env, const std::string& fname, uint64_t *bytes);
+
+//LDS::grow of the LDS of env, an Env of LDS_NewEnv or Env::Default() (env_lds.cc)
+int LDS_GrowStorage(Env *env, uint64_t bytes);
+
 class LDS_Slot{
 public:
 	char * addr;//physical address;//mmaped address
@@ -62,15 +165,33 @@ public:
 	uint64_t flush_offset;//for flush to OS buffer
 	uint64_t sync_offset;//for sync to disk
 
-	void *buffer;//buffer data in  userspace 
+	void *buffer;//buffer data in  userspace, or the mapping of the slot being filled in the mmap write mode
+	char *map;//mapping of the first slot in the mmap write mode, NULL when buffered
 	
-	int fd;
+	LDS_Device *dev;
+	LDS *lds;
+
+	uint64_t number;//file number
+
+	std::vector<uint64_t> chain;//continuation slots of a table larger than a slot
+	std::vector<char*> chain_maps;//their mappings in the mmap write mode
+	uint64_t seg_offset;//device offset of the slot being filled, write_head/flush_offset are relative to it
+
+	uint64_t data_offset;//of the table in its first slot, SLOT_HEADER_SIZE (0 for a slot without header)
+	uint32_t crc;//crc32c of the table data written so far
+	int level;//recorded in the header, -1 if unknown
+
+	bool gathered;//some data went out from the caller buffers (Slot_append), not through the buffer
+	bool charged;//the buffer is counted in LDS::memory, released by Slot_close
+	bool sealed;//Slot_sync is done, Slot_close may give the buffer to LDS::sealed_cache
 
 public:
-	LDS_Slot(std::string name);
+	LDS_Slot(std::string name, bool buffered=true);
 
 	~LDS_Slot(){
-		free(buffer);
+		if(map==NULL && buffer!=NULL){
+			munmap(buffer, SLOT_SIZE);
+		}
 		
 	}
 
@@ -81,29 +202,48 @@ class LDS_Log{
 public:
 	char *addr;//mmaped address
 	uint64_t phy_offset;
-	uint64_t size;
+	uint64_t size;//payload read so far by a reader, the size of a writer's log is write_head
 
 	std::string file_name;//for debug
 
-	uint64_t write_head;//
-	uint64_t flush_offset;//for flush to OS buffer
+	//Log_write may be called by several threads: a record is reserved with a fetch_add on
+	//reserve_head, built in place, and published by moving write_head past it once the records
+	//before it are published. Log_flush/Log_sync write out up to write_head.
+	//The offsets are in the log area; a writer keeps the bytes from the page of flush_offset on
+	//in a ring of ring_size bytes (offset % ring_size), a writer that finds the ring full flushes it.
+	std::atomic<uint64_t> write_head;//the records below it are complete
+	std::atomic<uint64_t> reserve_head;//next free byte
+	std::atomic<uint64_t> flush_offset;//for flush to OS buffer
 	uint64_t sync_offset;//for sync to disk
+	pthread_mutex_t flush_mu;//Log_flush and Log_sync of one log one at a time
 
 
-	void* buffer;
+	void* buffer;//the ring of a writer, NULL for a reader
+	uint64_t ring_size;
+	void *tail_page;//the last page of a flush, zeroed after write_head
+	bool polled;//a WAL writer with LDS_Options::wal_polled_io, its pages never go through the OS buffer
 
+	//a reader decodes the records from a mapping of the area as it is read
 	void *read_buf;
 	uint64_t load_size;
-	uint64_t read_offset;
+	uint64_t read_offset;//of the next record
+	uint64_t payload_pos;//of the rest of the payload of the current record
+	uint64_t payload_left;
 
-	int fd;
+	LDS_Device *dev;
+	LDS *lds;
 
-	uint64_t sn;
+	std::atomic<uint64_t> sn;//of the next record
 public:
-	LDS_Log(std::string name);
+	LDS_Log(std::string name, uint64_t ring_bytes);//ring_bytes is 0 for a reader
 	
 	~LDS_Log(){
 		free(buffer);
+		free(tail_page);
+		if(read_buf!=NULL){
+			dev->Unmap(read_buf, load_size);
+		}
+		pthread_mutex_destroy(&flush_mu);
 		
 	}
 };
@@ -132,36 +272,143 @@ public:
 
 };
 
+#define LDS_EPOCH_MAX 64 //slot counts a file-backed LDS goes through by LDS::grow
+
+//the file numbers from first_number on have their home slot at number % amount
+struct LDS_SlotEpoch{
+	uint64_t first_number;
+	uint64_t amount;
+};
+
+//the allocation state of the slots of one LDS (of one namespace)
+struct LDS_SlotMap{
+	char *online;//one byte per slot, 1 when used
+	uint64_t total;
+	uint64_t base;//device offset of slot 0
+	uint64_t free_cursor;//where Alloc_free_slot continues searching
+	uint64_t run_cursor;//where the next run of Alloc_slot with a hint is searched
+	pthread_mutex_t mu;//protects online and the cursors
+
+	//a grown LDS keeps the slot count of every number range, so the tables of the earlier
+	//sizes are found at their home slots. Read without the lock: an epoch is complete
+	//before epoch_count covers it.
+	LDS_SlotEpoch epochs[LDS_EPOCH_MAX];
+	std::atomic<int> epoch_count;
+	uint64_t grow_to;//slots the next allocation switches to, if more than total
+	uint64_t last_number;//largest number handed out
+	std::string epoch_path;//where the epochs are kept, empty if the LDS cannot grow
+};
+
+//a table stored in a pack slot
+struct LDS_PackedTable{
+	uint64_t slot;//index of the pack slot
+	uint64_t offset;//of the table data inside the pack slot
+	uint64_t size;
+};
+
+struct LDS_PackSlot{
+	uint64_t generation;//tells the entries of this use of the slot from stale ones
+	uint64_t write_offset;
+	uint64_t live;//live tables in the slot
+};
+
 class LDS{
 
 	public:
 		LDS(const std::string& storage_path);
 		LDS(const std::string& storage_path, int flash_using_exist);
-		virtual LDS_Slot * alloc_slot(const std::string& chunk_name);
+		virtual ~LDS();//the devices stay open, they are shared in the process (LDS_SharedDevice)
+		virtual LDS_Slot * alloc_slot(const std::string& chunk_name, bool writer=true);//a reader only locates the table
 		//virtual LDS_Log * alloc_version(const std::string& name)=0;
 		//virtual LDS_Log * alloc_backup(const std::string& name)=0;
-		virtual LDS_Log * alloc_log(const std::string& name);
+		virtual LDS_Log * alloc_log(const std::string& name, bool writer=true);
 
 
 
 		virtual int Storage_init(const std::string& storage_path);//e.g., /dev/sdb1
-		virtual int LDS_recover(const std::string& storage_path);//e.g., /dev/sdb1
+		virtual int LDS_recover(const std::string& storage_path);//e.g., /dev/sdb1, rebuilds the online map from the slot and pack headers
+
+		uint64_t slot_offset(uint64_t slot_index){ return slot_base+ slot_index * SLOT_SIZE; }
+		uint64_t home_slot(uint64_t number);//index of the slot the table number starts in
+
+		//adds bytes (whole slots) to a file-backed LDS while it runs, the file numbers allocated
+		//from then on spread over all the slots. 0, or -1 if the device cannot grow.
+		int grow(uint64_t bytes);
+
+		//the live tables of a pack slot, read from its headers with page (PACK_HEADER_SIZE, aligned), and
+		//its state. Only the arguments are filled, true if the slot has live tables.
+		bool scan_pack_slot(uint64_t slot_index, void *page, std::map<uint64_t, LDS_PackedTable> *live, LDS_PackSlot *ps);
+
+		//sub-slot allocation for small tables
+		int pack_table(LDS_Slot *slot);//write and seal the table into the current pack slot
+		bool locate_packed(uint64_t number, uint64_t *offset, uint64_t *size);//device offset and size of a packed table
+		void free_file(uint64_t number, bool table);//the file is deleted, release its slot(s) or its part of a pack slot
+
+		//the files held by LDS, reported to leveldb by GetChildren so that obsolete files get deleted
+		void add_file(const std::string& name);
+		void list_files(std::vector<std::string>* result);
+		void delete_file(const std::string& name);
+
+		//bulk ingestion: copies the table file src_path (built outside LevelDB) into the slots of fname,
+		//a table name with a number from NewFileNumber, and seals it with level in its header.
+		//0 and the table size, or -1 if src_path cannot be read or is not a table
+		int ingest_table(const std::string& src_path, const std::string& fname, int level, uint64_t *size);
+
+		//"lds.io-throttle": counters of the rate limiter, "lds.meta-cache": of the metadata cache,
+		//"lds.sealed-cache": of the sealed table cache, "lds.scrub": of the scrubber,
+		//"lds.memory": usage by category (lds_mem.h), "lds.slots": slots used and the slot counts
+		//a grown LDS went through
+		bool get_property(const std::string& property, std::string* value);
+
+		//a table the scrubber found bad: it cannot be opened any more, and its slots stay allocated
+		//when it is deleted (until restart)
+		void quarantine(uint64_t number);
+		bool is_quarantined(uint64_t number);
+
+		void release_slot(uint64_t slot_index);//Free_slot_in, the slot is punched out of a file first
+		void reserve_slot(uint64_t slot_index);//the blocks of a punched slot are allocated again, before it is written
+
+	private:
+		void clear_header(uint64_t slot_index);//zeroes and syncs the slot header page, LDS_recover skips the slot
 
 	public:
 		//char * online_map;
-		uint64_t slot_amount;
+		uint64_t slot_amount;//at open, slots.total follows LDS::grow
 
 		LDS_Log *manifest;
 		LDS_Log *backup;
 
 		//int dev_fd;
-		int version_fd;
-		int backup_fd;
-		int slot_fd;
+		LDS_Device *dev;//slots, and the version and backup areas unless they have their own device
+		LDS_Device *log_dev;//version area and backup area, dev itself without options.log_path
+		uint64_t slot_base;//device offset of slot 0
+		uint64_t log_base;//offset of the version area on log_dev, the backup area follows it
+
+		std::string ns_name;//of the namespace, empty for the whole device
+		LDS_SlotMap slots;//the allocator of the slots of this LDS
 
 		char *dev_read_only;
 		uint64_t size;
 
+		LDS_Options options;
+
+		LDS_RateLimiter *limiter;//NULL when compaction I/O is neither limited nor prioritized
+
+		LDS_MetaCache *meta_cache;//NULL when disabled
+
+		LDS_SealedCache *sealed_cache;//NULL when disabled
+
+		LDS_Scrubber *scrubber;//NULL when disabled
+
+		LDS_MemBudget *memory;//counts even without a budget
+
+		pthread_mutex_t mu;//protects files, the pack state and quarantined
+		std::set<std::string> files;
+		std::map<uint64_t, LDS_PackedTable> packed;//file number -> location
+		std::map<uint64_t, LDS_PackSlot> pack_slots;//slot index -> state
+		uint64_t current_pack;//slot index of the pack slot being filled, or -1
+		std::set<uint64_t> quarantined;//file numbers
+
 
 };
 
@@ -0,0 +1,77 @@
+// Backs up the live data of an LDS device into an image file, or restores one (see lds_image.h).
+//
+//   ./lds_backup backup --dev=/dev/sdb1 --image=/backup/lds.img [--threads=8] [--log_dev=<device>]
+//   ./lds_backup restore --dev=/dev/sdb1 --image=/backup/lds.img [--threads=8] [--log_dev=<device>]
+//
+// Only the version and backup areas up to the end of their records and the slots of the
+// tables of the current version are copied, so the time goes with the live data. The db
+// must be closed. --dev may name a namespace, /dev/sdb1#shard7. --log_dev is the device of
+// lds_options.log_path, if the db uses one.
+// A restore needs a device with the same number of slots.
+// WARNING: the restore overwrites the device.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+
+#include "db/lds.h"
+#include "db/lds_image.h"
+
+namespace {
+
+const char* FLAGS_dev=NULL;
+const char* FLAGS_log_dev=NULL;
+const char* FLAGS_image=NULL;
+int FLAGS_threads=8;
+
+}//namespace
+
+int main(int argc, char** argv){
+	bool restore= argc>1 && strcmp(argv[1], "restore")==0;
+	if(argc<2 || (!restore && strcmp(argv[1], "backup")!=0)){
+		argc=0;//usage
+	}
+	for(int i=2; i<argc; i++){
+		if(strncmp(argv[i], "--dev=", 6)==0){
+			FLAGS_dev=argv[i]+6;
+		}
+		else if(strncmp(argv[i], "--log_dev=", 10)==0){
+			FLAGS_log_dev=argv[i]+10;
+		}
+		else if(strncmp(argv[i], "--image=", 8)==0){
+			FLAGS_image=argv[i]+8;
+		}
+		else if(strncmp(argv[i], "--threads=", 10)==0){
+			FLAGS_threads=atoi(argv[i]+10);
+		}
+		else{
+			fprintf(stderr,"lds_backup.cc, invalid flag '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+	if(FLAGS_dev==NULL || FLAGS_image==NULL){
+		fprintf(stderr,"usage: lds_backup backup|restore --dev=<device> --image=<file> [--threads=N] [--log_dev=<device>]\n");
+		return 1;
+	}
+
+	if(FLAGS_log_dev!=NULL){
+		leveldb::lds_options.log_path=FLAGS_log_dev;
+	}
+	leveldb::LDS lds(FLAGS_dev);//finds the live slots and the pack slots (LDS_recover), the backup reads them from it
+
+	leveldb::LDS_ImageStats stats;
+	std::string error;
+	int res= restore ? leveldb::LDS_RestoreImage(&lds, FLAGS_image, FLAGS_threads, &stats, &error) :
+		leveldb::LDS_BackupImage(&lds, FLAGS_image, FLAGS_threads, &stats, &error);
+	if(res!=0){
+		fprintf(stderr,"lds_backup.cc, %s failed: %s\n", argv[1], error.c_str());
+		return 1;
+	}
+	double secs=stats.micros/1e6;
+	printf("{\"op\":\"%s\",\"tables\":%llu,\"extents\":%llu,\"bytes\":%llu,\"secs\":%.3f,\"mb_per_sec\":%.1f}\n",
+		argv[1], (unsigned long long)stats.tables, (unsigned long long)stats.extents, (unsigned long long)stats.bytes,
+		secs, secs>0 ? stats.bytes/1048576.0/secs : 0.0);
+	return 0;
+}
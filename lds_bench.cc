@@ -0,0 +1,632 @@
+// Benchmarks for LDS.
+//
+// Two groups of benchmarks are provided:
+//   1. db_bench-style workloads through the leveldb::DB interface:
+//        fillseq, fillrandom, fillsync, readrandom, overwrite (rewrites the keys in the db),
+//        recover (closes and reopens the db)
+//   2. micro benchmarks directly against the LDS layer:
+//        slot (Slot_write/Slot_flush/Slot_sync), log (Log_write/Log_sync),
+//        log_mt (Log_write from --log_threads threads, one thread syncing),
+//        alloc (Alloc_slot at various fill ratios, with and without a run hint)
+//
+// Every result is printed as one JSON object per line, so a run can be appended to a
+// file and compared against earlier runs.
+//
+// Build it in the LDS tree (env_lds.cc provides Env::Default()) to measure LDSEnv. Build
+// it with -DLDS_BENCH_POSIX in a stock LevelDB tree to measure the POSIX env; in that case
+// --dev must be a directory on a file system created on the same device/loop device, and
+// the micro benchmarks are skipped.
+//
+// Example:
+//   ./lds_bench --dev=/dev/loop0 --num=1000000 --json=lds.json
+//   ./lds_bench --dev=/dev/sdb1 --log_dev=/dev/nvme0n1p2 --benchmarks=fillsync,log
+//   ./lds_bench --dev=/dev/nvme0n1 --wal_polled_io=1 --benchmarks=fillsync,log
+//   ./lds_bench_posix --dev=/mnt/loop0/db --num=1000000 --json=posix.json
+//
+// WARNING: the micro benchmarks overwrite slots and the log areas of the device.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+#include <pthread.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "leveldb/db.h"
+#include "leveldb/env.h"
+#include "leveldb/options.h"
+#include "leveldb/write_batch.h"
+
+#ifndef LDS_BENCH_POSIX
+#include "db/lds_io.h"
+
+extern char * OnlineMap; //lds.cc
+extern uint64_t SlotTotal;
+#endif
+
+//globals read by LDSEnv (env_lds.cc)
+std::string dev_name;
+int flash_using_exist=0;
+int is_storage_inited=0;
+
+namespace {
+
+const char* FLAGS_benchmarks="fillseq,fillrandom,fillsync,overwrite,readrandom,slot,log,log_mt,alloc,recover";
+int FLAGS_num=1000000;
+int FLAGS_reads=-1;
+int FLAGS_value_size=100;
+int FLAGS_sync_num=10000;//number of ops for fillsync
+int FLAGS_slot_num=64;//number of slots for the slot micro benchmark
+int FLAGS_log_num=100000;//number of records for the log micro benchmark
+int FLAGS_log_record=200;//record size for the log micro benchmark
+int FLAGS_log_threads=4;//appending threads for log_mt
+int FLAGS_alloc_num=100000;
+int FLAGS_alloc_run=16;//tables per compaction for alloc_slot_run
+const char* FLAGS_fill_ratios="0,0.5,0.9,0.99";
+const char* FLAGS_json=NULL;
+
+#ifdef LDS_BENCH_POSIX
+const char* kEnvName="posix";
+#else
+const char* kEnvName="lds";
+#endif
+
+FILE *json_out=NULL;
+
+uint64_t NowMicros(){
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return static_cast<uint64_t>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+//a small xorshift generator, so that every run uses the same key sequence.
+class Random64{
+	uint64_t s_;
+	public:
+		Random64(uint64_t seed) : s_(seed ? seed : 0x9e3779b97f4a7c15ull) { }
+		uint64_t Next(){
+			s_ ^= s_ << 13;
+			s_ ^= s_ >> 7;
+			s_ ^= s_ << 17;
+			return s_;
+		}
+		uint64_t Uniform(uint64_t n){ return Next() % n; }
+};
+
+class Histogram{
+	std::vector<uint64_t> samples_;
+	public:
+		void Add(uint64_t micros){ samples_.push_back(micros); }
+		uint64_t Percentile(double p){
+			if(samples_.empty()){
+				return 0;
+			}
+			std::vector<uint64_t> s(samples_);
+			size_t k=static_cast<size_t>(p/100.0*(s.size()-1));
+			std::nth_element(s.begin(), s.begin()+k, s.end());
+			return s[k];
+		}
+};
+
+//prints one result as a json line
+void Report(const char* name, uint64_t ops, uint64_t bytes, uint64_t micros, Histogram *hist, const char* extra){
+	double secs = micros/1e6;
+	char line[1024];
+	int n=snprintf(line, sizeof(line),
+		"{\"bench\":\"%s\",\"env\":\"%s\",\"ops\":%llu,\"bytes\":%llu,\"micros\":%llu,"
+		"\"micros_per_op\":%.3f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.3f",
+		name, kEnvName, (unsigned long long)ops, (unsigned long long)bytes, (unsigned long long)micros,
+		ops ? (double)micros/ops : 0.0, secs>0 ? ops/secs : 0.0, secs>0 ? bytes/1048576.0/secs : 0.0);
+	if(hist!=NULL){
+		n+=snprintf(line+n, sizeof(line)-n, ",\"p50\":%llu,\"p99\":%llu,\"p999\":%llu",
+			(unsigned long long)hist->Percentile(50), (unsigned long long)hist->Percentile(99),
+			(unsigned long long)hist->Percentile(99.9));
+	}
+	if(extra!=NULL){
+		n+=snprintf(line+n, sizeof(line)-n, ",%s", extra);
+	}
+	snprintf(line+n, sizeof(line)-n, "}");
+
+	printf("%s\n", line);
+	if(json_out!=NULL){
+		fprintf(json_out, "%s\n", line);
+		fflush(json_out);
+	}
+}
+
+//-----------------------------------------db workloads-----------------------------------
+
+class DBBench{
+	leveldb::DB *db_;
+	std::string value_;
+
+	public:
+		DBBench() : db_(NULL) {
+			value_.assign(FLAGS_value_size, 'x');
+			Random64 rnd(301);
+			for(int i=0; i<FLAGS_value_size; i++){
+				value_[i]=' '+rnd.Uniform(95);
+			}
+		}
+		~DBBench(){
+			delete db_;
+		}
+
+		void Open(){
+			leveldb::Options options;
+			options.create_if_missing=true;
+			options.env=leveldb::Env::Default();
+			leveldb::Status s=leveldb::DB::Open(options, dev_name, &db_);
+			if(!s.ok()){
+				fprintf(stderr,"lds_bench.cc, open error: %s\n", s.ToString().c_str());
+				exit(1);
+			}
+		}
+
+		void Key(uint64_t k, char *buf){
+			snprintf(buf, 32, "%016llu", (unsigned long long)k);
+		}
+
+		void Write(const char* name, bool seq, bool sync, int num){
+			leveldb::WriteOptions wo;
+			wo.sync=sync;
+			Random64 rnd(1000);
+			Histogram hist;
+			char key[32];
+			uint64_t bytes=0;
+			uint64_t start=NowMicros();
+			for(int i=0; i<num; i++){
+				Key(seq ? i : rnd.Uniform(FLAGS_num), key);
+				uint64_t t=NowMicros();
+				leveldb::Status s=db_->Put(wo, key, value_);
+				hist.Add(NowMicros()-t);
+				if(!s.ok()){
+					fprintf(stderr,"lds_bench.cc, put error: %s\n", s.ToString().c_str());
+					exit(1);
+				}
+				bytes+=16+value_.size();
+			}
+			Report(name, num, bytes, NowMicros()-start, &hist, NULL);
+		}
+
+		void Overwrite(){
+			//every key in the db once more, in random order with a new value, so the compactions
+			//drop the old versions
+			std::vector<std::string> keys;
+			leveldb::Iterator *it=db_->NewIterator(leveldb::ReadOptions());
+			for(it->SeekToFirst(); it->Valid(); it->Next()){
+				keys.push_back(it->key().ToString());
+			}
+			delete it;
+			if(keys.empty()){
+				fprintf(stderr,"lds_bench.cc, overwrite, the db is empty, run a fill first\n");
+				return;
+			}
+			Random64 rnd(3000);
+			for(size_t i=keys.size()-1; i>0; i--){
+				std::swap(keys[i], keys[rnd.Uniform(i+1)]);
+			}
+			std::string value(value_.rbegin(), value_.rend());
+			leveldb::WriteOptions wo;
+			Histogram hist;
+			uint64_t bytes=0;
+			uint64_t start=NowMicros();
+			for(size_t i=0; i<keys.size(); i++){
+				uint64_t t=NowMicros();
+				leveldb::Status s=db_->Put(wo, keys[i], value);
+				hist.Add(NowMicros()-t);
+				if(!s.ok()){
+					fprintf(stderr,"lds_bench.cc, put error: %s\n", s.ToString().c_str());
+					exit(1);
+				}
+				bytes+=keys[i].size()+value.size();
+			}
+			Report("overwrite", keys.size(), bytes, NowMicros()-start, &hist, NULL);
+		}
+
+		void Recover(){
+			//a restart: close the db and open it again, which loads the MANIFEST and replays the WAL
+			delete db_;
+			db_=NULL;
+			uint64_t start=NowMicros();
+			Open();
+			uint64_t total=NowMicros()-start;
+
+			char extra[64]="";
+#ifndef LDS_BENCH_POSIX
+			//the LDS-level part alone: open the device (slot map rebuild) and read the version area
+			uint64_t t=NowMicros();
+			leveldb::LDS *lds=new leveldb::LDS(dev_name);
+			leveldb::LDS_Log *manifest=lds->alloc_log("MANIFEST-LDS", false);
+			char buf[32768];
+			while(leveldb::Log_read(buf, 1, sizeof(buf), manifest)>0){
+			}
+			leveldb::Log_close(manifest);
+			delete lds;
+			snprintf(extra, sizeof(extra), "\"lds_init_micros\":%llu", (unsigned long long)(NowMicros()-t));
+#endif
+			Report("recover", 1, 0, total, NULL, extra[0] ? extra : NULL);
+		}
+
+		void ReadRandom(){
+			leveldb::ReadOptions ro;
+			Random64 rnd(2000);
+			Histogram hist;
+			std::string value;
+			char key[32];
+			int reads= FLAGS_reads<0 ? FLAGS_num : FLAGS_reads;
+			uint64_t found=0, bytes=0;
+			uint64_t start=NowMicros();
+			for(int i=0; i<reads; i++){
+				Key(rnd.Uniform(FLAGS_num), key);
+				uint64_t t=NowMicros();
+				if(db_->Get(ro, key, &value).ok()){
+					found++;
+					bytes+=16+value.size();
+				}
+				hist.Add(NowMicros()-t);
+			}
+			char extra[64];
+			snprintf(extra, sizeof(extra), "\"found\":%llu", (unsigned long long)found);
+			Report("readrandom", reads, bytes, NowMicros()-start, &hist, extra);
+		}
+
+		void Run(const std::string& name){
+			if(db_==NULL){
+				Open();
+			}
+			if(name=="fillseq"){
+				Write("fillseq", true, false, FLAGS_num);
+			}
+			else if(name=="fillrandom"){
+				Write("fillrandom", false, false, FLAGS_num);
+			}
+			else if(name=="fillsync"){
+				Write("fillsync", false, true, FLAGS_sync_num);
+			}
+			else if(name=="overwrite"){
+				Overwrite();
+			}
+			else if(name=="recover"){
+				Recover();
+			}
+			else if(name=="readrandom"){
+				ReadRandom();
+			}
+		}
+};
+
+#ifndef LDS_BENCH_POSIX
+//-----------------------------------------LDS micro benchmarks-----------------------------------
+
+void BenchSlot(leveldb::LDS *lds){
+	const size_t append_size=4096;
+	const size_t flush_every=64*1024;//like the table builder, which flushes per data block group
+	const size_t table_size=2*1024*1024;
+	char *data=(char*)malloc(append_size);
+	memset(data, 'a', append_size);
+
+	Histogram write_hist, sync_hist;
+	uint64_t write_micros=0, sync_micros=0;
+	for(int i=0; i<FLAGS_slot_num; i++){
+		char name[64];
+		snprintf(name, sizeof(name), "%06d.ldb", i+1);
+		leveldb::LDS_Slot *slot=lds->alloc_slot(name);
+
+		uint64_t t=NowMicros();
+		for(size_t off=0; off<table_size; off+=append_size){
+			leveldb::Slot_write(data, 1, append_size, slot);
+			if((off+append_size) % flush_every==0){
+				leveldb::Slot_flush(slot);
+			}
+		}
+		uint64_t w=NowMicros()-t;
+		write_hist.Add(w);
+		write_micros+=w;
+
+		t=NowMicros();
+		leveldb::Slot_sync(slot);
+		uint64_t s=NowMicros()-t;
+		sync_hist.Add(s);
+		sync_micros+=s;
+
+		leveldb::Slot_close(slot);
+	}
+	Report("slot_write", FLAGS_slot_num, (uint64_t)FLAGS_slot_num*table_size, write_micros, &write_hist, NULL);
+	Report("slot_sync", FLAGS_slot_num, (uint64_t)FLAGS_slot_num*table_size, sync_micros, &sync_hist, NULL);
+	free(data);
+}
+
+void BenchLog(leveldb::LDS *lds){
+	char *record=(char*)malloc(FLAGS_log_record);
+	memset(record, 'l', FLAGS_log_record);
+
+	leveldb::LDS_Log *log=lds->alloc_log("000001.log");
+	//the backup area is small, wrap around by reopening the log when it is almost full
+	uint64_t limit=BACKUP_SIZE - 2*(FLAGS_log_record+64);
+
+	Histogram write_hist, sync_hist;
+	uint64_t write_micros=0, sync_micros=0;
+	for(int i=0; i<FLAGS_log_num; i++){
+		if(log->write_head.load() + FLAGS_log_record + 64 > limit){
+			leveldb::Log_close(log);
+			log=lds->alloc_log("000001.log");
+		}
+		uint64_t t=NowMicros();
+		leveldb::Log_write(record, 1, FLAGS_log_record, log);
+		uint64_t w=NowMicros()-t;
+		write_hist.Add(w);
+		write_micros+=w;
+
+		t=NowMicros();
+		leveldb::Log_sync(log);
+		uint64_t s=NowMicros()-t;
+		sync_hist.Add(s);
+		sync_micros+=s;
+	}
+	leveldb::Log_close(log);
+
+	Report("log_write", FLAGS_log_num, (uint64_t)FLAGS_log_num*FLAGS_log_record, write_micros, &write_hist, NULL);
+	Report("log_sync", FLAGS_log_num, (uint64_t)FLAGS_log_num*FLAGS_log_record, sync_micros, &sync_hist, NULL);
+	free(record);
+}
+
+struct LogAppender{
+	leveldb::LDS_Log *log;
+	int records;
+	const char *record;
+};
+
+void *LogAppenderMain(void *arg){
+	LogAppender *a=(LogAppender*)arg;
+	for(int i=0; i<a->records; i++){
+		leveldb::Log_write(a->record, 1, FLAGS_log_record, a->log);
+	}
+	return NULL;
+}
+
+void BenchLogThreads(leveldb::LDS *lds){
+	char *record=(char*)malloc(FLAGS_log_record);
+	memset(record, 'l', FLAGS_log_record);
+
+	//one log, as many records as fit in the backup area
+	leveldb::LDS_Log *log=lds->alloc_log("000001.log");
+	uint64_t fit= (BACKUP_SIZE-4096) / (FLAGS_log_record+24);
+	int per_thread= std::min<uint64_t>(FLAGS_log_num, fit) / FLAGS_log_threads;
+
+	std::vector<pthread_t> threads(FLAGS_log_threads);
+	std::vector<LogAppender> appenders(FLAGS_log_threads);
+	uint64_t start=NowMicros();
+	for(int i=0; i<FLAGS_log_threads; i++){
+		appenders[i].log=log;
+		appenders[i].records=per_thread;
+		appenders[i].record=record;
+		pthread_create(&threads[i], NULL, LogAppenderMain, &appenders[i]);
+	}
+	//the group commit thread: syncs whatever the appenders have published
+	uint64_t total=(uint64_t)per_thread*FLAGS_log_threads*(FLAGS_log_record+24);
+	int syncs=0;
+	while(log->write_head.load() < total){
+		leveldb::Log_sync(log);
+		syncs++;
+	}
+	for(int i=0; i<FLAGS_log_threads; i++){
+		pthread_join(threads[i], NULL);
+	}
+	leveldb::Log_sync(log);
+	uint64_t micros=NowMicros()-start;
+	leveldb::Log_close(log);
+
+	char extra[64];
+	snprintf(extra, sizeof(extra), "\"threads\":%d,\"syncs\":%d", FLAGS_log_threads, syncs+1);
+	Report("log_write_mt", per_thread*FLAGS_log_threads, (uint64_t)per_thread*FLAGS_log_threads*FLAGS_log_record, micros, NULL, extra);
+	free(record);
+}
+
+void ReleaseGroup(std::vector<uint64_t> *group){
+	for(size_t i=0; i<group->size(); i++){
+		leveldb::Free_slot((*group)[i]);
+	}
+	group->clear();
+}
+
+void BenchAlloc(){
+	char *saved=(char*)malloc(SlotTotal);
+	memcpy(saved, OnlineMap, SlotTotal);
+	char *saved_fill=(char*)malloc(SlotTotal);
+
+	const char *p=FLAGS_fill_ratios;
+	while(*p){
+		double ratio=atof(p);
+		if(ratio>=1){
+			ratio=0.99;//a full map makes Alloc_slot exit
+		}
+		Random64 rnd(42);
+		for(uint64_t i=0; i<SlotTotal; i++){
+			OnlineMap[i]= (rnd.Uniform(10000) < ratio*10000) ? 1 : 0;
+		}
+		memcpy(saved_fill, OnlineMap, SlotTotal);
+
+		Histogram hist;
+		uint64_t start=NowMicros();
+		uint64_t prev=0, adjacent=0;
+		std::vector<uint64_t> group;//the tables of a group are deleted when the next group starts, the fill stays
+		for(int i=0; i<FLAGS_alloc_num; i++){
+			if(i%FLAGS_alloc_run==0){
+				ReleaseGroup(&group);
+			}
+			uint64_t t=NowMicros();
+			uint64_t n=leveldb::Alloc_slot(rnd.Next() >> 1);
+			hist.Add(NowMicros()-t);
+			group.push_back(n);
+			adjacent+= (i%FLAGS_alloc_run!=0 && n%SlotTotal==prev%SlotTotal+1);
+			prev=n;
+		}
+		char extra[96];
+		snprintf(extra, sizeof(extra), "\"fill_ratio\":%.3f,\"adjacent\":%llu", ratio, (unsigned long long)adjacent);
+		Report("alloc_slot", FLAGS_alloc_num, 0, NowMicros()-start, &hist, extra);
+
+		//the same fill, with the outputs of each "compaction" of alloc_run tables kept together
+		group.clear();
+		memcpy(OnlineMap, saved_fill, SlotTotal);
+		Histogram run_hist;
+		start=NowMicros();
+		adjacent=0;
+		leveldb::LDS_AllocHint hint(FLAGS_alloc_run);
+		for(int i=0; i<FLAGS_alloc_num; i++){
+			if(i%FLAGS_alloc_run==0){
+				ReleaseGroup(&group);
+				hint=leveldb::LDS_AllocHint(FLAGS_alloc_run);
+			}
+			uint64_t t=NowMicros();
+			uint64_t n=leveldb::Alloc_slot(rnd.Next() >> 1, &hint);
+			run_hist.Add(NowMicros()-t);
+			group.push_back(n);
+			adjacent+= (i%FLAGS_alloc_run!=0 && n%SlotTotal==prev%SlotTotal+1);
+			prev=n;
+		}
+		snprintf(extra, sizeof(extra), "\"fill_ratio\":%.3f,\"adjacent\":%llu", ratio, (unsigned long long)adjacent);
+		Report("alloc_slot_run", FLAGS_alloc_num, 0, NowMicros()-start, &run_hist, extra);
+
+		p=strchr(p, ',');
+		if(p==NULL){
+			break;
+		}
+		p++;
+	}
+
+	memcpy(OnlineMap, saved, SlotTotal);
+	free(saved);
+	free(saved_fill);
+}
+
+#endif
+
+}//namespace
+
+int main(int argc, char** argv){
+	dev_name="/dev/sdb1";
+	for(int i=1; i<argc; i++){
+		int n;
+		char junk;
+		if(strncmp(argv[i], "--benchmarks=", 13)==0){
+			FLAGS_benchmarks=argv[i]+13;
+		}
+		else if(strncmp(argv[i], "--dev=", 6)==0){
+			dev_name=argv[i]+6;
+		}
+		else if(strncmp(argv[i], "--json=", 7)==0){
+			FLAGS_json=argv[i]+7;
+		}
+#ifndef LDS_BENCH_POSIX
+		else if(strncmp(argv[i], "--log_dev=", 10)==0){
+			leveldb::lds_options.log_path=argv[i]+10;//MANIFEST and WAL on their own device
+		}
+		else if(sscanf(argv[i], "--wal_polled_io=%d%c", &n, &junk)==1){
+			leveldb::lds_options.wal_polled_io= n!=0;//fillsync and log with polled WAL writes
+		}
+#endif
+		else if(strncmp(argv[i], "--fill_ratios=", 14)==0){
+			FLAGS_fill_ratios=argv[i]+14;
+		}
+		else if(sscanf(argv[i], "--num=%d%c", &n, &junk)==1){
+			FLAGS_num=n;
+		}
+		else if(sscanf(argv[i], "--reads=%d%c", &n, &junk)==1){
+			FLAGS_reads=n;
+		}
+		else if(sscanf(argv[i], "--value_size=%d%c", &n, &junk)==1){
+			FLAGS_value_size=n;
+		}
+		else if(sscanf(argv[i], "--sync_num=%d%c", &n, &junk)==1){
+			FLAGS_sync_num=n;
+		}
+		else if(sscanf(argv[i], "--slot_num=%d%c", &n, &junk)==1){
+			FLAGS_slot_num=n;
+		}
+		else if(sscanf(argv[i], "--log_num=%d%c", &n, &junk)==1){
+			FLAGS_log_num=n;
+		}
+		else if(sscanf(argv[i], "--log_record=%d%c", &n, &junk)==1){
+			FLAGS_log_record=n;
+		}
+		else if(sscanf(argv[i], "--log_threads=%d%c", &n, &junk)==1 && n>0){
+			FLAGS_log_threads=n;
+		}
+		else if(sscanf(argv[i], "--alloc_num=%d%c", &n, &junk)==1){
+			FLAGS_alloc_num=n;
+		}
+		else if(sscanf(argv[i], "--alloc_run=%d%c", &n, &junk)==1 && n>0){
+			FLAGS_alloc_run=n;
+		}
+		else{
+			fprintf(stderr,"lds_bench.cc, invalid flag '%s'\n", argv[i]);
+			exit(1);
+		}
+	}
+
+	if(FLAGS_json!=NULL){
+		json_out=fopen(FLAGS_json, "a");
+		if(json_out==NULL){
+			fprintf(stderr,"lds_bench.cc, cannot open %s\n", FLAGS_json);
+			exit(1);
+		}
+	}
+
+	//the micro benchmarks run first, the db workloads rebuild the db afterwards
+	std::vector<std::string> names;
+	const char *p=FLAGS_benchmarks;
+	while(*p){
+		const char *sep=strchr(p, ',');
+		std::string name= sep ? std::string(p, sep-p) : std::string(p);
+		names.push_back(name);
+		if(sep==NULL){
+			break;
+		}
+		p=sep+1;
+	}
+
+#ifndef LDS_BENCH_POSIX
+	leveldb::LDS *lds=NULL;
+	for(size_t i=0; i<names.size(); i++){
+		if(names[i]=="slot" || names[i]=="log" || names[i]=="log_mt" || names[i]=="alloc"){
+			if(lds==NULL){
+				lds=new leveldb::LDS(dev_name);
+			}
+			if(names[i]=="slot"){
+				BenchSlot(lds);
+			}
+			else if(names[i]=="log"){
+				BenchLog(lds);
+			}
+			else if(names[i]=="log_mt"){
+				BenchLogThreads(lds);
+			}
+			else{
+				BenchAlloc();
+			}
+		}
+	}
+#endif
+
+	DBBench *bench=NULL;
+	for(size_t i=0; i<names.size(); i++){
+		if(names[i]=="fillseq" || names[i]=="fillrandom" || names[i]=="fillsync" ||
+			names[i]=="overwrite" || names[i]=="readrandom" || names[i]=="recover"){
+			if(bench==NULL){
+				bench=new DBBench;
+			}
+			bench->Run(names[i]);
+		}
+	}
+	delete bench;
+
+	if(json_out!=NULL){
+		fclose(json_out);
+	}
+	return 0;
+}
@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "db/lds_cache.h"
+#include "util/coding.h" //in LevelDB
+
+namespace leveldb {
+
+namespace {
+
+bool DecodeHandle(const char **p, const char *limit, uint64_t *offset, uint64_t *size){
+	*p=GetVarint64Ptr(*p, limit, offset);
+	if(*p==NULL){
+		return false;
+	}
+	*p=GetVarint64Ptr(*p, limit, size);
+	return *p!=NULL;
+}
+
+}//namespace
+
+LDS_MetaCache::LDS_MetaCache(uint64_t capacity, LDS_MemBudget *memory) : capacity_(capacity), usage_(0), memory_(memory),
+	inserts_(0), rejects_(0), hits_(0), misses_(0), evictions_(0) {
+	pthread_mutex_init(&mu_, NULL);
+}
+
+LDS_MetaCache::~LDS_MetaCache(){
+	for(std::map<uint64_t, LDS_TableMeta*>::iterator it=table_.begin(); it!=table_.end(); ++it){
+		delete it->second;//pinned entries are gone with the LDS as well
+	}
+	pthread_mutex_destroy(&mu_);
+}
+
+bool LDS_MetaCache::MetaStart(const char *seg, uint64_t seg_start, uint64_t size, uint64_t *start, bool *complete){
+	if(complete!=NULL){
+		*complete=true;
+	}
+	if(size < seg_start + LDS_TABLE_FOOTER_SIZE){
+		return false;
+	}
+	const char *footer= seg + (size - LDS_TABLE_FOOTER_SIZE - seg_start);
+	uint64_t magic= (uint64_t)DecodeFixed32(footer+40) | ((uint64_t)DecodeFixed32(footer+44) << 32);
+	if(magic!=LDS_TABLE_MAGIC){
+		return false;
+	}
+	const char *p=footer;
+	uint64_t meta_offset, meta_size, index_offset, index_size;
+	if(!DecodeHandle(&p, footer+40, &meta_offset, &meta_size) || !DecodeHandle(&p, footer+40, &index_offset, &index_size)){
+		return false;
+	}
+	if(meta_offset < seg_start || meta_offset + meta_size + LDS_BLOCK_TRAILER_SIZE > size){
+		return false;
+	}
+	*start= meta_offset < index_offset ? meta_offset : index_offset;
+
+	//the filter block comes before the metaindex block, its handle is in it (key "filter.<policy>").
+	//a compressed metaindex block is not parsed, the tail then starts at the metaindex block.
+	const char *block= seg + (meta_offset - seg_start);
+	if(block[meta_size]!=0 || meta_size<4){
+		return true;
+	}
+	uint32_t restarts=DecodeFixed32(block+meta_size-4);
+	if(((uint64_t)restarts+1)*4 > meta_size){
+		return true;
+	}
+	const char *limit= block + meta_size - ((uint64_t)restarts+1)*4;
+	std::string key;
+	p=block;
+	while(p<limit){
+		uint32_t shared, non_shared, value_len;
+		if((p=GetVarint32Ptr(p, limit, &shared))==NULL || (p=GetVarint32Ptr(p, limit, &non_shared))==NULL ||
+			(p=GetVarint32Ptr(p, limit, &value_len))==NULL || shared>key.size() || p+non_shared+value_len>limit){
+			break;
+		}
+		key.resize(shared);
+		key.append(p, non_shared);
+		p+=non_shared;
+		const char *v=p;
+		p+=value_len;
+
+		uint64_t filter_offset, filter_size;
+		if(key.compare(0, 7, "filter.")==0 && DecodeHandle(&v, p, &filter_offset, &filter_size) && filter_offset < *start){
+			if(filter_offset >= seg_start){
+				*start=filter_offset;
+			}
+			else if(complete!=NULL){
+				*complete=false;//a large filter, not in seg
+			}
+		}
+	}
+	return true;
+}
+
+void LDS_MetaCache::Insert(uint64_t number, const char *seg, uint64_t seg_start, uint64_t size,
+	const std::vector<std::pair<uint64_t, size_t> >& extents){
+	uint64_t start;
+	if(!MetaStart(seg, seg_start, size, &start) || (size-start)*2 > capacity_){
+		pthread_mutex_lock(&mu_);
+		rejects_++;
+		pthread_mutex_unlock(&mu_);
+		return;
+	}
+	LDS_TableMeta *meta=new LDS_TableMeta;
+	meta->number=number;
+	meta->size=size;
+	meta->offset=start;
+	meta->data.assign(seg + (start-seg_start), size-start);
+	meta->extents=extents;
+	meta->refs=1;
+
+	pthread_mutex_lock(&mu_);
+	std::map<uint64_t, LDS_TableMeta*>::iterator it=table_.find(number);
+	if(it!=table_.end()){
+		Remove(it->second);
+	}
+	meta->lru=lru_.insert(lru_.end(), number);
+	table_[number]=meta;
+	usage_+=meta->data.size();
+	if(memory_!=NULL){
+		memory_->Charge(LDS_MEM_META_CACHE, meta->data.size());
+	}
+	inserts_++;
+	while(usage_ > capacity_ && !lru_.empty()){
+		Remove(table_[lru_.front()]);
+		evictions_++;
+	}
+	pthread_mutex_unlock(&mu_);
+}
+
+LDS_TableMeta *LDS_MetaCache::Lookup(uint64_t number){
+	pthread_mutex_lock(&mu_);
+	LDS_TableMeta *meta=NULL;
+	std::map<uint64_t, LDS_TableMeta*>::iterator it=table_.find(number);
+	if(it!=table_.end()){
+		meta=it->second;
+		meta->refs++;
+		lru_.splice(lru_.end(), lru_, meta->lru);
+		hits_++;
+	}
+	else{
+		misses_++;
+	}
+	pthread_mutex_unlock(&mu_);
+	return meta;
+}
+
+bool LDS_MetaCache::Locate(uint64_t number, std::vector<std::pair<uint64_t, size_t> > *extents, uint64_t *size){
+	pthread_mutex_lock(&mu_);
+	std::map<uint64_t, LDS_TableMeta*>::iterator it=table_.find(number);
+	bool found= it!=table_.end() && !it->second->extents.empty();
+	if(found){
+		*extents=it->second->extents;
+		*size=it->second->size;
+	}
+	pthread_mutex_unlock(&mu_);
+	return found;
+}
+
+void LDS_MetaCache::Release(LDS_TableMeta *meta){
+	pthread_mutex_lock(&mu_);
+	Unref(meta);
+	pthread_mutex_unlock(&mu_);
+}
+
+void LDS_MetaCache::Erase(uint64_t number){
+	pthread_mutex_lock(&mu_);
+	std::map<uint64_t, LDS_TableMeta*>::iterator it=table_.find(number);
+	if(it!=table_.end()){
+		Remove(it->second);
+	}
+	pthread_mutex_unlock(&mu_);
+}
+
+void LDS_MetaCache::Unref(LDS_TableMeta *meta){
+	meta->refs--;
+	if(meta->refs==0){
+		delete meta;
+	}
+}
+
+void LDS_MetaCache::Remove(LDS_TableMeta *meta){
+	table_.erase(meta->number);
+	lru_.erase(meta->lru);
+	usage_-=meta->data.size();
+	if(memory_!=NULL){
+		memory_->Release(LDS_MEM_META_CACHE, meta->data.size());
+	}
+	Unref(meta);
+}
+
+void LDS_MetaCache::Report(std::string *result){
+	char buf[256];
+	pthread_mutex_lock(&mu_);
+	snprintf(buf, sizeof(buf), "capacity=%llu usage=%llu tables=%zu inserts=%llu rejects=%llu hits=%llu misses=%llu evictions=%llu\n",
+		(unsigned long long)capacity_, (unsigned long long)usage_, table_.size(), (unsigned long long)inserts_,
+		(unsigned long long)rejects_, (unsigned long long)hits_, (unsigned long long)misses_, (unsigned long long)evictions_);
+	pthread_mutex_unlock(&mu_);
+	result->append(buf);
+}
+
+//-----------------------------------------LDS_SealedCache-----------------------------------
+
+LDS_SealedCache::LDS_SealedCache(uint64_t capacity, LDS_MemBudget *memory, LDS_Device *dev) : capacity_(capacity), usage_(0), memory_(memory), dev_(dev),
+	inserts_(0), hits_(0), misses_(0), evictions_(0) {
+	pthread_mutex_init(&mu_, NULL);
+	if(capacity_ < LDS_SEALED_CACHE_MIN){
+		fprintf(stderr,"lds_cache.cc, LDS_SealedCache, sealed_cache_bytes=%llu is below %d, no table will be cached\n",
+			(unsigned long long)capacity_, LDS_SEALED_CACHE_MIN);
+	}
+}
+
+LDS_SealedCache::~LDS_SealedCache(){
+	for(std::map<uint64_t, LDS_SealedTable*>::iterator it=table_.begin(); it!=table_.end(); ++it){
+		munmap(it->second->buffer, it->second->buffer_size);//pinned entries are gone with the LDS as well
+		delete it->second;
+	}
+	pthread_mutex_destroy(&mu_);
+}
+
+bool LDS_SealedCache::Insert(uint64_t number, char *buffer, uint64_t buffer_size, const char *data, uint64_t size, uint64_t offset){
+	if(buffer_size*2 > capacity_){
+		return false;
+	}
+	LDS_SealedTable *table=new LDS_SealedTable;
+	table->number=number;
+	table->size=size;
+	table->buffer=buffer;
+	table->buffer_size=buffer_size;
+	table->data=data;
+	table->offset=offset;
+	table->remapped=false;
+	table->refs=1;
+
+	pthread_mutex_lock(&mu_);
+	std::map<uint64_t, LDS_SealedTable*>::iterator it=table_.find(number);
+	if(it!=table_.end()){
+		Remove(it->second);
+	}
+	table->lru=lru_.insert(lru_.end(), number);
+	table_[number]=table;
+	usage_+=buffer_size;
+	memory_->Charge(LDS_MEM_SEALED_CACHE, buffer_size);
+	inserts_++;
+	while(usage_ > capacity_ && !lru_.empty()){
+		Remove(table_[lru_.front()]);
+		evictions_++;
+	}
+	pthread_mutex_unlock(&mu_);
+	return true;
+}
+
+LDS_SealedTable *LDS_SealedCache::Lookup(uint64_t number){
+	pthread_mutex_lock(&mu_);
+	LDS_SealedTable *table=NULL;
+	std::map<uint64_t, LDS_SealedTable*>::iterator it=table_.find(number);
+	if(it!=table_.end()){
+		table=it->second;
+		table->refs++;
+		lru_.splice(lru_.end(), lru_, table->lru);
+		hits_++;
+	}
+	else{
+		misses_++;
+	}
+	pthread_mutex_unlock(&mu_);
+	return table;
+}
+
+void LDS_SealedCache::Release(LDS_SealedTable *table){
+	pthread_mutex_lock(&mu_);
+	Unref(table);
+	pthread_mutex_unlock(&mu_);
+}
+
+void LDS_SealedCache::Erase(uint64_t number){
+	pthread_mutex_lock(&mu_);
+	std::map<uint64_t, LDS_SealedTable*>::iterator it=table_.find(number);
+	if(it!=table_.end()){
+		Remove(it->second);
+	}
+	pthread_mutex_unlock(&mu_);
+}
+
+void LDS_SealedCache::Evict(uint64_t bytes){
+	pthread_mutex_lock(&mu_);
+	uint64_t dropped=0;
+	std::list<uint64_t>::iterator it=lru_.begin();
+	while(dropped < bytes && it!=lru_.end()){
+		LDS_SealedTable *table=table_[*it];
+		++it;//Remove erases the entry from lru_
+		dropped+=table->buffer_size;
+		Remove(table);
+		evictions_++;
+	}
+	pthread_mutex_unlock(&mu_);
+}
+
+void LDS_SealedCache::Unref(LDS_SealedTable *table){
+	table->refs--;
+	if(table->refs==0){
+		if(!table->remapped){
+			memory_->Release(LDS_MEM_SEALED_CACHE, table->buffer_size);
+		}
+		munmap(table->buffer, table->buffer_size);
+		delete table;
+	}
+}
+
+void LDS_SealedCache::Remove(LDS_SealedTable *table){
+	table_.erase(table->number);
+	lru_.erase(table->lru);
+	usage_-=table->buffer_size;
+	if(table->refs>1){
+		Remap(table);
+	}
+	Unref(table);
+}
+
+void LDS_SealedCache::Remap(LDS_SealedTable *table){
+	//the open tables keep their pointers into the buffer, the table pages now come from the
+	//device (they were written before the seal) and the rest of the buffer is dropped
+	char *start=(char*)table->data;
+	size_t len=(table->size+4095)/4096*4096;
+	if((uintptr_t)start%4096!=0 || table->offset%4096!=0 || dev_->MapOver(start, table->offset, len)!=0){
+		return;//the buffer stays until the last pin is released
+	}
+	madvise(table->buffer, start-table->buffer, MADV_DONTNEED);
+	if(start+len < table->buffer+table->buffer_size){
+		madvise(start+len, table->buffer+table->buffer_size-(start+len), MADV_DONTNEED);
+	}
+	table->remapped=true;
+	memory_->Release(LDS_MEM_SEALED_CACHE, table->buffer_size);
+}
+
+void LDS_SealedCache::Report(std::string *result){
+	char buf[256];
+	pthread_mutex_lock(&mu_);
+	snprintf(buf, sizeof(buf), "capacity=%llu usage=%llu tables=%zu inserts=%llu hits=%llu misses=%llu evictions=%llu\n",
+		(unsigned long long)capacity_, (unsigned long long)usage_, table_.size(), (unsigned long long)inserts_,
+		(unsigned long long)hits_, (unsigned long long)misses_, (unsigned long long)evictions_);
+	pthread_mutex_unlock(&mu_);
+	result->append(buf);
+}
+
+}//leveldb
@@ -0,0 +1,163 @@
+#ifndef LDS_CACHE_H
+#define LDS_CACHE_H
+
+#include <stdint.h>
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+
+#include <pthread.h>
+
+#include "db/lds_mem.h"
+#include "db/lds_dev.h"
+
+namespace leveldb {
+
+/*
+ Metadata of freshly written tables, kept in memory so that opening them reads nothing
+ from the device.
+
+ A LevelDB table ends with [filter block][metaindex block][index block][footer]. When a
+ table is sealed (Slot_sync), that tail is copied from the slot buffer into the cache,
+ keyed by file number (a packed table shares its slot, the number is what identifies it).
+ LDS_MmapedSlot pins the entry while the table is open and serves reads inside the tail
+ from it. The entry also keeps the extents of the table, so NewRandomAccessFile does not
+ locate it again.
+
+ The cache is bounded by LDS_Options.meta_cache_bytes and evicts the least recently used
+ entries; an evicted entry that is pinned stays alive until it is released.
+*/
+
+#define LDS_TABLE_FOOTER_SIZE 48
+#define LDS_TABLE_MAGIC 0xdb4775248b80fb57ull
+#define LDS_BLOCK_TRAILER_SIZE 5
+
+struct LDS_TableMeta{
+	uint64_t number;
+	uint64_t size;//of the table
+	uint64_t offset;//of the cached tail in the table
+	std::string data;//the table bytes [offset, size)
+	std::vector<std::pair<uint64_t, size_t> > extents;//of the table data on the device, in table order
+
+	int refs;//one for the cache while the entry is in it, one per pin
+	std::list<uint64_t>::iterator lru;
+};
+
+class LDS_MetaCache{
+public:
+	LDS_MetaCache(uint64_t capacity, LDS_MemBudget *memory=NULL);//the entries are counted in memory
+	~LDS_MetaCache();
+
+	//seg holds the table bytes [seg_start, size) when the table is sealed, extents are where it is
+	void Insert(uint64_t number, const char *seg, uint64_t seg_start, uint64_t size,
+		const std::vector<std::pair<uint64_t, size_t> >& extents);
+
+	LDS_TableMeta *Lookup(uint64_t number);//pinned, NULL if not cached
+	//the extents and size of a cached table, so that opening it does not read its slot header.
+	//false if it is not cached.
+	bool Locate(uint64_t number, std::vector<std::pair<uint64_t, size_t> > *extents, uint64_t *size);
+	void Release(LDS_TableMeta *meta);
+
+	void Erase(uint64_t number);//the table is deleted
+
+	void Report(std::string *result);
+
+	//offset of the filter block (or of the metaindex block if the table has no filter),
+	//found from the footer and the metaindex block within the bytes [seg_start, size). false if
+	//they are not there or not a table. *complete (if not NULL) is false when the filter block
+	//starts before seg_start, *start is then the metaindex block.
+	static bool MetaStart(const char *seg, uint64_t seg_start, uint64_t size, uint64_t *start, bool *complete=NULL);
+
+private:
+	void Unref(LDS_TableMeta *meta);//mu_ held
+	void Remove(LDS_TableMeta *meta);//mu_ held
+
+	pthread_mutex_t mu_;
+	uint64_t capacity_;
+	uint64_t usage_;
+	LDS_MemBudget *memory_;
+	std::map<uint64_t, LDS_TableMeta*> table_;
+	std::list<uint64_t> lru_;//front is the oldest
+
+	uint64_t inserts_;
+	uint64_t rejects_;//not a table, or too large
+	uint64_t hits_;
+	uint64_t misses_;
+	uint64_t evictions_;
+};
+
+/*
+ Whole tables just sealed, kept in the slot buffer that wrote them so that the first reads
+ of a fresh table (the hottest data) are served from memory instead of faulting the table
+ back in from the device.
+
+ Slot_close hands the buffer of a sealed table over to the cache instead of freeing it, if
+ the whole table is in the buffer (a table of one slot, not written by gather writes, a
+ packed table too). NewRandomAccessFile then pins the entry and LDS_MmapedSlot reads from
+ it. The cache is bounded by LDS_Options.sealed_cache_bytes (whole buffers are counted) and
+ evicts the least recently used tables; the memory budget evicts as well when a slot buffer
+ does not fit. An evicted entry that is still pinned (LevelDB keeps an opened table in its
+ table cache, and its blocks point into the buffer) gets the table pages of the device
+ mapped over its buffer: the memory is given back at once, the open table reads the same
+ bytes from the OS buffer from then on, and the mapping goes when the last pin is released.
+ A buffer takes at most half of the cache, so a cache below LDS_SEALED_CACHE_MIN (two slot
+ buffers) takes no table; it is reported on stderr when the cache is built.
+*/
+
+#define LDS_SEALED_CACHE_MIN (8*1024*1024)
+
+struct LDS_SealedTable{
+	uint64_t number;
+	uint64_t size;//of the table
+	char *buffer;//the slot buffer (an anonymous mapping), owned by the entry
+	uint64_t buffer_size;
+	const char *data;//the table, in buffer, page aligned
+	uint64_t offset;//device offset of the table data
+	bool remapped;//evicted while pinned, the device is mapped over the table pages
+
+	int refs;//one for the cache while the entry is in it, one per pin
+	std::list<uint64_t>::iterator lru;
+};
+
+class LDS_SealedCache{
+public:
+	LDS_SealedCache(uint64_t capacity, LDS_MemBudget *memory, LDS_Device *dev);
+	~LDS_SealedCache();
+
+	//takes buffer (from mmap) holding the size bytes of table number at data, which are at
+	//offset on the device as well. false if it does not fit, the buffer stays the caller's then
+	bool Insert(uint64_t number, char *buffer, uint64_t buffer_size, const char *data, uint64_t size, uint64_t offset);
+
+	LDS_SealedTable *Lookup(uint64_t number);//pinned, NULL if not cached
+	void Release(LDS_SealedTable *table);
+
+	void Erase(uint64_t number);//the table is deleted
+
+	//drops the oldest entries until at least bytes are freed (or none is left), for the memory budget
+	void Evict(uint64_t bytes);
+
+	void Report(std::string *result);
+
+private:
+	void Unref(LDS_SealedTable *table);//mu_ held
+	void Remove(LDS_SealedTable *table);//mu_ held
+	void Remap(LDS_SealedTable *table);//mu_ held, the entry is pinned
+
+	pthread_mutex_t mu_;
+	uint64_t capacity_;
+	uint64_t usage_;
+	LDS_MemBudget *memory_;//counts the buffers until they are freed or remapped
+	LDS_Device *dev_;
+	std::map<uint64_t, LDS_SealedTable*> table_;
+	std::list<uint64_t> lru_;//front is the oldest
+
+	uint64_t inserts_;
+	uint64_t hits_;
+	uint64_t misses_;
+	uint64_t evictions_;
+};
+
+}//leveldb
+
+#endif
@@ -0,0 +1,576 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>   //provides BLKGETSIZE64
+
+#include "db/lds_dev.h"
+
+namespace leveldb {
+
+namespace {
+
+uint64_t MonoMicros(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+uint64_t ParseBytes(const std::string& v){
+	char *end;
+	uint64_t n=strtoull(v.c_str(), &end, 10);
+	switch(*end){
+		case 'k': case 'K': n<<=10; break;
+		case 'm': case 'M': n<<=20; break;
+		case 'g': case 'G': n<<=30; break;
+		case 't': case 'T': n<<=40; break;
+	}
+	return n;
+}
+
+}//namespace
+
+//-----------------------------------------LDS_Device-----------------------------------
+
+void *LDS_Device::MapExtents(const std::vector<std::pair<uint64_t, size_t> >& extents, size_t *total){
+	size_t page=sysconf(_SC_PAGESIZE);
+	size_t len=0;
+	for(size_t i=0; i<extents.size(); i++){
+		len+=extents[i].second;
+	}
+	len=(len+page-1)/page*page;
+	*total=len;
+
+	//reserve the address range, then map every extent over its part of it
+	char *base=(char*)mmap(NULL, len, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if(base==MAP_FAILED){
+		return NULL;
+	}
+	size_t pos=0;
+	for(size_t i=0; i<extents.size(); i++){
+		void *p=mmap(base+pos, extents[i].second, PROT_READ, MAP_SHARED|MAP_FIXED, MapFd(), extents[i].first);
+		if(p==MAP_FAILED){
+			munmap(base, len);
+			return NULL;
+		}
+		pos+=extents[i].second;
+	}
+	return base;
+}
+
+void LDS_Device::UnmapExtents(void *addr, size_t total){
+	munmap(addr, total);
+}
+
+int LDS_Device::MapOver(void *addr, uint64_t offset, size_t n){
+	void *p=mmap(addr, n, PROT_READ, MAP_SHARED|MAP_FIXED, MapFd(), offset);
+	return p==MAP_FAILED ? -1 : 0;
+}
+
+ssize_t LDS_Device::WriteV(uint64_t offset, const struct iovec *iov, int iovcnt){
+	ssize_t done=0;
+	for(int i=0; i<iovcnt; i++){
+		ssize_t res=Write(offset+done, iov[i].iov_base, iov[i].iov_len);
+		if(res<0){
+			return res;
+		}
+		done+=res;
+		if((size_t)res<iov[i].iov_len){
+			break;
+		}
+	}
+	return done;
+}
+
+ssize_t LDS_Device::WritePolled(uint64_t offset, const struct iovec *iov, int iovcnt, bool durable){
+	ssize_t res=WriteV(offset, iov, iovcnt);
+	if(res>0 && durable && Sync(offset, res)!=0){
+		return -1;
+	}
+	return res;
+}
+
+int LDS_Device::SyncRanges(const std::vector<std::pair<uint64_t, uint64_t> >& ranges){
+	//the writeback of all of them is under way, each Sync only waits for its part
+	int res=0;
+	for(size_t i=0; i<ranges.size() && res==0; i++){
+		res=Sync(ranges[i].first, ranges[i].second);
+	}
+	return res;
+}
+
+//-----------------------------------------LDS_BlockDevice-----------------------------------
+
+LDS_BlockDevice::LDS_BlockDevice(const std::string& path, int fd, uint64_t size) : path_(path), fd_(fd), size_(size) {
+	direct_fd_=open(path.c_str(), O_RDONLY|O_DIRECT);
+	polled_fd_=open(path.c_str(), O_RDWR|O_DIRECT);
+}
+
+LDS_BlockDevice::~LDS_BlockDevice(){
+	if(direct_fd_>=0){
+		close(direct_fd_);
+	}
+	if(polled_fd_>=0){
+		close(polled_fd_);
+	}
+	close(fd_);
+}
+
+ssize_t LDS_BlockDevice::Write(uint64_t offset, const void *buf, size_t n){
+	return pwrite64(fd_, buf, n, offset);
+}
+
+ssize_t LDS_BlockDevice::WriteV(uint64_t offset, const struct iovec *iov, int iovcnt){
+	return pwritev64(fd_, iov, iovcnt, offset);
+}
+
+ssize_t LDS_BlockDevice::WritePolled(uint64_t offset, const struct iovec *iov, int iovcnt, bool durable){
+#ifdef RWF_HIPRI
+	if(polled_fd_>=0){
+		//a direct write also drops the OS buffer pages of the range, Map and Read see the new bytes
+		ssize_t res=pwritev2(polled_fd_, iov, iovcnt, offset, RWF_HIPRI|(durable ? RWF_DSYNC : 0));
+		if(res>=0 || (errno!=EOPNOTSUPP && errno!=EINVAL && errno!=ENOSYS)){
+			return res;
+		}
+		//the kernel or the device does not poll
+		res=pwritev2(polled_fd_, iov, iovcnt, offset, durable ? RWF_DSYNC : 0);
+		if(res>=0 || (errno!=EOPNOTSUPP && errno!=EINVAL && errno!=ENOSYS)){
+			return res;
+		}
+	}
+#endif
+	return LDS_Device::WritePolled(offset, iov, iovcnt, durable);
+}
+
+ssize_t LDS_BlockDevice::Read(uint64_t offset, void *buf, size_t n){
+	return pread64(fd_, buf, n, offset);
+}
+
+ssize_t LDS_BlockDevice::ReadUncached(uint64_t offset, void *buf, size_t n){
+	//a direct read writes dirty OS buffer pages of the range back first, so it sees what Read would
+	return pread64(direct_fd_>=0 ? direct_fd_ : fd_, buf, n, offset);
+}
+
+int LDS_BlockDevice::Sync(uint64_t offset, uint64_t n){
+	//WAIT_BEFORE also waits for a writeback started earlier by StartSync
+	return sync_file_range(fd_, offset, n, SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER);
+}
+
+int LDS_BlockDevice::StartSync(uint64_t offset, uint64_t n){
+	return sync_file_range(fd_, offset, n, SYNC_FILE_RANGE_WRITE);
+}
+
+void *LDS_BlockDevice::Map(uint64_t offset, size_t n){
+	return mmap(NULL, n, PROT_READ, MAP_SHARED, fd_, offset);
+}
+
+void LDS_BlockDevice::Unmap(void *addr, size_t n){
+	munmap(addr, n);
+}
+
+void *LDS_BlockDevice::MapWritable(uint64_t offset, size_t n){
+	void *p=mmap(NULL, n, PROT_READ|PROT_WRITE, MAP_SHARED, fd_, offset);
+	return p==MAP_FAILED ? NULL : p;
+}
+
+int LDS_BlockDevice::SyncMapped(void *addr, uint64_t offset, uint64_t n){
+	//msync wants a page aligned start
+	size_t page=sysconf(_SC_PAGESIZE);
+	uintptr_t start=(uintptr_t)addr/page*page;
+	return msync((void*)start, (uintptr_t)addr+n-start, MS_SYNC);
+}
+
+//-----------------------------------------LDS_FileDevice-----------------------------------
+
+LDS_FileDevice::LDS_FileDevice(const std::string& path, int fd, uint64_t size) : LDS_BlockDevice(path, fd, size), dio_align_(0) {
+	pthread_mutex_init(&mu_, NULL);
+
+	//the slot and log code issues direct I/O at 4KB offsets from 4KB aligned buffers
+#ifdef STATX_DIOALIGN
+	struct statx stx;
+	if(statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx)==0 && (stx.stx_mask & STATX_DIOALIGN)){
+		dio_align_= stx.stx_dio_mem_align>stx.stx_dio_offset_align ? stx.stx_dio_mem_align : stx.stx_dio_offset_align;
+	}
+	else
+#endif
+	{
+		struct stat st;
+		if(direct_fd_>=0 && fstat(fd, &st)==0){
+			dio_align_=st.st_blksize;
+		}
+	}
+	if(dio_align_==0 || dio_align_>4096){
+		if(direct_fd_>=0){
+			close(direct_fd_);
+			direct_fd_=-1;
+		}
+		if(polled_fd_>=0){
+			close(polled_fd_);
+			polled_fd_=-1;
+		}
+		printf("lds_dev.cc, LDS_FileDevice, %s, no 4KB direct I/O (alignment %llu), reads and writes go through the OS buffer\n",
+			path.c_str(), (unsigned long long)dio_align_);
+	}
+}
+
+LDS_FileDevice::~LDS_FileDevice(){
+	pthread_mutex_destroy(&mu_);
+}
+
+ssize_t LDS_FileDevice::WriteDirect(uint64_t offset, const void *buf, size_t n){
+	if(polled_fd_<0 || offset%dio_align_!=0 || n%dio_align_!=0 || (uintptr_t)buf%dio_align_!=0){
+		return Write(offset, buf, n);
+	}
+	//a direct write drops the OS buffer pages of the range, Map and Read see the new bytes
+	return pwrite64(polled_fd_, buf, n, offset);
+}
+
+int LDS_FileDevice::Sync(uint64_t offset, uint64_t n){
+	//the data is on the device, fdatasync records the reserved blocks it went to as written
+	int res=LDS_BlockDevice::Sync(offset, n);
+	return res==0 ? fdatasync(fd_) : res;
+}
+
+int LDS_FileDevice::SyncRanges(const std::vector<std::pair<uint64_t, uint64_t> >& ranges){
+	//one fdatasync for all of them
+	int res=0;
+	for(size_t i=0; i<ranges.size() && res==0; i++){
+		res=LDS_BlockDevice::Sync(ranges[i].first, ranges[i].second);
+	}
+	return res==0 ? fdatasync(fd_) : res;
+}
+
+int LDS_FileDevice::SyncMapped(void *addr, uint64_t offset, uint64_t n){
+	int res=LDS_BlockDevice::SyncMapped(addr, offset, n);
+	return res==0 ? fdatasync(fd_) : res;
+}
+
+int LDS_FileDevice::Discard(uint64_t offset, uint64_t n){
+	//the size of the file stays, the punched range reads as zeros until it is written again
+	return fallocate(fd_, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, offset, n);
+}
+
+int LDS_FileDevice::Reserve(uint64_t offset, uint64_t n){
+	int res=fallocate(fd_, 0, offset, n);
+	if(res!=0 && errno==EOPNOTSUPP){
+		return 0;//a sparse file, it was not punched either
+	}
+	return res;
+}
+
+int LDS_FileDevice::Grow(uint64_t size){
+	pthread_mutex_lock(&mu_);
+	int res=0;
+	if(size>size_){
+		//reserved, not only a hole at the end, so the new slots are written like the others
+		res=fallocate(fd_, 0, size_, size-size_);
+		if(res!=0 && errno==EOPNOTSUPP){
+			fprintf(stderr,"lds_dev.cc, LDS_FileDevice::Grow, %s cannot reserve blocks, extended sparse\n", path_.c_str());
+			res=ftruncate(fd_, size);
+		}
+		if(res==0){
+			size_=size;
+		}
+	}
+	pthread_mutex_unlock(&mu_);
+	return res;
+}
+
+int LDS_FileDevice::ParseSpec(const std::string& spec, std::string *path, uint64_t *size){
+	//file:/path or file:/path?size=64G
+	if(spec.find("file:")!=0){
+		return -1;
+	}
+	size_t q=spec.find('?');
+	*path=spec.substr(5, q==std::string::npos ? std::string::npos : q-5);
+	*size=0;
+	if(path->empty()){
+		return -1;
+	}
+	if(q!=std::string::npos){
+		std::string kv=spec.substr(q+1);
+		if(kv.find("size=")!=0){
+			return -1;
+		}
+		*size=ParseBytes(kv.substr(5));
+	}
+	return 0;
+}
+
+//-----------------------------------------LDS_SimDevice-----------------------------------
+
+LDS_SimDevice::LDS_SimDevice(const LDS_SimConfig& config) : config_(config), mem_(NULL), fd_(-1), busy_until_(0) {
+	pthread_mutex_init(&mu_, NULL);
+
+	if(config_.file.empty()){
+		//a memfd rather than anonymous memory, so that extents can be mapped at fixed addresses
+		fd_=memfd_create("lds_sim", 0);
+		if(fd_<0 || ftruncate(fd_, config_.size)!=0){
+			fprintf(stderr,"lds_dev.cc, LDS_SimDevice, memfd error, exit\n");
+			exit(9);
+		}
+		mem_=(char*)mmap(NULL, config_.size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE, fd_, 0);
+	}
+	else{
+		fd_=open(config_.file.c_str(), O_RDWR|O_CREAT, 0644);
+		if(fd_<0){
+			fprintf(stderr,"lds_dev.cc, LDS_SimDevice, open %s error, exit\n", config_.file.c_str());
+			exit(9);
+		}
+		if(config_.size==0){
+			config_.size=lseek(fd_, 0, SEEK_END);
+		}
+		else if(ftruncate(fd_, config_.size)!=0){
+			fprintf(stderr,"lds_dev.cc, LDS_SimDevice, ftruncate error, exit\n");
+			exit(9);
+		}
+		mem_=(char*)mmap(NULL, config_.size, PROT_READ|PROT_WRITE, MAP_SHARED, fd_, 0);
+	}
+	if(mem_==MAP_FAILED || config_.size==0){
+		fprintf(stderr,"lds_dev.cc, LDS_SimDevice, cannot create %llu bytes device, exit\n", (unsigned long long)config_.size);
+		exit(9);
+	}
+	printf("lds_dev.cc, LDS_SimDevice, %s, latency_us=%llu, bandwidth_mb=%llu, sector=%llu, sync_us=%llu\n",
+		Name().c_str(), (unsigned long long)config_.latency_us, (unsigned long long)config_.bandwidth_mb,
+		(unsigned long long)config_.sector, (unsigned long long)config_.sync_us);
+}
+
+LDS_SimDevice::~LDS_SimDevice(){
+	munmap(mem_, config_.size);
+	if(fd_>=0){
+		close(fd_);
+	}
+	pthread_mutex_destroy(&mu_);
+}
+
+std::string LDS_SimDevice::Name(){
+	return config_.file.empty() ? std::string("sim:mem") : "sim:"+config_.file;
+}
+
+void LDS_SimDevice::Charge(uint64_t offset, size_t n, uint64_t fixed_us, bool write){
+	//the transfer time is serialized on the device (the bandwidth is shared), the fixed latency is not.
+	uint64_t transfer_us=0;
+	if(config_.bandwidth_mb>0){
+		transfer_us= (uint64_t)n*1000000/(config_.bandwidth_mb<<20);
+	}
+	if(write && config_.sector>1 && (offset%config_.sector!=0 || n%config_.sector!=0)){
+		fixed_us+=config_.latency_us;//read-modify-write of the partial sectors
+	}
+
+	uint64_t now=MonoMicros();
+	pthread_mutex_lock(&mu_);
+	uint64_t start= busy_until_>now ? busy_until_ : now;
+	busy_until_= start+transfer_us;
+	uint64_t done= busy_until_+fixed_us;
+	pthread_mutex_unlock(&mu_);
+
+	if(done>now){
+		usleep(done-now);
+	}
+}
+
+ssize_t LDS_SimDevice::Write(uint64_t offset, const void *buf, size_t n){
+	if(offset>=config_.size){
+		return 0;
+	}
+	if(offset+n>config_.size){
+		n=config_.size-offset;
+	}
+	memcpy(mem_+offset, buf, n);
+	Charge(offset, n, config_.latency_us, true);
+	return n;
+}
+
+ssize_t LDS_SimDevice::WriteV(uint64_t offset, const struct iovec *iov, int iovcnt){
+	//one I/O, it pays the latency once
+	uint64_t done=0;
+	for(int i=0; i<iovcnt && offset+done<config_.size; i++){
+		size_t n=iov[i].iov_len;
+		if(offset+done+n>config_.size){
+			n=config_.size-offset-done;
+		}
+		memcpy(mem_+offset+done, iov[i].iov_base, n);
+		done+=n;
+	}
+	Charge(offset, done, config_.latency_us, true);
+	return done;
+}
+
+ssize_t LDS_SimDevice::WritePolled(uint64_t offset, const struct iovec *iov, int iovcnt, bool durable){
+	//one I/O that carries its sync, no separate Sync call
+	uint64_t done=0;
+	for(int i=0; i<iovcnt && offset+done<config_.size; i++){
+		size_t n=iov[i].iov_len;
+		if(offset+done+n>config_.size){
+			n=config_.size-offset-done;
+		}
+		memcpy(mem_+offset+done, iov[i].iov_base, n);
+		done+=n;
+	}
+	Charge(offset, done, config_.latency_us+ (durable ? config_.sync_us : 0), true);
+	return done;
+}
+
+ssize_t LDS_SimDevice::Read(uint64_t offset, void *buf, size_t n){
+	if(offset>=config_.size){
+		return 0;
+	}
+	if(offset+n>config_.size){
+		n=config_.size-offset;
+	}
+	memcpy(buf, mem_+offset, n);
+	Charge(offset, n, config_.latency_us);
+	return n;
+}
+
+int LDS_SimDevice::Sync(uint64_t offset, uint64_t n){
+	//only the cost is simulated, a file backend is not forced to its disk, which keeps runs reproducible
+	Charge(offset, 0, config_.sync_us);
+	return 0;
+}
+
+int LDS_SimDevice::StartSync(uint64_t offset, uint64_t n){
+	return 0;
+}
+
+int LDS_SimDevice::SyncRanges(const std::vector<std::pair<uint64_t, uint64_t> >& ranges){
+	//the syncs overlap on the device, the batch pays one sync
+	if(!ranges.empty()){
+		Charge(ranges[0].first, 0, config_.sync_us);
+	}
+	return 0;
+}
+
+void *LDS_SimDevice::Map(uint64_t offset, size_t n){
+	//reads through the mapping are not charged, like page cache hits
+	return mem_+offset;
+}
+
+void LDS_SimDevice::Unmap(void *addr, size_t n){
+}
+
+void *LDS_SimDevice::MapWritable(uint64_t offset, size_t n){
+	return mem_+offset;
+}
+
+int LDS_SimDevice::SyncMapped(void *addr, uint64_t offset, uint64_t n){
+	//stores through the mapping are not charged, so the transfer is charged here with the sync
+	Charge(offset, n, config_.sync_us);
+	return 0;
+}
+
+int LDS_SimDevice::ParseSpec(const std::string& spec, LDS_SimConfig *config){
+	//sim:mem?k=v&k=v or sim:/path?k=v&k=v
+	if(spec.find("sim:")!=0){
+		return -1;
+	}
+	size_t q=spec.find('?');
+	std::string target=spec.substr(4, q==std::string::npos ? std::string::npos : q-4);
+	if(target!="mem"){
+		config->file=target;
+	}
+	while(q!=std::string::npos){
+		size_t next=spec.find('&', q+1);
+		std::string kv=spec.substr(q+1, next==std::string::npos ? std::string::npos : next-q-1);
+		size_t eq=kv.find('=');
+		if(eq==std::string::npos){
+			return -1;
+		}
+		std::string k=kv.substr(0, eq);
+		std::string v=kv.substr(eq+1);
+		if(k=="size"){
+			config->size=ParseBytes(v);
+		}
+		else if(k=="latency_us"){
+			config->latency_us=strtoull(v.c_str(), NULL, 10);
+		}
+		else if(k=="bandwidth_mb"){
+			config->bandwidth_mb=strtoull(v.c_str(), NULL, 10);
+		}
+		else if(k=="sector"){
+			config->sector=ParseBytes(v);
+		}
+		else if(k=="sync_us"){
+			config->sync_us=strtoull(v.c_str(), NULL, 10);
+		}
+		else{
+			return -1;
+		}
+		q=next;
+	}
+	return 0;
+}
+
+//-----------------------------------------open-----------------------------------
+
+LDS_Device *LDS_OpenDevice(const std::string& path){
+	if(path.find("sim:")==0){
+		LDS_SimConfig config;
+		if(LDS_SimDevice::ParseSpec(path, &config)!=0){
+			fprintf(stderr,"lds_dev.cc, LDS_OpenDevice, bad simulated device spec %s, exit\n", path.c_str());
+			exit(0);
+		}
+		return new LDS_SimDevice(config);
+	}
+
+	std::string file=path;
+	uint64_t want=0;
+	if(path.find("file:")==0 && LDS_FileDevice::ParseSpec(path, &file, &want)!=0){
+		fprintf(stderr,"lds_dev.cc, LDS_OpenDevice, bad file device spec %s, exit\n", path.c_str());
+		exit(0);
+	}
+
+	int fd=open(file.c_str(), want>0 ? O_RDWR|O_CREAT : O_RDWR, 0644);
+	if(fd<0){
+		printf("lds_dev.cc, LDS_OpenDevice, open error,exit\n");
+		exit(0);
+	}
+	struct stat st;
+	if(fstat(fd, &st)!=0){
+		printf("lds_dev.cc, LDS_OpenDevice, stat error,exit\n");
+		exit(0);
+	}
+	if(S_ISREG(st.st_mode)){
+		uint64_t size=st.st_size;
+		if(want>size){
+			//reserve the blocks of the whole layout now, the slot writes then never allocate
+			int res=fallocate(fd, 0, size, want-size);
+			if(res!=0 && errno==EOPNOTSUPP){
+				fprintf(stderr,"lds_dev.cc, LDS_OpenDevice, %s cannot reserve blocks, extended sparse\n", file.c_str());
+				res=ftruncate(fd, want);
+			}
+			if(res!=0){
+				fprintf(stderr,"lds_dev.cc, LDS_OpenDevice, cannot extend %s to %llu bytes (%s), exit\n", file.c_str(),
+					(unsigned long long)want, strerror(errno));
+				exit(9);
+			}
+			size=want;
+		}
+		return new LDS_FileDevice(file, fd, size);
+	}
+
+	uint64_t blk64=0;
+	ioctl(fd, BLKGETSIZE64, &blk64);//the path is the raw device, reture the size in bytes . This result is real
+	return new LDS_BlockDevice(path, fd, blk64);
+}
+
+LDS_Device *LDS_SharedDevice(const std::string& path){
+	static pthread_mutex_t mu=PTHREAD_MUTEX_INITIALIZER;
+	static std::map<std::string, LDS_Device*> devices;
+	pthread_mutex_lock(&mu);
+	LDS_Device*& dev=devices[path];
+	if(dev==NULL){
+		dev=LDS_OpenDevice(path);
+	}
+	LDS_Device *res=dev;
+	pthread_mutex_unlock(&mu);
+	return res;
+}
+
+}//leveldb
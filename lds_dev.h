@@ -0,0 +1,225 @@
+#ifndef LDS_DEV_H
+#define LDS_DEV_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <utility>
+#include <map>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <pthread.h>
+
+namespace leveldb {
+
+/*
+ The storage below LDS. All LDS I/O goes through this interface with absolute device
+ offsets, so the slot and log code does not care what the storage really is.
+
+ The storage path decides the backend:
+   /dev/sdb1                                 real device (LDS_BlockDevice)
+   file:/path/to/file?size=64G               file on a file system (LDS_FileDevice), created and
+                                             reserved up to size if it is smaller; a plain path
+                                             of a regular file opens it at its current size
+   sim:mem?size=8G&latency_us=100...         simulated device kept in memory (LDS_SimDevice)
+   sim:/path/to/file?size=8G&latency_us=100   simulated device backed by a file
+
+ Parameters of the simulated device (all optional except size for sim:mem):
+   size=<bytes, K/M/G suffix>   device size, a file is extended to it if needed
+   latency_us=<n>               fixed latency of each read/write
+   bandwidth_mb=<n>             MB/s shared by all I/Os, 0 is unlimited
+   sector=<bytes>               unaligned writes pay an extra read-modify-write latency
+   sync_us=<n>                  cost of each sync
+*/
+class LDS_Device{
+public:
+	virtual ~LDS_Device(){ }
+
+	virtual uint64_t Size()=0;
+
+	//write to the OS buffer (or the device cache), not durable until Sync
+	virtual ssize_t Write(uint64_t offset, const void *buf, size_t n)=0;
+
+	//write the iovcnt buffers back to back from offset in one I/O (pwritev) where the backend allows it
+	virtual ssize_t WriteV(uint64_t offset, const struct iovec *iov, int iovcnt);
+
+	//write around the OS buffer (O_DIRECT) where the backend allows it and offset, buf and n are
+	//aligned for it, else like Write. For whole slot pages that are not read back soon.
+	virtual ssize_t WriteDirect(uint64_t offset, const void *buf, size_t n){ return Write(offset, buf, n); }
+
+	//write the buffers around the OS buffer and poll for the completion instead of sleeping
+	//for the interrupt (O_DIRECT pwritev2 with RWF_HIPRI), durable adds RWF_DSYNC. Spends a
+	//core spinning to cut the latency of small log writes. offset and the buffers must be 4KB
+	//aligned. Backends without it do WriteV, and Sync if durable.
+	virtual ssize_t WritePolled(uint64_t offset, const struct iovec *iov, int iovcnt, bool durable);
+
+	virtual ssize_t Read(uint64_t offset, void *buf, size_t n)=0;
+
+	//read for a scan (the scrubber) that should not fill the OS buffer, with O_DIRECT where the
+	//backend allows it. offset, buf and n must be 4KB aligned.
+	virtual ssize_t ReadUncached(uint64_t offset, void *buf, size_t n){ return Read(offset, buf, n); }
+
+	//make [offset, offset+n) durable
+	virtual int Sync(uint64_t offset, uint64_t n)=0;
+
+	//start writing [offset, offset+n) back without waiting, a later Sync of the range waits for it
+	virtual int StartSync(uint64_t offset, uint64_t n)=0;
+
+	//make all the (offset, length) ranges durable, their writeback was started with StartSync
+	virtual int SyncRanges(const std::vector<std::pair<uint64_t, uint64_t> >& ranges);
+
+	//read-only mapping of [offset, offset+n), offset must be page aligned
+	virtual void *Map(uint64_t offset, size_t n)=0;
+	virtual void Unmap(void *addr, size_t n)=0;
+
+	//shared writable mapping, stores land in the OS buffer like Write. Returns NULL on error,
+	//release it with Unmap. SyncMapped makes [offset, offset+n) of a mapping at addr durable.
+	virtual void *MapWritable(uint64_t offset, size_t n)=0;
+	virtual int SyncMapped(void *addr, uint64_t offset, uint64_t n)=0;
+
+	//one contiguous read-only view of several (offset, length) extents, all but the last
+	//length must be page aligned. Returns NULL on error, release it with UnmapExtents.
+	void *MapExtents(const std::vector<std::pair<uint64_t, size_t> >& extents, size_t *total);
+	void UnmapExtents(void *addr, size_t total);
+
+	//read-only mapping of [offset, offset+n) at addr, in place of the pages mapped there
+	//(MAP_FIXED). addr and offset must be page aligned. -1 on error, addr is unchanged then.
+	int MapOver(void *addr, uint64_t offset, size_t n);
+
+	//give the blocks of [offset, offset+n) back to the storage, the range reads as zeros
+	//afterwards. -1 where the backend cannot.
+	virtual int Discard(uint64_t offset, uint64_t n){ return -1; }
+
+	//allocate the blocks of [offset, offset+n) again after a Discard, so writing them does not
+	//allocate. 0 where the backend has nothing to reserve.
+	virtual int Reserve(uint64_t offset, uint64_t n){ return 0; }
+
+	//extend the device to size bytes, -1 where the backend cannot
+	virtual int Grow(uint64_t size){ return -1; }
+
+	virtual std::string Name()=0;
+
+protected:
+	virtual int MapFd()=0;//the descriptor the extents are mapped from
+};
+
+class LDS_BlockDevice : public LDS_Device{
+public:
+	LDS_BlockDevice(const std::string& path, int fd, uint64_t size);
+	virtual ~LDS_BlockDevice();
+
+	virtual uint64_t Size(){ return size_; }
+	virtual ssize_t Write(uint64_t offset, const void *buf, size_t n);
+	virtual ssize_t WriteV(uint64_t offset, const struct iovec *iov, int iovcnt);
+	virtual ssize_t WritePolled(uint64_t offset, const struct iovec *iov, int iovcnt, bool durable);
+	virtual ssize_t Read(uint64_t offset, void *buf, size_t n);
+	virtual ssize_t ReadUncached(uint64_t offset, void *buf, size_t n);
+	virtual int Sync(uint64_t offset, uint64_t n);
+	virtual int StartSync(uint64_t offset, uint64_t n);
+	virtual void *Map(uint64_t offset, size_t n);
+	virtual void Unmap(void *addr, size_t n);
+	virtual void *MapWritable(uint64_t offset, size_t n);
+	virtual int SyncMapped(void *addr, uint64_t offset, uint64_t n);
+	virtual std::string Name(){ return path_; }
+
+protected:
+	virtual int MapFd(){ return fd_; }
+
+	std::string path_;
+	int fd_;
+	int direct_fd_;//O_DIRECT descriptor for ReadUncached, -1 if the file system does not take it
+	int polled_fd_;//writable O_DIRECT descriptor for WritePolled (and WriteDirect of a file), -1 if the file system does not take it
+	uint64_t size_;
+};
+
+/*
+ A regular file as the device. Its blocks are reserved with fallocate when it is created or
+ extended (size= of the file: spec), so the slot writes do not allocate and the layout stays
+ contiguous. The O_DIRECT descriptors are only kept if the file system takes 4KB aligned
+ direct I/O (statx STATX_DIOALIGN, or the block size of the file system); WriteDirect then
+ writes the sealed slot pages around the OS buffer. Discard punches a hole (the freed slots
+ of the LDS, LDS_Options::file_punch_holes) and Reserve fills it again when the slot is taken,
+ Grow reserves the extension (LDS::grow). A file system without fallocate gets a sparse file.
+ Reserved blocks stay unwritten extents until the file system records them as written, which
+ sync_file_range does not do, so every sync ends with fdatasync.
+*/
+class LDS_FileDevice : public LDS_BlockDevice{
+public:
+	LDS_FileDevice(const std::string& path, int fd, uint64_t size);
+	virtual ~LDS_FileDevice();
+
+	virtual ssize_t WriteDirect(uint64_t offset, const void *buf, size_t n);
+	virtual int Sync(uint64_t offset, uint64_t n);
+	virtual int SyncRanges(const std::vector<std::pair<uint64_t, uint64_t> >& ranges);
+	virtual int SyncMapped(void *addr, uint64_t offset, uint64_t n);
+	virtual int Discard(uint64_t offset, uint64_t n);
+	virtual int Reserve(uint64_t offset, uint64_t n);
+	virtual int Grow(uint64_t size);
+
+	//file:/path?size=64G, size is 0 if not given
+	static int ParseSpec(const std::string& spec, std::string *path, uint64_t *size);
+
+	uint64_t dio_align(){ return dio_align_; }
+
+private:
+	uint64_t dio_align_;//offset alignment of direct I/O, 0 if the file system does not take it
+	pthread_mutex_t mu_;//Grow
+};
+
+struct LDS_SimConfig{
+	uint64_t size;
+	uint64_t latency_us;
+	uint64_t bandwidth_mb;
+	uint64_t sector;
+	uint64_t sync_us;
+	std::string file;//empty for the memory backend
+
+	LDS_SimConfig() : size(0), latency_us(0), bandwidth_mb(0), sector(512), sync_us(0) { }
+};
+
+class LDS_SimDevice : public LDS_Device{
+public:
+	LDS_SimDevice(const LDS_SimConfig& config);
+	virtual ~LDS_SimDevice();
+
+	virtual uint64_t Size(){ return config_.size; }
+	virtual ssize_t Write(uint64_t offset, const void *buf, size_t n);
+	virtual ssize_t WriteV(uint64_t offset, const struct iovec *iov, int iovcnt);
+	virtual ssize_t WritePolled(uint64_t offset, const struct iovec *iov, int iovcnt, bool durable);
+	virtual ssize_t Read(uint64_t offset, void *buf, size_t n);
+	virtual int Sync(uint64_t offset, uint64_t n);
+	virtual int StartSync(uint64_t offset, uint64_t n);
+	virtual int SyncRanges(const std::vector<std::pair<uint64_t, uint64_t> >& ranges);
+	virtual void *Map(uint64_t offset, size_t n);
+	virtual void Unmap(void *addr, size_t n);
+	virtual void *MapWritable(uint64_t offset, size_t n);
+	virtual int SyncMapped(void *addr, uint64_t offset, uint64_t n);
+	virtual std::string Name();
+
+	static int ParseSpec(const std::string& spec, LDS_SimConfig *config);
+
+protected:
+	virtual int MapFd(){ return fd_; }
+
+private:
+	void Charge(uint64_t offset, size_t n, uint64_t fixed_us, bool write=false);//sleeps for the simulated cost, unaligned writes pay a read-modify-write
+
+	LDS_SimConfig config_;
+	char *mem_;//shared mapping of the memory (memfd) or file backend
+	int fd_;
+
+	pthread_mutex_t mu_;
+	uint64_t busy_until_;//time when the simulated transfers queued so far are done
+};
+
+//open the backend according to the path, exit on error like Storage_init
+LDS_Device *LDS_OpenDevice(const std::string& path);
+
+//the device of path shared in the process (opened on the first call, never closed), so that the
+//namespaces of one device (lds_ns.h) and a sim:mem device opened twice see the same storage
+LDS_Device *LDS_SharedDevice(const std::string& path);
+
+}//leveldb
+
+#endif
@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include "db/lds_image.h"
+#include "db/lds_io.h"
+#include "db/log_format.h" //in LevelDB
+#include "util/coding.h" //in LevelDB
+#include "util/crc32c.h" //in LevelDB
+
+namespace leveldb {
+
+namespace {
+
+uint64_t MonoMicros(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+uint64_t RoundUp(uint64_t n){
+	return (n+4095)/4096*4096;
+}
+
+struct Extent{
+	uint32_t area;//0 slots (lds->dev), 1 log areas (lds->log_dev)
+	uint32_t crc;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t image_offset;
+};
+
+bool ByOffset(const Extent& a, const Extent& b){
+	return a.area!=b.area ? a.area<b.area : a.offset<b.offset;
+}
+
+//the records of a log area: the concatenated payloads, and where the records end
+uint64_t LogRecords(LDS_Device *dev, uint64_t offset, uint64_t area_size, std::string *payloads){
+	const char *area=(const char*)dev->Map(offset, area_size);
+	if(area==NULL){
+		return 0;
+	}
+	uint64_t pos=0, len;
+	while(pos<area_size){
+		int res=Log_check_record(area+pos, area_size-pos, &len);
+		if(res!=LOG_RECORD_OK && res!=LOG_RECORD_UNCHECKED){
+			break;
+		}
+		if(payloads!=NULL){
+			payloads->append(area+pos+20, len-24);//header[20], payload, crc[4]
+		}
+		pos+=len;
+	}
+	dev->Unmap((void*)area, area_size);
+	return pos;
+}
+
+//applies one VersionEdit (db/version_edit.cc) to the live table numbers
+bool ApplyEdit(const char *p, const char *limit, std::set<uint64_t> *live){
+	enum{ kComparator=1, kLogNumber=2, kNextFileNumber=3, kLastSequence=4, kCompactPointer=5,
+		kDeletedFile=6, kNewFile=7, kPrevLogNumber=9 };
+	while(p<limit){
+		uint32_t tag, level, len;
+		uint64_t number, size;
+		if((p=GetVarint32Ptr(p, limit, &tag))==NULL){
+			return false;
+		}
+		switch(tag){
+			case kComparator:
+				if((p=GetVarint32Ptr(p, limit, &len))==NULL || p+len>limit){
+					return false;
+				}
+				p+=len;
+				break;
+			case kLogNumber: case kNextFileNumber: case kLastSequence: case kPrevLogNumber:
+				p=GetVarint64Ptr(p, limit, &number);
+				break;
+			case kCompactPointer:
+				if((p=GetVarint32Ptr(p, limit, &level))==NULL || (p=GetVarint32Ptr(p, limit, &len))==NULL || p+len>limit){
+					return false;
+				}
+				p+=len;
+				break;
+			case kDeletedFile:
+				if((p=GetVarint32Ptr(p, limit, &level))==NULL || (p=GetVarint64Ptr(p, limit, &number))==NULL){
+					return false;
+				}
+				live->erase(number);
+				break;
+			case kNewFile:
+				if((p=GetVarint32Ptr(p, limit, &level))==NULL || (p=GetVarint64Ptr(p, limit, &number))==NULL ||
+					(p=GetVarint64Ptr(p, limit, &size))==NULL){
+					return false;
+				}
+				for(int key=0; key<2; key++){//smallest, largest
+					if((p=GetVarint32Ptr(p, limit, &len))==NULL || p+len>limit){
+						return false;
+					}
+					p+=len;
+				}
+				live->insert(number);
+				break;
+			default:
+				return false;
+		}
+		if(p==NULL){
+			return false;
+		}
+	}
+	return true;
+}
+
+//the live tables of the MANIFEST, whose log format (db/log_format.h) is in the payloads of the version area.
+//a torn record at the end is dropped, like the recovery of LevelDB does
+bool LiveTables(const std::string& manifest, std::set<uint64_t> *live, std::string *error){
+	std::string record;
+	uint64_t edits=0;
+	size_t pos=0;
+	while(pos+log::kHeaderSize <= manifest.size()){
+		size_t left= log::kBlockSize - pos%log::kBlockSize;
+		if(left<(size_t)log::kHeaderSize){
+			pos+=left;//the trailer of the block
+			continue;
+		}
+		const char *h=manifest.data()+pos;
+		uint32_t length= (uint32_t)(uint8_t)h[4] | ((uint32_t)(uint8_t)h[5] << 8);
+		int type=(uint8_t)h[6];
+		if(type==log::kZeroType || pos+log::kHeaderSize+length > manifest.size() ||
+			crc32c::Unmask(DecodeFixed32(h))!=crc32c::Value(h+6, 1+length)){
+			break;
+		}
+		const char *data=h+log::kHeaderSize;
+		pos+=log::kHeaderSize+length;
+		if(type==log::kFullType || type==log::kFirstType){
+			record.assign(data, length);
+		}
+		else{
+			record.append(data, length);
+		}
+		if(type==log::kFullType || type==log::kLastType){
+			if(!ApplyEdit(record.data(), record.data()+record.size(), live)){
+				*error="bad version edit in the MANIFEST";
+				return false;
+			}
+			edits++;
+		}
+	}
+	if(edits==0){
+		*error="no MANIFEST in the version area";
+		return false;
+	}
+	return true;
+}
+
+//the extents of a live table. 0, or 1 when its home slot has no header of it (packed, or written
+//before the slot header), -1 on a bad header
+int TableExtents(LDS *lds, uint64_t number, std::vector<Extent> *extents){
+	uint64_t home= lds->slot_offset(lds->home_slot(number));
+	void *page;
+	posix_memalign(&page, 4096, SLOT_HEADER_SIZE);
+	LDS_SlotHeader h;
+	int res= lds->dev->Read(home, page, SLOT_HEADER_SIZE)==SLOT_HEADER_SIZE ? Slot_decode_header((const char*)page, &h) : -2;
+	free(page);
+	if(res==-1 || (res==0 && h.number!=number)){
+		return 1;
+	}
+	if(res!=0){
+		return -1;
+	}
+	Extent e;
+	e.area=0;
+	e.crc=0;
+	uint64_t left=h.size;
+	uint64_t first= left < SLOT_SIZE-SLOT_HEADER_SIZE ? left : SLOT_SIZE-SLOT_HEADER_SIZE;
+	e.offset=home;
+	e.length=RoundUp(SLOT_HEADER_SIZE+first);
+	extents->push_back(e);
+	left-=first;
+	for(size_t i=0; i<h.chain.size(); i++){
+		uint64_t len= left < SLOT_SIZE ? left : SLOT_SIZE;
+		e.offset=lds->slot_offset(h.chain[i]);
+		e.length=RoundUp(len);
+		extents->push_back(e);
+		left-=len;
+	}
+	return 0;
+}
+
+//the copy threads of a backup or a restore, each takes the next extent
+struct Copy{
+	LDS *lds;
+	int fd;//of the image
+	bool restore;
+	std::vector<Extent> *extents;
+
+	pthread_mutex_t mu;
+	size_t next;
+	uint64_t bytes;
+	std::string error;
+
+	LDS_Device *Dev(const Extent& e){ return e.area==0 ? lds->dev : lds->log_dev; }
+
+	bool CopyExtent(Extent *e, char *buf){
+		LDS_Device *dev=Dev(*e);
+		uint32_t crc=0;
+		for(uint64_t done=0; done<e->length; ){
+			uint64_t n= e->length-done < LDS_IMAGE_CHUNK ? e->length-done : LDS_IMAGE_CHUNK;
+			if(!restore){
+				if(dev->ReadUncached(e->offset+done, buf, n)!=(ssize_t)n){
+					return Fail("device read error", *e);
+				}
+				if(pwrite(fd, buf, n, e->image_offset+done)!=(ssize_t)n){
+					return Fail("image write error", *e);
+				}
+			}
+			else{
+				if(pread(fd, buf, n, e->image_offset+done)!=(ssize_t)n){
+					return Fail("image read error", *e);
+				}
+				if(dev->Write(e->offset+done, buf, n)!=(ssize_t)n){
+					return Fail("device write error", *e);
+				}
+			}
+			crc=crc32c::Extend(crc, buf, n);
+			done+=n;
+		}
+		if(!restore){
+			e->crc=crc;
+			return true;
+		}
+		if(crc!=e->crc){
+			return Fail("crc mismatch of the image data", *e);
+		}
+		if(dev->Sync(e->offset, e->length)!=0){
+			return Fail("device sync error", *e);
+		}
+		return true;
+	}
+
+	bool Fail(const char *what, const Extent& e){
+		char buf[160];
+		snprintf(buf, sizeof(buf), "%s at device offset %llu", what, (unsigned long long)e.offset);
+		pthread_mutex_lock(&mu);
+		if(error.empty()){
+			error=buf;
+		}
+		pthread_mutex_unlock(&mu);
+		return false;
+	}
+
+	void Work(){
+		void *buf;
+		posix_memalign(&buf, 4096, LDS_IMAGE_CHUNK);
+		for(;;){
+			pthread_mutex_lock(&mu);
+			size_t i=next++;
+			bool stop= i>=extents->size() || !error.empty();
+			pthread_mutex_unlock(&mu);
+			if(stop || !CopyExtent(&(*extents)[i], (char*)buf)){
+				break;
+			}
+			pthread_mutex_lock(&mu);
+			bytes+=(*extents)[i].length;
+			pthread_mutex_unlock(&mu);
+		}
+		free(buf);
+	}
+
+	static void *WorkerMain(void *arg){
+		((Copy*)arg)->Work();
+		return NULL;
+	}
+
+	//0 on success, -1 with the reason in error
+	int Run(int threads){
+		pthread_mutex_init(&mu, NULL);
+		next=0;
+		bytes=0;
+		std::vector<pthread_t> workers(threads>1 ? threads-1 : 0);
+		for(size_t i=0; i<workers.size(); i++){
+			pthread_create(&workers[i], NULL, &Copy::WorkerMain, this);
+		}
+		Work();
+		for(size_t i=0; i<workers.size(); i++){
+			pthread_join(workers[i], NULL);
+		}
+		pthread_mutex_destroy(&mu);
+		return error.empty() ? 0 : -1;
+	}
+};
+
+void EncodeHeader(char *h, LDS *lds, uint32_t count, uint32_t tables, uint64_t table_offset, uint32_t flags, uint32_t table_crc){
+	memset(h, 0, 4096);
+	memcpy(h, LDS_IMAGE_MAGIC, 4);
+	EncodeFixed32(h+4, LDS_IMAGE_VERSION);
+	EncodeFixed64(h+8, lds->slot_base);
+	EncodeFixed64(h+16, lds->slot_amount);
+	EncodeFixed32(h+24, count);
+	EncodeFixed32(h+28, tables);
+	EncodeFixed64(h+32, table_offset);
+	EncodeFixed32(h+40, flags);
+	EncodeFixed32(h+44, crc32c::Mask(table_crc));
+	EncodeFixed32(h+48, crc32c::Mask(crc32c::Value(h, 48)));
+}
+
+}//namespace
+
+int LDS_BackupImage(LDS *lds, const std::string& image_path, int threads, LDS_ImageStats *stats, std::string *error){
+	uint64_t start=MonoMicros();
+	*stats=LDS_ImageStats();
+
+	if(lds->slots.epoch_count.load()>1){
+		*error="the LDS was grown, the home slots of its tables depend on its slot epochs, which images do not hold";
+		return -1;
+	}
+
+	//the current version, and the valid part of the log areas
+	std::string manifest;
+	uint64_t version_end=LogRecords(lds->log_dev, lds->log_base, VERSION_LOG_SIZE, &manifest);
+	uint64_t backup_end=LogRecords(lds->log_dev, lds->log_base+ VERSION_LOG_SIZE, BACKUP_SIZE, NULL);
+	std::set<uint64_t> live;
+	if(!LiveTables(manifest, &live, error)){
+		return -1;
+	}
+
+	std::vector<Extent> extents;
+	Extent e;
+	e.area=1;
+	e.crc=0;
+	//up to the page holding the first byte after the records, so no older record follows them after a restore
+	e.offset=lds->log_base;
+	e.length=std::min<uint64_t>(RoundUp(version_end+1), VERSION_LOG_SIZE);
+	extents.push_back(e);
+	e.offset=lds->log_base+ VERSION_LOG_SIZE;
+	e.length=std::min<uint64_t>(RoundUp(backup_end+1), BACKUP_SIZE);
+	extents.push_back(e);
+
+	std::vector<uint64_t> unresolved;
+	for(std::set<uint64_t>::iterator it=live.begin(); it!=live.end(); ++it){
+		int res=TableExtents(lds, *it, &extents);
+		if(res<0){
+			char buf[96];
+			snprintf(buf, sizeof(buf), "bad slot header of table %06llu", (unsigned long long)*it);
+			*error=buf;
+			return -1;
+		}
+		if(res==1){
+			unresolved.push_back(*it);
+		}
+	}
+
+	//small tables are in pack slots, LDS_recover found them when the LDS was opened. Only read
+	//here, the slots are not scanned again.
+	uint32_t flags=0;
+	std::map<uint64_t, uint64_t> pack_slots;//slot index -> end of its tables
+	std::vector<bool> in_pack(unresolved.size(), false);
+	pthread_mutex_lock(&lds->mu);
+	for(size_t i=0; i<unresolved.size(); i++){
+		std::map<uint64_t, LDS_PackedTable>::iterator it=lds->packed.find(unresolved[i]);
+		if(it!=lds->packed.end()){
+			pack_slots[it->second.slot]=lds->pack_slots[it->second.slot].write_offset;
+			in_pack[i]=true;
+		}
+	}
+	pthread_mutex_unlock(&lds->mu);
+	for(size_t i=0; i<unresolved.size(); i++){
+		if(in_pack[i]){
+			continue;
+		}
+		//a slot written before the slot header, the whole slot is copied
+		LDS_Slot slot(std::string("0"), false);
+		slot.phy_offset=lds->slot_offset(lds->home_slot(unresolved[i]));
+		slot.number=unresolved[i];
+		slot.dev=lds->dev;
+		std::vector<uint64_t> chain;
+		uint64_t size_old=read_chunk_size(&slot);
+		if(size_old==0 || read_chain(&slot, size_old, &chain)<0){
+			char buf[96];
+			snprintf(buf, sizeof(buf), "table %06llu not found", (unsigned long long)unresolved[i]);
+			*error=buf;
+			return -1;
+		}
+		e.area=0;
+		e.offset=slot.phy_offset;
+		e.length=SLOT_SIZE;
+		extents.push_back(e);
+		for(size_t k=0; k<chain.size(); k++){
+			e.offset=lds->slot_offset(chain[k]);
+			extents.push_back(e);
+		}
+	}
+	for(std::map<uint64_t, uint64_t>::iterator it=pack_slots.begin(); it!=pack_slots.end(); ++it){
+		e.area=0;
+		e.offset=lds->slot_offset(it->first);
+		e.length=RoundUp(it->second);
+		extents.push_back(e);
+		flags|=LDS_IMAGE_PACKED;
+	}
+
+	//in device order, adjacent slots as one extent
+	std::sort(extents.begin(), extents.end(), ByOffset);
+	std::vector<Extent> merged;
+	for(size_t i=0; i<extents.size(); i++){
+		if(!merged.empty()){
+			Extent& last=merged.back();
+			if(last.area==extents[i].area && last.length%SLOT_SIZE==0 && last.offset+last.length==extents[i].offset &&
+				last.length+extents[i].length <= LDS_IMAGE_EXTENT_MAX){
+				last.length+=extents[i].length;
+				continue;
+			}
+		}
+		merged.push_back(extents[i]);
+	}
+	uint64_t image_offset=0;
+	for(size_t i=0; i<merged.size(); i++){
+		merged[i].image_offset=image_offset;
+		image_offset+=merged[i].length;
+	}
+
+	int fd=open(image_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(fd<0){
+		*error="cannot create "+image_path;
+		return -1;
+	}
+	Copy copy;
+	copy.lds=lds;
+	copy.fd=fd;
+	copy.restore=false;
+	copy.extents=&merged;
+	if(copy.Run(threads)!=0){
+		*error=copy.error;
+		close(fd);
+		return -1;
+	}
+
+	//the extent table and the header, after the data
+	std::string table;
+	for(size_t i=0; i<merged.size(); i++){
+		char entry[LDS_IMAGE_ENTRY_SIZE];
+		memset(entry, 0, sizeof(entry));
+		EncodeFixed32(entry, merged[i].area);
+		EncodeFixed32(entry+4, merged[i].crc);
+		EncodeFixed64(entry+8, merged[i].offset- (merged[i].area==0 ? lds->slot_base : lds->log_base));
+		EncodeFixed64(entry+16, merged[i].length);
+		EncodeFixed64(entry+24, merged[i].image_offset);
+		table.append(entry, sizeof(entry));
+	}
+	table.resize(RoundUp(table.size()), 0);
+	char header[4096];
+	EncodeHeader(header, lds, merged.size(), live.size(), image_offset, flags, crc32c::Value(table.data(), table.size()));
+	table.append(header, sizeof(header));
+	if(pwrite(fd, table.data(), table.size(), image_offset)!=(ssize_t)table.size() || fsync(fd)!=0){
+		*error="image write error";
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	stats->tables=live.size();
+	stats->extents=merged.size();
+	stats->bytes=copy.bytes;
+	stats->micros=MonoMicros()-start;
+	return 0;
+}
+
+int LDS_RestoreImage(LDS *lds, const std::string& image_path, int threads, LDS_ImageStats *stats, std::string *error){
+	uint64_t start=MonoMicros();
+	*stats=LDS_ImageStats();
+
+	if(lds->slots.epoch_count.load()>1){
+		*error="the LDS was grown, the home slots of its tables depend on its slot epochs, which images do not hold";
+		return -1;
+	}
+
+	int fd=open(image_path.c_str(), O_RDONLY);
+	if(fd<0){
+		*error="cannot open "+image_path;
+		return -1;
+	}
+	off_t end=lseek(fd, 0, SEEK_END);
+	char h[4096];
+	if(end<4096 || pread(fd, h, sizeof(h), end-4096)!=(ssize_t)sizeof(h) || memcmp(h, LDS_IMAGE_MAGIC, 4)!=0 ||
+		DecodeFixed32(h+4)!=LDS_IMAGE_VERSION || crc32c::Unmask(DecodeFixed32(h+48))!=crc32c::Value(h, 48)){
+		*error=image_path+" is not an LDS image of this version";
+		close(fd);
+		return -1;
+	}
+	if(DecodeFixed64(h+16)!=lds->slot_amount){
+		char buf[160];
+		snprintf(buf, sizeof(buf), "the image is of a device with %llu slots, this one has %llu",
+			(unsigned long long)DecodeFixed64(h+16), (unsigned long long)lds->slot_amount);
+		*error=buf;
+		close(fd);
+		return -1;
+	}
+	uint32_t count=DecodeFixed32(h+24);
+	uint64_t table_offset=DecodeFixed64(h+32);
+	std::string table(RoundUp((uint64_t)count*LDS_IMAGE_ENTRY_SIZE), 0);
+	if(pread(fd, &table[0], table.size(), table_offset)!=(ssize_t)table.size() ||
+		crc32c::Unmask(DecodeFixed32(h+44))!=crc32c::Value(table.data(), table.size())){
+		*error="bad extent table in "+image_path;
+		close(fd);
+		return -1;
+	}
+	std::vector<Extent> extents(count);
+	std::set<uint64_t> imaged;//slots
+	for(uint32_t i=0; i<count; i++){
+		const char *entry=table.data()+ (size_t)i*LDS_IMAGE_ENTRY_SIZE;
+		extents[i].area=DecodeFixed32(entry);
+		extents[i].crc=DecodeFixed32(entry+4);
+		extents[i].offset=DecodeFixed64(entry+8)+ (extents[i].area==0 ? lds->slot_base : lds->log_base);
+		extents[i].length=DecodeFixed64(entry+16);
+		extents[i].image_offset=DecodeFixed64(entry+24);
+		if(extents[i].area==0){
+			for(uint64_t off=0; off<extents[i].length; off+=SLOT_SIZE){
+				imaged.insert((extents[i].offset+off-lds->slot_base)/SLOT_SIZE);
+			}
+		}
+	}
+
+	Copy copy;
+	copy.lds=lds;
+	copy.fd=fd;
+	copy.restore=true;
+	copy.extents=&extents;
+	int res=copy.Run(threads);
+	close(fd);
+	if(res!=0){
+		*error=copy.error;
+		return -1;
+	}
+
+	//stale slot and pack headers of the target would be taken as live by the scan at start-up.
+	//LDS_recover marked the slots holding one when the LDS was opened, only those are cleared.
+	void *page;
+	posix_memalign(&page, 4096, PACK_HEADER_SIZE);
+	memset(page, 0, PACK_HEADER_SIZE);
+	for(uint64_t i=0; i<lds->slot_amount; i++){
+		if(lds->slots.online[i] && imaged.count(i)==0){
+			lds->dev->Write(lds->slot_offset(i), page, PACK_HEADER_SIZE);
+		}
+	}
+	free(page);
+	if(lds->dev->Sync(lds->slot_base, lds->slot_amount*SLOT_SIZE)!=0){
+		*error="device sync error";
+		return -1;
+	}
+
+	stats->tables=DecodeFixed32(h+28);
+	stats->extents=count;
+	stats->bytes=copy.bytes;
+	stats->micros=MonoMicros()-start;
+	return 0;
+}
+
+}//leveldb
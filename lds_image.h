@@ -0,0 +1,64 @@
+#ifndef LDS_IMAGE_H
+#define LDS_IMAGE_H
+
+#include <stdint.h>
+#include <string>
+
+namespace leveldb {
+
+class LDS;
+
+/*
+ Backup and restore of the live data of an LDS, without copying the whole device.
+
+ The live tables are those of the current version in the MANIFEST (the version area). A
+ backup copies the version area and the backup area (.log) up to the end of their records,
+ and the slots of the live tables: a table with a slot header up to its size, its
+ continuation slots, the pack slots holding live small tables up to their last entry, and
+ the whole slot of a table written before the slot header. Adjacent slots are merged into
+ one extent (up to LDS_IMAGE_EXTENT_MAX), and the extents are copied by several threads with
+ large reads (LDS_IMAGE_CHUNK, O_DIRECT on a block device), so the time goes with the live
+ data, not with the device size.
+
+ The image is a regular file: the extents at 4KB aligned offsets, then the extent table, then
+ one page of header at the end (so the data can be written first and in parallel):
+   header:  magic[4], version[4], slot_base[8], slot_amount[8], count[4], tables[4],
+            table offset[8], flags[4], table crc[4], header crc[4]
+   extent:  area[4] (0 slots, 1 log areas), crc[4] (of the data), offset[8], length[8], image offset[8]
+ The offset of an extent is relative to slot 0, or to the version area.
+
+ A restore writes the extents back at their offsets and syncs them. The target, a device or a
+ namespace (lds_ns.h), must have the same number of slots (the slot of a table follows from
+ its number), which is checked. An LDS grown by LDS::grow (more than one slot epoch) is
+ neither backed up nor restored.
+ The first page of every slot that is not in the image but was in use on the target (found by
+ LDS_recover when the LDS was opened) is cleared as well, so the slot map rebuild at the next
+ open does not find stale tables (slot or pack headers) of the target. A backup takes the
+ pack slots of its tables from the pack state LDS_recover built, it does not scan the slots.
+
+ Nothing may write the LDS during a backup or a restore: run them on a closed db (lds_backup.cc).
+*/
+
+#define LDS_IMAGE_MAGIC "LDSI"
+#define LDS_IMAGE_VERSION 2 //1 had device offsets
+#define LDS_IMAGE_CHUNK (4*1024*1024) //one read or write of a copy thread
+#define LDS_IMAGE_EXTENT_MAX (64*1024*1024) //adjacent slots are merged up to this
+#define LDS_IMAGE_ENTRY_SIZE 40
+#define LDS_IMAGE_PACKED 1 //flag: the image holds pack slots, for information
+
+struct LDS_ImageStats{
+	uint64_t tables;//live tables
+	uint64_t extents;
+	uint64_t bytes;//of data copied
+	uint64_t micros;
+
+	LDS_ImageStats() : tables(0), extents(0), bytes(0), micros(0) { }
+};
+
+//0 on success, -1 with the reason in *error
+int LDS_BackupImage(LDS *lds, const std::string& image_path, int threads, LDS_ImageStats *stats, std::string *error);
+int LDS_RestoreImage(LDS *lds, const std::string& image_path, int threads, LDS_ImageStats *stats, std::string *error);
+
+}//leveldb
+
+#endif
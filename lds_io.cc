@@ -1,16 +1,185 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <sched.h>
 
 #include "db/lds_io.h"
+#include "db/lds_trace.h"
 #include "util/coding.h" //in LevelDB
+#include "util/crc32c.h" //in LevelDB
 
 #define MAGIC "LDSX"
-extern char * OnlineMap; //lds.cc
+#define SLOT_EPOCH_MAGIC "LDSE"
+extern char * OnlineMap; //lds.cc, of the first LDS
 extern uint64_t SlotTotal;
+extern uint64_t SlotBase;
+
 
 namespace leveldb {
 
+static uint8_t Log_area(LDS_Log *log){
+	return log->file_name.find("MANIFEST")!=-1 ? LDS_AREA_VERSION : LDS_AREA_BACKUP;
+}
+
+static __thread int table_level=-1;//see LDS_SetTableLevel
+
+void LDS_SetTableLevel(int level){
+	table_level=level;
+}
+
+LDS_TableLevelScope::LDS_TableLevelScope(int level) : prev_(table_level) {
+	table_level=level;
+}
 
+LDS_TableLevelScope::~LDS_TableLevelScope(){
+	table_level=prev_;
+}
+
+static size_t Slot_write_out(LDS_Slot *slot, bool direct=false){
+	/*write [flush_offset, write_head) of the slot being filled to the OS buffer*/
+	//direct: the range is final (a seal, or a full slot), it may go around the OS buffer
+	uint64_t flush_bytes = slot->write_head - slot->flush_offset;
+	
+	LDS_RateLimiter *limiter= slot->lds!=NULL ? slot->lds->limiter : NULL;
+	LDS_TRACE_BEGIN(t);
+	if(slot->map!=NULL){
+		//mmap write mode, the bytes are in the OS buffer already
+		if(limiter!=NULL){
+			limiter->Request(flush_bytes);
+		}
+	}
+	else if(limiter==NULL){
+		if(direct){
+			slot->dev->WriteDirect(slot->seg_offset+ slot->flush_offset, slot->buffer+ slot->flush_offset, flush_bytes);
+		}
+		else{
+			slot->dev->Write(slot->seg_offset+ slot->flush_offset, slot->buffer+ slot->flush_offset, flush_bytes);
+		}
+	}
+	else{
+		//compaction data goes out in paced pieces, so WAL writes do not queue behind megabytes of it
+		for(uint64_t done=0; done<flush_bytes; ){
+			uint64_t n= flush_bytes-done < LDS_RATE_CHUNK ? flush_bytes-done : LDS_RATE_CHUNK;
+			limiter->Request(n);
+			if(direct){
+				slot->dev->WriteDirect(slot->seg_offset+ slot->flush_offset+ done, slot->buffer+ slot->flush_offset+ done, n);
+			}
+			else{
+				slot->dev->Write(slot->seg_offset+ slot->flush_offset+ done, slot->buffer+ slot->flush_offset+ done, n);
+			}
+			done+=n;
+		}
+	}
+	LDS_TRACE(LDS_TRACE_SLOT_FLUSH, LDS_AREA_SLOT, slot->seg_offset+ slot->flush_offset, flush_bytes, t);
+	
+	slot->flush_offset =  slot->write_head;
+	return flush_bytes;
+}
+
+static void Slot_extend(LDS_Slot *slot){
+	/*The current slot is full, continue the table in another slot, the adjacent one if it is free*/
+	uint64_t last= slot->chain.empty() ? slot->lds->home_slot(slot->number) : slot->chain.back();
+	int64_t next=Alloc_free_slot_in(&slot->lds->slots, last+1);
+	if(next<0 || slot->chain.size()>=CHAIN_MAX){
+		fprintf(stderr,"lds_io.cc, Slot_extend, cannot extend, exit, name=%s, slot->size=%llu\n",slot->file_name.c_str(),(unsigned long long)slot->size );
+		exit(9);
+	}
+	slot->lds->reserve_slot(next);
+
+	char *next_map=NULL;
+	if(slot->map!=NULL){
+		next_map=(char*)slot->dev->MapWritable(slot->lds->slot_offset(next), SLOT_SIZE);
+		if(next_map==NULL){
+			fprintf(stderr,"lds_io.cc, Slot_extend, cannot map, exit, name=%s\n",slot->file_name.c_str());
+			exit(9);
+		}
+	}
+
+	Slot_write_out(slot, true);//the first slot goes without its header, which is written when the chain is known
+	slot->chain.push_back(next);
+	if(next_map!=NULL){
+		slot->chain_maps.push_back(next_map);
+		slot->buffer=next_map;
+	}
+	slot->seg_offset= slot->lds->slot_offset(next);
+	slot->write_head= 0;
+	slot->flush_offset= 0;
+	LDS_TRACE(LDS_TRACE_ALLOC_SLOT, LDS_AREA_SLOT, slot->seg_offset, slot->number, 0);
+}
+
+static void Slot_cache_meta(LDS_Slot *slot){
+	//the table is sealed, keep its tail (filter, metaindex, index, footer) for the opens to come.
+	//the buffer holds the last bytes of the table, after the header in the first slot.
+	if(slot->lds!=NULL && slot->lds->meta_cache!=NULL){
+		//where the table is, for the opens to skip locating it
+		std::vector<std::pair<uint64_t, size_t> > extents;
+		uint64_t offset, packed_size;
+		if(slot->lds->locate_packed(slot->number, &offset, &packed_size)){
+			extents.push_back(std::make_pair(offset, (size_t)packed_size));
+		}
+		else{
+			uint64_t left= slot->size;
+			uint64_t first= left < SLOT_SIZE-slot->data_offset ? left : SLOT_SIZE-slot->data_offset;
+			extents.push_back(std::make_pair(slot->phy_offset+slot->data_offset, (size_t)first));
+			left-=first;
+			for(size_t i=0; i<slot->chain.size(); i++){
+				size_t len= left < SLOT_SIZE ? left : SLOT_SIZE;
+				extents.push_back(std::make_pair(slot->lds->slot_offset(slot->chain[i]), len));
+				left-=len;
+			}
+		}
+		uint64_t skip= slot->chain.empty() ? slot->data_offset : 0;
+		if(!slot->gathered){
+			uint64_t bytes= slot->write_head - skip;
+			slot->lds->meta_cache->Insert(slot->number, (const char*)slot->buffer + skip, slot->size - bytes, slot->size, extents);
+			return;
+		}
+		//the tail may have gone out from the caller buffers, read it back through a mapping of the table
+		size_t total;
+		void *base=slot->dev->MapExtents(extents, &total);
+		if(base!=NULL){
+			slot->lds->meta_cache->Insert(slot->number, (const char*)base, 0, slot->size, extents);
+			slot->dev->UnmapExtents(base, total);
+		}
+	}
+}
+
+static void Slot_encode_header(LDS_Slot *slot, char *h){
+	memset(h, 0, SLOT_HEADER_SIZE);
+	memcpy(h, SLOT_HEADER_MAGIC, 4);
+	EncodeFixed32(h+4, SLOT_HEADER_VERSION);
+	EncodeFixed64(h+8, slot->number);
+	EncodeFixed64(h+16, slot->size);
+	EncodeFixed32(h+24, (uint32_t)slot->level);
+	EncodeFixed32(h+28, slot->chain.size());
+	EncodeFixed32(h+32, crc32c::Mask(slot->crc));
+	for(size_t i=0; i<slot->chain.size(); i++){
+		EncodeFixed64(h+40+i*8, slot->chain[i]);
+	}
+	EncodeFixed32(h+36, crc32c::Mask(crc32c::Value(h, SLOT_HEADER_SIZE)));//computed with its own field 0
+}
+
+int Slot_decode_header(const char *h, LDS_SlotHeader *header){
+	if(memcmp(h, SLOT_HEADER_MAGIC, 4)!=0){
+		return -1;
+	}
+	char copy[SLOT_HEADER_SIZE];
+	memcpy(copy, h, SLOT_HEADER_SIZE);
+	EncodeFixed32(copy+36, 0);
+	uint32_t count=DecodeFixed32(h+28);
+	if(DecodeFixed32(h+4)!=SLOT_HEADER_VERSION || count>CHAIN_MAX ||
+		crc32c::Unmask(DecodeFixed32(h+36))!=crc32c::Value(copy, SLOT_HEADER_SIZE)){
+		return -2;
+	}
+	header->number=DecodeFixed64(h+8);
+	header->size=DecodeFixed64(h+16);
+	header->level=(int32_t)DecodeFixed32(h+24);
+	header->data_crc=crc32c::Unmask(DecodeFixed32(h+32));
+	header->chain.clear();
+	for(uint32_t i=0; i<count; i++){
+		header->chain.push_back(DecodeFixed64(h+40+i*8));
+	}
+	return 0;
+}
 
 size_t Slot_write(const void * ptr, size_t size, size_t count, LDS_Slot * slot ){
 		//only write to LDS buffer
@@ -18,25 +187,136 @@ size_t Slot_write(const void * ptr, size_t size, size_t count, LDS_Slot * slot )
 		write_bytes=size*count;
 		//printf("lds_io.cc, SLot_write, write_bytes=%d\n",write_bytes);
 		
-		if(slot->size + write_bytes > SLOT_SIZE){
-			fprintf(stderr,"lds_io.cc, SLot_write, overflow,exit, name=%s, slot->size=%d\n",slot->file_name.c_str(),slot->size );
-			
-			exit(9);
+		const char *src=(const char*)ptr;
+		size_t remain=write_bytes;
+		while(remain>0){
+			if(slot->write_head >= SLOT_SIZE){
+				Slot_extend(slot);
+				continue;
+			}
+			size_t n= remain < SLOT_SIZE - slot->write_head ? remain : SLOT_SIZE - slot->write_head;
+			memcpy(slot->buffer + slot->write_head,  src, n);
+			LDS_TRACE(LDS_TRACE_SLOT_WRITE, LDS_AREA_SLOT, slot->seg_offset+ slot->write_head, n, 0);
 		
+			slot->crc = crc32c::Extend(slot->crc, src, n);
+			slot->write_head += n ;
+			slot->size += n;
+			src += n;
+			remain -= n;
 		}
-		memcpy(slot->buffer + slot->write_head,  ptr, write_bytes);
-		
-		slot->write_head += write_bytes ;
-		slot->size += write_bytes;
 		//printf("lds_io.cc, SLot_write, size=%d\n",slot->size);
 
 		return write_bytes;
 
 }
 
+static void Slot_gather_out(LDS_Slot *slot, const char *src, uint64_t n){
+	/*write [flush_offset, write_head) of the buffer and then n bytes of src in one I/O, src follows write_head*/
+	struct iovec iov[2];
+	int cnt=0;
+	uint64_t pending= slot->write_head - slot->flush_offset;
+	if(pending>0){
+		iov[cnt].iov_base= (char*)slot->buffer + slot->flush_offset;
+		iov[cnt].iov_len= pending;
+		cnt++;
+	}
+	iov[cnt].iov_base= (void*)src;
+	iov[cnt].iov_len= n;
+	cnt++;
+
+	LDS_RateLimiter *limiter= slot->lds!=NULL ? slot->lds->limiter : NULL;
+	if(limiter!=NULL){
+		limiter->Request(pending+n);
+	}
+	LDS_TRACE_BEGIN(t);
+	if(slot->dev->WriteV(slot->seg_offset+ slot->flush_offset, iov, cnt)!=(ssize_t)(pending+n)){
+		fprintf(stderr,"lds_io.cc, Slot_gather_out, write error, exit, name=%s\n",slot->file_name.c_str());
+		exit(9);
+	}
+	LDS_TRACE(LDS_TRACE_SLOT_FLUSH, LDS_AREA_SLOT, slot->seg_offset+ slot->flush_offset, pending+n, t);
+}
+
+size_t Slot_append(const void *ptr, size_t n, LDS_Slot *slot){
+	//LevelDB's buffer is only valid during Append, a large block is written out now instead of being copied.
+	//a table that may still be packed, or the mmap write mode (the copy is the write), takes the copy.
+	if(n < LDS_GATHER_MIN || slot->map!=NULL ||
+		(slot->lds!=NULL && slot->chain.empty() && slot->size + n <= slot->lds->options.pack_threshold)){
+		return Slot_write(ptr, 1, n, slot);
+	}
+	uint64_t piece_max= slot->lds!=NULL && slot->lds->limiter!=NULL ? LDS_RATE_CHUNK : SLOT_SIZE;//paced like Slot_write_out
+
+	const char *src=(const char*)ptr;
+	size_t remain=n;
+	while(remain>0){
+		if(slot->write_head >= SLOT_SIZE){
+			Slot_extend(slot);
+			continue;
+		}
+		uint64_t len= remain < SLOT_SIZE - slot->write_head ? remain : SLOT_SIZE - slot->write_head;
+		if(len > piece_max){
+			len=piece_max;
+		}
+		Slot_gather_out(slot, src, len);
+
+		slot->crc = crc32c::Extend(slot->crc, src, len);
+		slot->write_head += len;
+		slot->size += len;
+		slot->flush_offset = slot->write_head;
+		slot->gathered = true;
+		src += len;
+		remain -= len;
+	}
+	return n;
+}
+
+static void Ring_copy(LDS_Log *log, uint64_t pos, const void *src, uint64_t n){
+	//pos is an offset in the log area, the ring keeps it at pos % ring_size
+	const char *p=(const char*)src;
+	while(n>0){
+		uint64_t off= pos % log->ring_size;
+		uint64_t len= n < log->ring_size-off ? n : log->ring_size-off;
+		memcpy((char*)log->buffer+ off, p, len);
+		pos+=len;
+		p+=len;
+		n-=len;
+	}
+}
+
+static size_t Log_write_out(LDS_Log * log, int *synced);
+
+static bool Log_has_room(LDS_Log *log, uint64_t end){
+	//the page of flush_offset is written again by the next flush, it stays in the ring
+	uint64_t kept= log->flush_offset.load(std::memory_order_acquire)/4096*4096;
+	return end - kept <= log->ring_size;
+}
+
+static void Log_make_room(LDS_Log *log, uint64_t end){
+	//the ring is full: write out what is published. If that is not enough, the records before
+	//ours are being copied, wait for them.
+	while(!Log_has_room(log, end)){
+		pthread_mutex_lock(&log->flush_mu);
+		if(!Log_has_room(log, end)){
+			Log_write_out(log, NULL);
+		}
+		pthread_mutex_unlock(&log->flush_mu);
+		if(!Log_has_room(log, end)){
+			sched_yield();
+		}
+	}
+}
+
+static void Log_wait_published(LDS_Log *log, uint64_t start){
+	//the records before start are being copied by other writers
+	for(int spins=0; log->write_head.load(std::memory_order_acquire)!=start; spins++){
+		if(spins>=LOG_PUBLISH_SPINS){
+			sched_yield();
+		}
+	}
+}
+
 size_t Log_write(const void * ptr, size_t size, size_t count, LDS_Log * log ){
 	/*This function append the construct the log objects*/
-	//only write to LDS buffer
+	//only write to LDS buffer. Several threads may append at once, see LDS_Log.
 
 	uint32_t write_bytes;//payload
 	write_bytes=size*count;
@@ -44,46 +324,61 @@ size_t Log_write(const void * ptr, size_t size, size_t count, LDS_Log * log ){
 	
 
 	uint32_t header_size=20;//magic[4],type[4],sn[8],size[4];
-	char head[header_size];
-	sprintf(head,"%s",MAGIC);
-	EncodeFixed32(head+4, 2);//2 presents the type is common delta version
-	EncodeFixed64(head+8, 0x333322);//log->sn
-	EncodeFixed64(head+16, write_bytes);//
-	
-	uint32_t crc=0x77777777;//crc[4], call the crc32c::Extend(type_crc_[t], ptr, n) to calculate the crc
-	uint32_t crc_size=sizeof(crc);
-	char crc_buf[crc_size];
-	EncodeFixed32(crc_buf, crc);
-	
+	uint32_t crc_size=4;
+	uint64_t record_size= header_size+write_bytes + crc_size;
+
+	uint64_t start=log->reserve_head.fetch_add(record_size);
 	if(log->file_name.find("MANIFEST")!=-1){
 		//printf("lds_io.cc, Log_write, log->size=%d\n",  log->size);
-		if(log->size +  header_size+write_bytes + crc_size > VERSION_LOG_SIZE){
+		if(start + record_size > VERSION_LOG_SIZE){
 			fprintf(stderr,"lds_io.cc,  Log_write,version area overflow\n");
 			exit(9);
 		}
 	}
 	else if(log->file_name.find(".log")!=-1){
 		//printf("lds_io.cc, Log_write, log->size=%d\n",  log->size);
-		if(log->size +  header_size+write_bytes + crc_size > BACKUP_SIZE){
+		if(start + record_size > BACKUP_SIZE){
 			fprintf(stderr,"lds_io.cc, Log_write, backup area overflow\n");
 			exit(9);
 		}
 	}
 	
-	memcpy(log->buffer + log->write_head,  head, header_size);//copy the header
-
-	memcpy(log->buffer + log->write_head+header_size,  ptr, write_bytes);//copy the payload
-
-	
-
-	memcpy(log->buffer + log->write_head+header_size+write_bytes,  crc_buf, crc_size);//copy the crc
-
-
+	char head[header_size];
+	memcpy(head, MAGIC, 4);
+	EncodeFixed32(head+4, 2);//2 presents the type is common delta version
+	EncodeFixed64(head+8, log->sn.fetch_add(1));
+	EncodeFixed32(head+16, write_bytes);//4 bytes, the header ends here
+	char crc_buf[crc_size];
+	EncodeFixed32(crc_buf, crc32c::Mask(crc32c::Extend(crc32c::Value(head, header_size), (const char*)ptr, write_bytes)));//crc[4] of the header and the payload
+	LDS_TRACE(LDS_TRACE_LOG_WRITE, Log_area(log), log->phy_offset+ start, record_size, 0);
 
-	log->write_head += header_size+write_bytes + crc_size;
-	
-	log->size += header_size+write_bytes + crc_size;
-	
+	if(record_size + 4096 <= log->ring_size){
+		//copied in parallel with the other writers, then published in reservation order
+		Log_make_room(log, start + record_size);
+		Ring_copy(log, start, head, header_size);
+		Ring_copy(log, start+header_size, ptr, write_bytes);
+		Ring_copy(log, start+header_size+write_bytes, crc_buf, crc_size);
+		Log_wait_published(log, start);
+	}
+	else{
+		//larger than the ring: once the records before it are published, it is copied and
+		//published in pieces, flushing the ring as it fills
+		Log_wait_published(log, start);
+		const char *parts[3]={head, (const char*)ptr, crc_buf};
+		uint64_t lens[3]={header_size, write_bytes, crc_size};
+		uint64_t pos=start;
+		for(int i=0; i<3; i++){
+			for(uint64_t done=0; done<lens[i]; ){
+				uint64_t n= lens[i]-done < log->ring_size/2 ? lens[i]-done : log->ring_size/2;
+				Log_make_room(log, pos + n);
+				Ring_copy(log, pos, parts[i]+done, n);
+				pos+=n;
+				done+=n;
+				log->write_head.store(pos, std::memory_order_release);
+			}
+		}
+	}
+	log->write_head.store(start + record_size, std::memory_order_release);
 
 	return write_bytes;
 	
@@ -95,38 +390,87 @@ size_t Slot_flush(LDS_Slot *slot){
 		//flush to OS buffer
 		//printf("lds_io.cc, Slot_flush, begin\n");
 		
+		if(slot->chain.empty() && slot->map==NULL){
+			//the first slot stays in the buffer until Slot_sync, which writes it with its header in one I/O
+			//(or packs a small table)
+			return 0;
+		}
+		return Slot_write_out(slot);
 		
-		lseek64(slot->fd, slot->phy_offset+ slot->flush_offset, SEEK_SET);
-		
-		uint64_t flush_bytes = slot->write_head - slot->flush_offset;
-		
-		write(slot->fd, slot->buffer+ slot->flush_offset, flush_bytes);
-		
-		slot->flush_offset =  slot->write_head;
-		
-		//printf("lds_id.cc, Slot_flush, end, name=%s, slot->flush_offset=%d\n",slot->file_name.c_str(),slot->flush_offset);
+}
 
-		//exit(9);
-		return flush_bytes;
-		
+static int Slot_sync_range(LDS_Slot *slot, char *map, uint64_t offset, uint64_t n){
+	//map is where offset is mapped in the mmap write mode, NULL when buffered
+	if(map!=NULL && n>0 && LDS_SealBatch::Current()==NULL){
+		LDS_TRACE_BEGIN(t);
+		int res=slot->dev->SyncMapped(map, offset, n);
+		LDS_TRACE(LDS_TRACE_SLOT_SYNC, LDS_AREA_SLOT, offset, n, t);
+		return res;
+	}
+	return Sync_range(slot->dev, offset, n);//the OS buffer holds the stores to a mapping as well
 }
 
 size_t Slot_sync(LDS_Slot *slot){
 	/*This function uses sync_file_range to sync the chunk data to the corresponding slot*/
 	//flush to disk
 	//printf("lds_io.cc, Slot_sync, begin, chun size=%d\n", slot->size);
-	//printf("lds_io.cc, Slot_sync, begin, chun size=%d, flush offset=%d\n", slot->size, slot->flush_offset);
-	Slot_flush(slot);
+	if(slot->lds!=NULL && slot->chain.empty() && slot->size <= slot->lds->options.pack_threshold){
+		int packed=slot->lds->pack_table(slot);//a small table, it shares a pack slot and gives its own slot back
+		Slot_cache_meta(slot);
+		slot->sealed=true;
+		return packed;
+	}
 
+	slot->level=table_level;
+	if(slot->chain.empty() && !slot->gathered){
+		//the header is in front of the data in the buffer (or the mapping), one write seals the table
+		Slot_encode_header(slot, (char*)slot->buffer);
+		slot->flush_offset=0;
+		//whole pages, so that a file device can write them around the OS buffer
+		uint64_t end=slot->write_head;
+		uint64_t padded=(end+4095)/4096*4096;
+		if(slot->map==NULL){
+			memset((char*)slot->buffer+ end, 0, padded-end);
+			slot->write_head=padded;
+		}
+		Slot_write_out(slot, true);
+		slot->write_head=end;
+		slot->flush_offset=end;
+	}
+	else{
+		Slot_write_out(slot);//the rest of the last slot
 
-	char coded_size[8];
-	EncodeFixed64(coded_size, slot->size);
+		LDS_TRACE_BEGIN(t);
+		if(slot->map!=NULL){
+			Slot_encode_header(slot, slot->map);
+		}
+		else{
+			void *header;
+			posix_memalign(&header, 4096, SLOT_HEADER_SIZE);
+			Slot_encode_header(slot, (char*)header);
+			slot->dev->Write(slot->phy_offset, header, SLOT_HEADER_SIZE);
+			free(header);
+		}
+		LDS_TRACE(LDS_TRACE_SLOT_FLUSH, LDS_AREA_SLOT, slot->phy_offset, SLOT_HEADER_SIZE, t);
+	}
 
-	lseek64(slot->fd, slot->phy_offset+ (SLOT_SIZE -8), SEEK_SET);//8 bytes for the chunk size	
-	write(slot->fd, coded_size, 8);
+	LDS_RateLimiter *limiter= slot->lds!=NULL ? slot->lds->limiter : NULL;
+	if(limiter!=NULL){
+		limiter->Request(0);//let pending WAL/MANIFEST I/O go before the sync
+	}
+
+	for(size_t i=0; i<slot->chain.size(); i++){
+		uint64_t synced= i+1<slot->chain.size() ? SLOT_SIZE : slot->write_head;
+		uint64_t off= slot->lds->slot_offset(slot->chain[i]);
+		if(Slot_sync_range(slot, slot->map!=NULL ? slot->chain_maps[i] : NULL, off, synced)!=0){
+			fprintf(stderr,"lds_io.cc, Slot_sync, res error, exit\n");
+			exit(3);
+		}
+	}
 	
-	int res;
-	res=sync_file_range(slot->fd, slot->phy_offset, SLOT_SIZE , SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER );//SYNC_FILE_RANGE_WRITE
+	//only what was written, the header included
+	uint64_t synced= slot->chain.empty() ? (slot->write_head+4095)/4096*4096 : SLOT_SIZE;
+	int res=Slot_sync_range(slot, slot->map, slot->phy_offset, synced);
 	//printf("lds_io.cc, Slot_sync, begin, name=%s, phyoffset=%d\n", slot->file_name.c_str(), slot->phy_offset );
 	
 	if(res!=0){	
@@ -134,6 +478,8 @@ size_t Slot_sync(LDS_Slot *slot){
 		fprintf(stderr,"lds_io.cc, Slot_sync, res error, exit\n");
 		exit(3);
 	}
+	Slot_cache_meta(slot);
+	slot->sealed=true;
 	return res;
 	//sleep(999);
 
@@ -141,43 +487,224 @@ size_t Slot_sync(LDS_Slot *slot){
 
 }
 
+//-----------------------------------------LDS_SealBatch-----------------------------------
+
+static __thread LDS_SealBatch *current_batch=NULL;
+
+LDS_SealBatch::LDS_SealBatch() : prev_(current_batch), done_(false) {
+	current_batch=this;
+}
+
+LDS_SealBatch::~LDS_SealBatch(){
+	if(!done_){
+		Wait();
+	}
+}
+
+LDS_SealBatch *LDS_SealBatch::Current(){
+	return current_batch;
+}
+
+void LDS_SealBatch::Add(LDS_Device *dev, uint64_t offset, uint64_t n){
+	dev->StartSync(offset, n);
+	Range r;
+	r.dev=dev;
+	r.offset=offset;
+	r.n=n;
+	ranges_.push_back(r);
+}
+
+int LDS_SealBatch::Wait(){
+	if(current_batch==this){
+		current_batch=prev_;
+	}
+	done_=true;
+
+	//one wait per device for all its ranges
+	int res=0;
+	std::vector<bool> waited(ranges_.size(), false);
+	for(size_t i=0; i<ranges_.size(); i++){
+		if(waited[i]){
+			continue;
+		}
+		std::vector<std::pair<uint64_t, uint64_t> > ranges;
+		for(size_t j=i; j<ranges_.size(); j++){
+			if(!waited[j] && ranges_[j].dev==ranges_[i].dev){
+				ranges.push_back(std::make_pair(ranges_[j].offset, ranges_[j].n));
+				waited[j]=true;
+			}
+		}
+		LDS_TRACE_BEGIN(t);
+		if(ranges_[i].dev->SyncRanges(ranges)!=0){
+			res=-1;
+		}
+		for(size_t j=0; j<ranges.size(); j++){
+			LDS_TRACE(LDS_TRACE_SLOT_SYNC, LDS_AREA_SLOT, ranges[j].first, ranges[j].second, t);
+		}
+	}
+	ranges_.clear();
+	if(res!=0){
+		fprintf(stderr,"lds_io.cc, LDS_SealBatch::Wait, sync error, exit\n");
+		exit(3);
+	}
+	return res;
+}
+
+LDS_SealBatchDetach::LDS_SealBatchDetach() : batch_(current_batch) {
+	current_batch=NULL;
+}
+
+LDS_SealBatchDetach::~LDS_SealBatchDetach(){
+	current_batch=batch_;
+}
+
+int Sync_range(LDS_Device *dev, uint64_t offset, uint64_t n){
+	if(n==0){
+		return 0;//sync_file_range takes 0 as "to the end of the device"
+	}
+	if(current_batch!=NULL){
+		current_batch->Add(dev, offset, n);
+		return 0;
+	}
+	LDS_TRACE_BEGIN(t);
+	int res=dev->Sync(offset, n);
+	LDS_TRACE(LDS_TRACE_SLOT_SYNC, LDS_AREA_SLOT, offset, n, t);
+	return res;
+}
+
 size_t Slot_close(LDS_Slot *slot){
 	/*Free the LDS buffer*/
+	LDS_TRACE(LDS_TRACE_SLOT_CLOSE, LDS_AREA_SLOT, slot->phy_offset, slot->size, 0);
+	if(slot->map!=NULL){//mmap write mode, the data stays in the OS buffer
+		slot->dev->Unmap(slot->map, SLOT_SIZE);
+		for(size_t i=0; i<slot->chain_maps.size(); i++){
+			slot->dev->Unmap(slot->chain_maps[i], SLOT_SIZE);
+		}
+	}
+	if(!slot->sealed && slot->buffer!=NULL && slot->lds!=NULL){
+		//a table given up before its seal has no header to find its continuation slots by, the
+		//db deletes it by name and only its home slot is freed then. Only a writer has a buffer,
+		//the chain of a reader slot is the one read_chunk_size took from the header.
+		for(size_t i=0; i<slot->chain.size(); i++){
+			slot->lds->release_slot(slot->chain[i]);
+		}
+	}
+	if(slot->charged){
+		slot->lds->memory->Release(LDS_MEM_SLOT_BUFFER, SLOT_SIZE);
+		LDS_SealedCache *sealed_cache=slot->lds->sealed_cache;
+		if(sealed_cache!=NULL && slot->sealed && slot->chain.empty() && !slot->gathered){
+			uint64_t offset, size;
+			if(!slot->lds->locate_packed(slot->number, &offset, &size)){
+				offset= slot->phy_offset+ slot->data_offset;
+			}
+			if(sealed_cache->Insert(slot->number, (char*)slot->buffer, SLOT_SIZE, (const char*)slot->buffer+ slot->data_offset, slot->size, offset)){
+				//the whole table is in the buffer, the cache keeps it for the first reads and counts it from now
+				slot->buffer=NULL;
+			}
+		}
+	}
 	delete slot;
+	return 0;
 }
 
-size_t Log_flush(LDS_Log * log){
-	/*
-	 FLush the log object/objects to the OS buffer.
-	 This function is called by LevelDB each time when a log request is processed.
-	 */
-	 //flush to OS buffer
-	//printf("lds_id.cc, Log_flush, fd=%d\n", log->fd);
-	
+static size_t Log_write_out(LDS_Log * log, int *synced){
 	/*Align to avoid the read-before-write problem*/
+	//synced is NULL, or the write of a polled log is made durable and *synced is 1, 0 if there
+	//was nothing to write, -1 on error.
+	//flush_mu held. Only the published records go out, the page they end in is written again by
+	//the next flush, with the records after them complete.
 	int algin_unit=4096;
+	uint64_t write_head=log->write_head.load(std::memory_order_acquire);
+	uint64_t flush_offset=log->flush_offset.load(std::memory_order_relaxed);
 	uint64_t l_algined,r_aligned; 
-	l_algined=log->flush_offset;
-	r_aligned= log->write_head;
+	l_algined=flush_offset;
+	r_aligned= write_head;
 	
 	l_algined=l_algined/algin_unit;
 	l_algined=l_algined*algin_unit;
 	
 	r_aligned=r_aligned/algin_unit;
-	r_aligned=(r_aligned+1)*algin_unit;
+	r_aligned=r_aligned*algin_unit;
 	
 	/*Do the real flush operation with write system call*/
-	lseek64(log->fd, log->phy_offset+ log->l_algined, SEEK_SET);
-	write(log->fd, log->buffer+ l_algined, r_aligned- l_algined );//r_aligned- l_algined	
+	LDS_TRACE_BEGIN(t);
+	struct iovec iov[3];//of a polled log, written with one I/O
+	int iovcnt=0;
+	for(uint64_t pos=l_algined; pos<r_aligned; ){//the full pages, in up to two pieces of the ring
+		uint64_t off= pos % log->ring_size;
+		uint64_t len= r_aligned-pos < log->ring_size-off ? r_aligned-pos : log->ring_size-off;
+		if(log->polled){
+			iov[iovcnt].iov_base=(char*)log->buffer+ off;
+			iov[iovcnt].iov_len=len;
+			iovcnt++;
+		}
+		else{
+			log->dev->Write(log->phy_offset+ pos, (char*)log->buffer+ off, len);
+		}
+		pos+=len;
+	}
+	if(r_aligned + algin_unit <= log->load_size){
+		//the last page: after write_head the ring holds records being copied or bytes of an
+		//earlier round, and the device an older log of the area, none of which must look like
+		//records. The zeros end the log.
+		uint64_t n= write_head - r_aligned;
+		memcpy(log->tail_page, (char*)log->buffer+ r_aligned % log->ring_size, n);
+		memset((char*)log->tail_page+ n, 0, algin_unit-n);
+		if(log->polled){
+			iov[iovcnt].iov_base=log->tail_page;
+			iov[iovcnt].iov_len=algin_unit;
+			iovcnt++;
+		}
+		else{
+			log->dev->Write(log->phy_offset+ r_aligned, log->tail_page, algin_unit);
+		}
+		r_aligned+=algin_unit;
+	}
+	if(synced!=NULL){
+		*synced=0;
+	}
+	if(iovcnt>0){
+		//no copy into the OS buffer and no sync_file_range after it, the thread polls for the
+		//completion; a sync carries RWF_DSYNC in the same write
+		ssize_t res=log->dev->WritePolled(log->phy_offset+ l_algined, iov, iovcnt, synced!=NULL);
+		if(synced!=NULL){
+			*synced= res==(ssize_t)(r_aligned- l_algined) ? 1 : -1;
+		}
+	}
+	LDS_TRACE(LDS_TRACE_LOG_FLUSH, Log_area(log), log->phy_offset+ l_algined, r_aligned- l_algined, t);
 
 	//lseek64(log->fd, log->phy_offset+ log->flush_offset, SEEK_SET);//The lseek64 call can be removed to improve performance, if the log fd is only used by one logging procedure.
 
-	//uint64_t flush_bytes = log->write_head - log->flush_offset;
+	uint64_t flush_bytes = write_head - flush_offset;
 	
 	//write(log->fd, log->buffer+ log->flush_offset, flush_bytes);
 	
-	log->flush_offset =  log->write_head;
+	log->flush_offset.store(write_head, std::memory_order_release);
+	return flush_bytes;
+}
+
+size_t Log_flush(LDS_Log * log){
+	/*
+	 FLush the log object/objects to the OS buffer.
+	 This function is called by LevelDB each time when a log request is processed.
+	 */
+	 //flush to OS buffer
+	//printf("lds_id.cc, Log_flush, fd=%d\n", log->fd);
+	
+	LDS_RateLimiter *limiter= log->lds!=NULL ? log->lds->limiter : NULL;
+	uint64_t start=0;
+	if(limiter!=NULL){
+		limiter->BeginHigh();//foreground I/O, compaction waits for it
+		start=LDS_Tracer::NowMicros();
+	}
+	
+	pthread_mutex_lock(&log->flush_mu);
+	uint64_t flush_bytes=Log_write_out(log, NULL);
+	pthread_mutex_unlock(&log->flush_mu);
 	
+	if(limiter!=NULL){
+		limiter->EndHigh(LDS_Tracer::NowMicros()-start);
+	}
 	//printf("lds_id.cc, Log_flush, end\n");
 
 	//exit(9);
@@ -187,77 +714,115 @@ size_t Log_flush(LDS_Log * log){
 size_t Log_sync(LDS_Log * log){
 	//Commit the OS-buffered log objects.
 
-	Log_flush(log);
+	LDS_RateLimiter *limiter= log->lds!=NULL ? log->lds->limiter : NULL;
+	uint64_t start=0;
+	if(limiter!=NULL){
+		limiter->BeginHigh();
+		start=LDS_Tracer::NowMicros();
+	}
+
+	pthread_mutex_lock(&log->flush_mu);
+	uint64_t sync_point=log->phy_offset +log->sync_offset;
+	int synced=0;
+	Log_write_out(log, log->polled ? &synced : NULL);//a polled log is synced by its write, traced as the flush
 	
 	
-	uint64_t sync_point=log->phy_offset +log->sync_offset;
 	uint64_t sync_bytes=log->flush_offset-log->sync_offset;
-	int res;
-	res=sync_file_range(log->fd, sync_point, sync_bytes , SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER );//SYNC_FILE_RANGE_WRITE
+	int res=0;
+	LDS_TRACE_BEGIN(t);
+	if(synced<0){
+		res=-1;
+	}
+	else if(synced==0){
+		//not polled, or the polled log had no page left to write with the sync
+		res=log->dev->Sync(sync_point, sync_bytes);
+	}
+	LDS_TRACE(LDS_TRACE_LOG_SYNC, Log_area(log), sync_point, sync_bytes, t);
 	//res=0;
 	log->sync_offset = log->flush_offset;
+	pthread_mutex_unlock(&log->flush_mu);
 	
-	
-	int res;
-	//res=sync_file_range(log->fd, slot->phy_offset, SLOT_SIZE , SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER );	
-
+	if(limiter!=NULL){
+		limiter->EndHigh(LDS_Tracer::NowMicros()-start);//the commit latency the auto tuning watches
+	}
+	return res;
 
 }
 
 
 size_t Log_close(LDS_Log * log){
 	/*For interface compatibility*/
+	if(log->lds!=NULL){
+		if(log->buffer!=NULL){
+			log->lds->memory->Release(LDS_MEM_LOG_RING, log->ring_size+ 4096);
+		}
+		if(log->read_buf!=NULL){
+			log->lds->memory->Release(LDS_MEM_TABLE_MAP, log->load_size);
+		}
+	}
 	delete log;
+	return 0;
 }
-int decode(char *raw_data, LDS_Log *log){
-
+int Log_check_record(const char *p, uint64_t avail, uint64_t *len){
 	uint32_t header_size=20;//magic[4],type[4],sn[8],size[4];
-	printf("lds_io.cc, decode, begin\n");
-	while(1){
-		char magic[4];
-		strncpy(magic, raw_data,4);
-		int cmp= strncmp(magic, MAGIC,4);
-		//printf("lds_io.cc, decode, raw_data=%s,magic=%s, cmp=%d\n",raw_data,magic,cmp);
-		if(cmp!=0){
-			break;
-		}
-		uint32_t payload_size= *(uint32_t*)(raw_data+16);
-		//printf("lds_io.cc, decode, payload size=%d\n",payload_size);
-
-		raw_data+= 20;
-		
-		memcpy(log->buffer + log->size, raw_data, payload_size);
-		log->size += payload_size;
-		raw_data +=payload_size +4;//crc
-		
+	if(avail<header_size){
+		*len=header_size;
+		return avail>=4 && strncmp(p, MAGIC, 4)!=0 ? LOG_RECORD_END : LOG_RECORD_SHORT;
 	}
-
-	
-
+	if(strncmp(p, MAGIC, 4)!=0){
+		return LOG_RECORD_END;
+	}
+	uint32_t payload_size= DecodeFixed32(p+16);
+	*len= header_size+ (uint64_t)payload_size+ 4;
+	if(avail<*len){
+		return LOG_RECORD_SHORT;
+	}
+	uint32_t crc=DecodeFixed32(p+ header_size+ payload_size);
+	if(crc==LOG_CRC_NONE){
+		return LOG_RECORD_UNCHECKED;
+	}
+	return crc32c::Unmask(crc)==crc32c::Value(p, header_size+ payload_size) ? LOG_RECORD_OK : LOG_RECORD_BAD;
 }
+
 size_t Log_read(void * ptr, size_t size, size_t count, LDS_Log *log){
 		/*Return raw data from the log area*/
-		//printf("lds_io.cc, Log_read, begin, read_buf=%p\n",log->read_buf);
+		//the records are decoded from a mapping of the area as they are read, nothing is copied but
+		//the payloads handed out
+		uint32_t header_size=20;//magic[4],type[4],sn[8],size[4];
 		if(log->read_buf==NULL){
-			printf("lds_io.cc, Log_read, buff is null, fd=%d, size=%lld\n",log->fd, log->size);
-			//here first load the data to memory, decode the valid data and copy them to read_buf.
-			char *read_buf=  (char*)mmap(NULL, log->load_size, PROT_READ, MAP_SHARED, log->fd,log->phy_offset);
-			//printf("lds_io.cc, Log_read, read_buf=%p,read_buf=%s\n",read_buf, read_buf );
-			decode(read_buf, log);
-
-			//printf("lds_io.cc, Log_read, after decode, size=%lld,buffer=%s\n",log->size, log->buffer );
-			
-			//exit(9);
+			printf("lds_io.cc, Log_read, map, dev=%s, size=%lld\n",log->dev->Name().c_str(), log->load_size);
+			log->read_buf=  log->dev->Map(log->phy_offset, log->load_size);
+			if(log->read_buf!=NULL && log->lds!=NULL){
+				log->lds->memory->Charge(LDS_MEM_TABLE_MAP, log->load_size);
+			}
+			log->read_offset=0;
+			log->payload_left=0;
 		}
-		//now provide read service, content is stored in log->buffer, bytes are log->size. read position is at log->read_offset.
+		const char *area=(const char*)log->read_buf;
 
 		size_t request_bytes= size*count;
-		size_t remained_bytes = log->size - log->read_offset;
-
-		size_t supply_bytes= remained_bytes > request_bytes? request_bytes : remained_bytes;
-		if(supply_bytes>0){
-			memcpy(ptr, log->buffer + log->read_offset, supply_bytes);
-			log->read_offset += supply_bytes;
+		size_t supply_bytes=0;
+		while(supply_bytes<request_bytes){
+			if(log->payload_left==0){
+				//the next record, the log ends at the first place without one
+				if(log->read_offset+ header_size > log->load_size || strncmp(area+ log->read_offset, MAGIC, 4)!=0){
+					break;
+				}
+				uint32_t payload_size= DecodeFixed32(area+ log->read_offset+ 16);
+				if(log->read_offset+ header_size+ payload_size+ 4 > log->load_size){
+					break;
+				}
+				log->payload_pos= log->read_offset+ header_size;
+				log->payload_left= payload_size;
+				log->read_offset+= header_size+ payload_size+ 4;//crc
+				log->size+= payload_size;
+				continue;
+			}
+			size_t n= request_bytes-supply_bytes < log->payload_left ? request_bytes-supply_bytes : log->payload_left;
+			memcpy((char*)ptr+ supply_bytes, area+ log->payload_pos, n);
+			log->payload_pos+= n;
+			log->payload_left-= n;
+			supply_bytes+= n;
 		}
 		//printf("lds_io.cc, Log_read, end, supply_bytes=%d\n",supply_bytes);
 		return supply_bytes;
@@ -266,20 +831,181 @@ size_t Log_read(void * ptr, size_t size, size_t count, LDS_Log *log){
 
 
 
-uint64_t Alloc_slot(uint64_t next_file_number_){
+static LDS_SlotMap *default_map=NULL;//of the first LDS, for Alloc_slot and the others without a map
+
+void Slot_map_init(LDS_SlotMap *map, uint64_t total, uint64_t base){
+	map->online=(char*)malloc(total);//now we use one byte for a slot, but one bit is enough
+	memset(map->online, 0, total);
+	map->total=total;
+	map->base=base;
+	map->free_cursor=0;
+	map->run_cursor=0;
+	pthread_mutex_init(&map->mu, NULL);
+	map->epochs[0].first_number=0;
+	map->epochs[0].amount=total;
+	map->epoch_count=1;
+	map->grow_to=0;
+	map->last_number=0;
+	if(default_map==NULL){
+		default_map=map;
+		OnlineMap=map->online;
+		SlotTotal=total;
+		SlotBase=base;
+	}
+}
+
+void Slot_map_free(LDS_SlotMap *map){
+	free(map->online);
+	map->online=NULL;
+	pthread_mutex_destroy(&map->mu);
+	if(default_map==map){
+		default_map=NULL;
+		OnlineMap=NULL;
+	}
+}
+
+uint64_t Home_slot(LDS_SlotMap *map, uint64_t number){
+	int i=map->epoch_count.load(std::memory_order_acquire)-1;
+	while(i>0 && map->epochs[i].first_number>number){
+		i--;
+	}
+	return number % map->epochs[i].amount;
+}
+
+static int Slot_map_save(LDS_SlotMap *map, int count){
+	//the first count epochs, durable before any number of the last one is handed out
+	char buf[8+LDS_EPOCH_MAX*16+4];
+	size_t n=8+count*16;
+	memcpy(buf, SLOT_EPOCH_MAGIC, 4);
+	EncodeFixed32(buf+4, count);
+	for(int i=0; i<count; i++){
+		EncodeFixed64(buf+8+i*16, map->epochs[i].first_number);
+		EncodeFixed64(buf+16+i*16, map->epochs[i].amount);
+	}
+	EncodeFixed32(buf+n, crc32c::Mask(crc32c::Value(buf, n)));
+	n+=4;
+
+	std::string tmp=map->epoch_path+".tmp";
+	int fd=open(tmp.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if(fd<0){
+		return -1;
+	}
+	int res= write(fd, buf, n)==(ssize_t)n && fsync(fd)==0 ? 0 : -1;
+	close(fd);
+	if(res!=0 || rename(tmp.c_str(), map->epoch_path.c_str())!=0){
+		return -1;
+	}
+	size_t slash=map->epoch_path.find_last_of('/');
+	std::string dir= slash==std::string::npos ? std::string(".") : map->epoch_path.substr(0, slash+1);
+	fd=open(dir.c_str(), O_RDONLY);
+	if(fd>=0){
+		fsync(fd);//the rename
+		close(fd);
+	}
+	return 0;
+}
+
+int Slot_map_load(LDS_SlotMap *map, const std::string& path, uint64_t device_slots){
+	map->epoch_path=path;
+	int fd=open(path.c_str(), O_RDONLY);
+	if(fd<0){
+		//the first open of the file, its size is the first epoch
+		return Slot_map_save(map, 1);
+	}
+	char buf[8+LDS_EPOCH_MAX*16+4];
+	ssize_t n=read(fd, buf, sizeof(buf));
+	close(fd);
+	uint32_t count= n>=8 ? DecodeFixed32(buf+4) : 0;
+	if(n<8 || memcmp(buf, SLOT_EPOCH_MAGIC, 4)!=0 || count==0 || count>LDS_EPOCH_MAX || n!=(ssize_t)(8+count*16+4) ||
+		crc32c::Unmask(DecodeFixed32(buf+8+count*16))!=crc32c::Value(buf, 8+count*16)){
+		fprintf(stderr,"lds_io.cc, Slot_map_load, bad slot epochs in %s\n", path.c_str());
+		return -1;
+	}
+	for(uint32_t i=0; i<count; i++){
+		map->epochs[i].first_number=DecodeFixed64(buf+8+i*16);
+		map->epochs[i].amount=DecodeFixed64(buf+16+i*16);
+	}
+	uint64_t amount=map->epochs[count-1].amount;
+	if(amount>device_slots || amount==0){
+		fprintf(stderr,"lds_io.cc, Slot_map_load, %s lists %llu slots, the device has %llu\n", path.c_str(),
+			(unsigned long long)amount, (unsigned long long)device_slots);
+		return -1;
+	}
+	map->epoch_count.store(count, std::memory_order_release);
+	map->total=amount;
+	map->last_number=map->epochs[count-1].first_number;
+	if(device_slots>amount){
+		map->grow_to=device_slots;//the device was grown, the epoch was not started
+	}
+	if(map==default_map){
+		SlotTotal=amount;
+	}
+	return 0;
+}
+
+int Slot_map_grow(LDS_SlotMap *map, uint64_t total){
+	pthread_mutex_lock(&map->mu);
+	int res= map->epoch_count.load()<LDS_EPOCH_MAX && !map->epoch_path.empty() ? 0 : -1;
+	if(res==0 && total>map->total && total>map->grow_to){
+		map->grow_to=total;
+	}
+	pthread_mutex_unlock(&map->mu);
+	return res;
+}
+
+static uint64_t Slot_map_epoch(LDS_SlotMap *map, uint64_t next_file_number_){
+	//the number an allocation starts from, in the last epoch. A pending grow starts a new
+	//epoch here, every number handed out before is below it. map->mu held.
+	int count=map->epoch_count.load(std::memory_order_relaxed);
+	uint64_t first=map->epochs[count-1].first_number;
+	if(map->grow_to>map->total && count<LDS_EPOCH_MAX){
+		uint64_t start= next_file_number_>map->last_number ? next_file_number_ : map->last_number+1;
+		char *online=(char*)realloc(map->online, map->grow_to);
+		if(online!=NULL){
+			memset(online+map->total, 0, map->grow_to-map->total);
+			map->online=online;
+			map->epochs[count].first_number=start;
+			map->epochs[count].amount=map->grow_to;
+			if(Slot_map_save(map, count+1)==0){
+				map->epoch_count.store(count+1, std::memory_order_release);
+				printf("lds_io.cc, Slot_map_epoch, %llu slots from file number %llu on\n",
+					(unsigned long long)map->grow_to, (unsigned long long)start);
+				map->total=map->grow_to;
+				first=start;
+			}
+			else{
+				fprintf(stderr,"lds_io.cc, Slot_map_epoch, cannot write %s, the LDS keeps %llu slots\n",
+					map->epoch_path.c_str(), (unsigned long long)map->total);
+			}
+			if(map==default_map){
+				OnlineMap=map->online;
+				SlotTotal=map->total;
+			}
+		}
+		map->grow_to=0;
+	}
+	return next_file_number_>first ? next_file_number_ : first;
+}
+
+static uint64_t Alloc_number(LDS_SlotMap *map, uint64_t next_file_number_){
 	//printf("lds_io.cc, Alloc_slot, begin\n");
 	//this function will alloc a free slot number according to the online-map;
 	//exit(9);
 	
 	uint64_t result;
-	result = next_file_number_ %SlotTotal;
+	pthread_mutex_lock(&map->mu);
+	next_file_number_=Slot_map_epoch(map, next_file_number_);
+	result = next_file_number_ %map->total;
 	
 	uint64_t final_number;
 	uint64_t temp;
-	for(temp=result; temp< SlotTotal; temp++){//To confirm that the slot is free. If not, find the next following it.
-		if(OnlineMap[temp]==0){//it is free
-			OnlineMap[temp]==1;
+	for(temp=result; temp< map->total; temp++){//To confirm that the slot is free. If not, find the next following it.
+		if(map->online[temp]==0){//it is free
+			map->online[temp]=1;
 			final_number= next_file_number_ + (temp-result);//reverse map
+			map->last_number= final_number>map->last_number ? final_number : map->last_number;
+			pthread_mutex_unlock(&map->mu);
+			LDS_TRACE(LDS_TRACE_ALLOC_SLOT, LDS_AREA_SLOT, map->base+ temp*SLOT_SIZE, final_number, 0);
 			return final_number;
 		}
 	
@@ -287,9 +1013,12 @@ uint64_t Alloc_slot(uint64_t next_file_number_){
 
 	fprintf(stderr,"lds_io.cc, Alloc_slot, round back\n");
 	for(temp= 0 ;temp<result;temp++){ //round back
-		if(OnlineMap[temp]==0){
-			OnlineMap[temp]==1;
-			final_number= next_file_number_ + (SlotTotal- result) + temp;
+		if(map->online[temp]==0){
+			map->online[temp]=1;
+			final_number= next_file_number_ + (map->total- result) + temp;
+			map->last_number= final_number>map->last_number ? final_number : map->last_number;
+			pthread_mutex_unlock(&map->mu);
+			LDS_TRACE(LDS_TRACE_ALLOC_SLOT, LDS_AREA_SLOT, map->base+ temp*SLOT_SIZE, final_number, 0);
 			
 			return final_number;
 		}
@@ -300,24 +1029,156 @@ uint64_t Alloc_slot(uint64_t next_file_number_){
 	exit(9);
 }
 
+static int64_t Find_run(LDS_SlotMap *map, uint64_t want, uint64_t *len){
+	//first run of want free slots from run_cursor on, or the longest run if there is none. map->mu held.
+	//a run does not wrap around, the last and the first slot are not adjacent on the device.
+	int64_t best=-1;
+	uint64_t best_len=0;
+	uint64_t start=0, n=0;
+	for(uint64_t i=0; i<map->total; i++){
+		uint64_t temp=(map->run_cursor+i) % map->total;
+		if(temp==0){
+			n=0;
+		}
+		if(map->online[temp]!=0){
+			n=0;
+			continue;
+		}
+		if(n==0){
+			start=temp;
+		}
+		n++;
+		if(n>best_len){
+			best=start;
+			best_len=n;
+			if(n>=want){
+				break;
+			}
+		}
+	}
+	*len=best_len;
+	return best;
+}
+
+uint64_t Alloc_slot_in(LDS_SlotMap *map, uint64_t next_file_number_, LDS_AllocHint *hint){
+	if(hint==NULL){
+		return Alloc_number(map, next_file_number_);
+	}
+	pthread_mutex_lock(&map->mu);
+	next_file_number_=Slot_map_epoch(map, next_file_number_);
+	int64_t temp=-1;
+	while(hint->remaining>0 && hint->next_slot<map->total && map->online[hint->next_slot]!=0){
+		//taken since the last call, e.g. by a continuation slot of the previous table, which
+		//Slot_extend takes right after its home slot: the run goes on after it
+		hint->next_slot++;
+		hint->remaining--;
+	}
+	if(hint->remaining>0 && hint->next_slot<map->total && map->online[hint->next_slot]==0){
+		temp=hint->next_slot;//continue the run
+		hint->remaining--;
+	}
+	else{
+		uint64_t len;
+		uint64_t want= hint->run>0 ? hint->run : 1;
+		temp=Find_run(map, want, &len);
+		if(temp>=0){
+			hint->remaining= (len<want ? len : want) -1;
+			map->run_cursor=temp+hint->remaining+1;//the next run goes after this one
+		}
+	}
+	if(temp<0){
+		pthread_mutex_unlock(&map->mu);
+		fprintf(stderr,"lds_io.cc, storage full,exit!\n");
+		exit(9);
+	}
+	map->online[temp]=1;
+	hint->next_slot=temp+1;
+	uint64_t result= next_file_number_ %map->total;
+	uint64_t final_number= next_file_number_ + (temp+map->total-result) %map->total;//reverse map
+	map->last_number= final_number>map->last_number ? final_number : map->last_number;
+	pthread_mutex_unlock(&map->mu);
+	LDS_TRACE(LDS_TRACE_ALLOC_SLOT, LDS_AREA_SLOT, map->base+ temp*SLOT_SIZE, final_number, 0);
+	return final_number;
+}
+
+int64_t Alloc_free_slot_in(LDS_SlotMap *map, int64_t prefer){
+	//for slots that are not tied to a file number, e.g., pack slots
+	pthread_mutex_lock(&map->mu);
+	if(prefer>=0 && (uint64_t)prefer<map->total && map->online[prefer]==0){
+		map->online[prefer]=1;
+		pthread_mutex_unlock(&map->mu);
+		return prefer;
+	}
+	for(uint64_t i=0; i<map->total; i++){
+		uint64_t temp=(map->free_cursor+i) % map->total;
+		if(map->online[temp]==0){
+			map->online[temp]=1;
+			map->free_cursor=temp+1;
+			pthread_mutex_unlock(&map->mu);
+			return temp;
+		}
+	}
+	pthread_mutex_unlock(&map->mu);
+	return -1;
+}
+
+void Free_slot_in(LDS_SlotMap *map, uint64_t slot_index){
+	pthread_mutex_lock(&map->mu);
+	map->online[slot_index % map->total]=0;
+	pthread_mutex_unlock(&map->mu);
+}
+
+uint64_t Alloc_slot(uint64_t next_file_number_){
+	return Alloc_number(default_map, next_file_number_);
+}
+
+uint64_t Alloc_slot(uint64_t next_file_number_, LDS_AllocHint *hint){
+	return Alloc_slot_in(default_map, next_file_number_, hint);
+}
+
+int64_t Alloc_free_slot(int64_t prefer){
+	return Alloc_free_slot_in(default_map, prefer);
+}
+
+void Free_slot(uint64_t slot_index){
+	Free_slot_in(default_map, slot_index);
+}
+
 
 uint64_t read_chunk_size(LDS_Slot *slot){
+	//one aligned read of the slot header gives the size and the chain
+	void *header;
+	posix_memalign(&header, 4096, SLOT_HEADER_SIZE);
+	LDS_TRACE_BEGIN(t);
+	ssize_t r=slot->dev->Read(slot->phy_offset, header, SLOT_HEADER_SIZE);
+	LDS_TRACE(LDS_TRACE_TABLE_OPEN, LDS_AREA_SLOT, slot->phy_offset, SLOT_HEADER_SIZE, t);
+
+	LDS_SlotHeader h;
+	int res= r==SLOT_HEADER_SIZE ? Slot_decode_header((const char*)header, &h) : -2;
+	free(header);
+	if(res==0 && h.number==slot->number){
+		slot->data_offset=SLOT_HEADER_SIZE;
+		slot->chain=h.chain;
+		slot->level=h.level;
+		return h.size;
+	}
+	if(res!=-1){
+		fprintf(stderr,"lds_io.cc, read_chunk_size, bad slot header, name=%s\n", slot->file_name.c_str());
+		return 0;
+	}
+
+	//a slot written before the slot header, the size is in its last 8 bytes
+	slot->data_offset=0;
+	slot->chain.clear();
 	uint64_t offset= slot->phy_offset+ (SLOT_SIZE -8);
-	
-	
-	//printf("lds_io.cc, read_chunk_size,slot->phy_offset=%d, offset=%llu\n",slot->phy_offset,offset);
 	char coded_size[8];
 	
-	fsync(slot->fd);
-	
-	//sleep(1);
-	lseek64(slot->fd, offset, SEEK_SET);//8 bytes for the chunk size
-	read(slot->fd, coded_size, 8);
-	
+	//the footer was written through the same page cache, no fsync is needed before reading it
 	
+	LDS_TRACE_BEGIN(t_old);
+	slot->dev->Read(offset, coded_size, 8);//8 bytes for the chunk size
+	LDS_TRACE(LDS_TRACE_TABLE_OPEN, LDS_AREA_SLOT, offset, 8, t_old);
 	
-	//printf("lds_io.cc, read_chunk_size,coded_size=%s\n",coded_size);
-
 	uint64_t size =*(uint64_t*)coded_size;
 	
 	return size;
@@ -325,4 +1186,18 @@ uint64_t read_chunk_size(LDS_Slot *slot){
 }
 
 
-}//end leveldb
\ No newline at end of file
+int read_chain(LDS_Slot *slot, uint64_t size, std::vector<uint64_t> *chain){
+	chain->clear();
+	if(slot->data_offset==SLOT_HEADER_SIZE){//read_chunk_size took it from the header
+		*chain=slot->chain;
+		return chain->size();
+	}
+	if(size <= SLOT_SIZE-8){
+		return 0;//a slot written before the slot header holds the whole table
+	}
+	fprintf(stderr,"lds_io.cc, read_chain, bad size in the slot footer, name=%s\n", slot->file_name.c_str());
+	return -1;
+}
+
+
+}//end leveldb
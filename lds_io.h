@@ -10,6 +10,12 @@ namespace leveldb{
 
 size_t Slot_write(const void * ptr, size_t size, size_t count, LDS_Slot * slot );
 
+//append for the table builder: a large block is written from the caller buffer together with the
+//bytes buffered before it (one pwritev), smaller ones are copied into the buffer like Slot_write
+size_t Slot_append(const void *ptr, size_t n, LDS_Slot *slot);
+
+#define LDS_GATHER_MIN (32*1024) //smaller appends are copied and coalesced
+
 size_t Slot_flush(LDS_Slot *slot);
 
 size_t Slot_sync(LDS_Slot *slot);
@@ -18,7 +24,9 @@ size_t Slot_close(LDS_Slot *slot);
 
 size_t Slot_read(void * ptr, size_t size, size_t count, LDS_Slot *slot);
 
-size_t Log_write(const void * ptr, size_t size, size_t count, LDS_Log * log );//package the fresh log buffer.
+size_t Log_write(const void * ptr, size_t size, size_t count, LDS_Log * log );//package the fresh log buffer, thread safe.
+
+#define LOG_PUBLISH_SPINS 64 //a writer spins this many times on the records before its own, then yields
 
 size_t Log_flush(LDS_Log * log);//flush the buffer to OS buffer.
 
@@ -28,9 +36,135 @@ size_t Log_close(LDS_Log * log);//flush the buffer to OS buffer.
 
 size_t Log_read(void * ptr, size_t size, size_t count, LDS_Log *log);
 
+//a log record is magic[4], type[4], sn[8], size[4], payload, crc[4] (masked crc32c of all before it)
+#define LOG_CRC_NONE 0x77777777 //the placeholder of records written before the crc
+#define LOG_RECORD_OK 0
+#define LOG_RECORD_UNCHECKED 1 //an older record without crc
+#define LOG_RECORD_SHORT 2 //*len bytes are needed
+#define LOG_RECORD_END 3 //no record at p, the log ends
+#define LOG_RECORD_BAD (-1)
+
+//checks the record at p with avail bytes from p on, *len is its length
+int Log_check_record(const char *p, uint64_t avail, uint64_t *len);
+
 uint64_t Alloc_slot(uint64_t next_file_number_);
 
-uint64_t read_chunk_size(LDS_Slot *slot);
+//keeps the tables of one compaction (or flush) in physically adjacent slots
+struct LDS_AllocHint{
+	uint64_t run;//slots wanted in a row, e.g. the expected number of output tables
+	uint64_t next_slot;//slot after the last one handed out
+	uint64_t remaining;//slots left of the current run
+
+	LDS_AllocHint(uint64_t run_slots=1) : run(run_slots), next_slot(0), remaining(0) { }
+};
+
+//like Alloc_slot, but the slot continues the run of the hint, or starts a new run of hint->run free
+//slots in a row. The returned number is the smallest one >= next_file_number_ that maps to that slot.
+uint64_t Alloc_slot(uint64_t next_file_number_, LDS_AllocHint *hint);
+
+int64_t Alloc_free_slot(int64_t prefer=-1);//take prefer if it is free, otherwise any free slot, and return its index, -1 when full
+
+void Free_slot(uint64_t slot_index);
+
+//the functions above work on the slots of the first LDS of the process (Env::Default()), these on
+//the slots of one LDS, e.g. of a namespace
+uint64_t Alloc_slot_in(LDS_SlotMap *map, uint64_t next_file_number_, LDS_AllocHint *hint);
+int64_t Alloc_free_slot_in(LDS_SlotMap *map, int64_t prefer);
+void Free_slot_in(LDS_SlotMap *map, uint64_t slot_index);
+void Slot_map_init(LDS_SlotMap *map, uint64_t total, uint64_t base);
+void Slot_map_free(LDS_SlotMap *map);//Alloc_slot then serves the next LDS opened
+
+//home slot of the file number in the map, by the epoch of the number
+uint64_t Home_slot(LDS_SlotMap *map, uint64_t number);
+
+/*
+ The epochs of a growable map are kept in the file path (magic "LDSE"[4], count[4],
+ (first_number[8], amount[8])*count, masked crc32c[4] of all before it), rewritten with a
+ rename. Slot_map_load reads them, or writes the first one; the map then has the slots of
+ the last epoch, and a device of more slots (a grow cut short) makes them pending.
+ -1 if the file is bad or the device has fewer slots than the last epoch.
+ Slot_map_grow makes total slots pending: the next allocation starts a new epoch from its
+ file number on, once the epochs are durable. -1 if there is no room for another epoch.
+*/
+int Slot_map_load(LDS_SlotMap *map, const std::string& path, uint64_t device_slots);
+int Slot_map_grow(LDS_SlotMap *map, uint64_t total);
+
+//Alloc_slot for the LDS of env, an Env of LDS_NewEnv or Env::Default() (env_lds.cc)
+uint64_t LDS_AllocSlot(Env *env, uint64_t next_file_number_, LDS_AllocHint *hint=NULL);
+//gives back the slot of a number from LDS_AllocSlot that was not used, e.g. VersionSet::ReuseFileNumber
+void LDS_FreeSlot(Env *env, uint64_t number);
+
+uint64_t read_chunk_size(LDS_Slot *slot);//from the slot header (or the footer of an older slot), 0 if the header is bad
+
+struct LDS_SlotHeader{
+	uint64_t number;
+	uint64_t size;
+	int level;
+	uint32_t data_crc;//crc32c of the table data
+	std::vector<uint64_t> chain;
+};
+
+//0 if h (SLOT_HEADER_SIZE bytes) is a valid slot header, -1 if it is not a header, -2 if it is corrupted
+int Slot_decode_header(const char *h, LDS_SlotHeader *header);
+
+//the level recorded in the headers of the tables this thread seals from now on, -1 if unknown
+void LDS_SetTableLevel(int level);
+
+//sets the level of the thread for its scope and restores the previous one, so a worker thread
+//does not record it in the tables it seals later for something else
+class LDS_TableLevelScope{
+public:
+	explicit LDS_TableLevelScope(int level);
+	~LDS_TableLevelScope();
+
+private:
+	int prev_;
+};
+
+int read_chain(LDS_Slot *slot, uint64_t size, std::vector<uint64_t> *chain);//continuation slots of a large table, -1 on a bad size
+
+/*
+ Seals of several tables with one wait. While a batch is open on a thread, Slot_sync (and
+ the sync of a packed table) on that thread writes the table and its footer and starts the
+ writeback of the written ranges, but does not wait; Wait() waits for all of them at once.
+ A compaction opens a batch for its outputs and waits before the version edit is logged.
+*/
+class LDS_SealBatch{
+public:
+	LDS_SealBatch();//becomes the batch of the calling thread
+	~LDS_SealBatch();//waits if Wait was not called
+
+	int Wait();//the barrier, 0 when every table of the batch is durable; the batch ends here
+
+	void Add(LDS_Device *dev, uint64_t offset, uint64_t n);//starts the writeback of the range
+
+	static LDS_SealBatch *Current();//of the calling thread, or NULL
+
+private:
+	struct Range{
+		LDS_Device *dev;
+		uint64_t offset;
+		uint64_t n;
+	};
+	std::vector<Range> ranges_;
+	LDS_SealBatch *prev_;//batches of one thread nest
+	bool done_;
+};
+
+//suspends the batch of the calling thread while it lives: the seals in between are synced at
+//once, e.g. the level-0 table of CompactMemTable, which runs inside the loop of DoCompactionWork
+//and must be durable before its version edit is logged
+class LDS_SealBatchDetach{
+public:
+	LDS_SealBatchDetach();
+	~LDS_SealBatchDetach();//the batch is the batch of the thread again
+
+private:
+	LDS_SealBatch *batch_;
+};
+
+//make [offset, offset+n) of dev durable now, or at the Wait of the thread's batch
+int Sync_range(LDS_Device *dev, uint64_t offset, uint64_t n);
 
 
 class LogObject{
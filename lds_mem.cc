@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "db/lds_mem.h"
+
+namespace leveldb {
+
+namespace {
+
+uint64_t MonoMicros(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+void Deadline(uint64_t micros, struct timespec *ts){
+	clock_gettime(CLOCK_REALTIME, ts);
+	uint64_t nsec=ts->tv_nsec + micros*1000;
+	ts->tv_sec+=nsec/1000000000;
+	ts->tv_nsec=nsec%1000000000;
+}
+
+const char *category_names[LDS_MEM_CATEGORIES]={"slot_buffers", "log_rings", "table_maps", "meta_cache", "sealed_cache"};
+
+}//namespace
+
+LDS_MemBudget::LDS_MemBudget(uint64_t limit) : limit_(limit), total_(0), peak_(0), waits_(0), wait_micros_(0), streamed_(0) {
+	for(int i=0; i<LDS_MEM_CATEGORIES; i++){
+		used_[i]=0;
+	}
+	pthread_mutex_init(&mu_, NULL);
+	pthread_cond_init(&cv_, NULL);
+}
+
+LDS_MemBudget::~LDS_MemBudget(){
+	pthread_cond_destroy(&cv_);
+	pthread_mutex_destroy(&mu_);
+}
+
+bool LDS_MemBudget::Reserve(int category, uint64_t bytes){
+	pthread_mutex_lock(&mu_);
+	if(limit_>0 && Budgeted()+bytes > limit_){
+		//wait for a release, bounded so a writer holding a buffer itself never waits forever
+		waits_++;
+		uint64_t start=MonoMicros();
+		struct timespec deadline;
+		Deadline(LDS_MEM_WAIT_US, &deadline);
+		while(Budgeted()+bytes > limit_){
+			if(pthread_cond_timedwait(&cv_, &mu_, &deadline)!=0){
+				break;
+			}
+		}
+		wait_micros_+=MonoMicros()-start;
+		if(Budgeted()+bytes > limit_){
+			pthread_mutex_unlock(&mu_);
+			return false;
+		}
+	}
+	used_[category]+=bytes;
+	total_+=bytes;
+	if(total_>peak_){
+		peak_=total_;
+	}
+	pthread_mutex_unlock(&mu_);
+	return true;
+}
+
+bool LDS_MemBudget::Fits(uint64_t bytes){
+	pthread_mutex_lock(&mu_);
+	bool fits= limit_==0 || Budgeted()+bytes <= limit_;
+	pthread_mutex_unlock(&mu_);
+	return fits;
+}
+
+void LDS_MemBudget::Charge(int category, uint64_t bytes){
+	pthread_mutex_lock(&mu_);
+	used_[category]+=bytes;
+	total_+=bytes;
+	if(total_>peak_){
+		peak_=total_;
+	}
+	pthread_mutex_unlock(&mu_);
+}
+
+void LDS_MemBudget::Release(int category, uint64_t bytes){
+	pthread_mutex_lock(&mu_);
+	used_[category]-=bytes;
+	total_-=bytes;
+	pthread_cond_broadcast(&cv_);
+	pthread_mutex_unlock(&mu_);
+}
+
+void LDS_MemBudget::NoteStreamed(){
+	pthread_mutex_lock(&mu_);
+	streamed_++;
+	pthread_mutex_unlock(&mu_);
+}
+
+uint64_t LDS_MemBudget::Usage(){
+	pthread_mutex_lock(&mu_);
+	uint64_t total=total_;
+	pthread_mutex_unlock(&mu_);
+	return total;
+}
+
+void LDS_MemBudget::Report(std::string *result){
+	char buf[256];
+	pthread_mutex_lock(&mu_);
+	snprintf(buf, sizeof(buf), "budget_bytes=%llu usage=%llu budgeted=%llu peak=%llu waits=%llu wait_micros=%llu streamed_tables=%llu\n",
+		(unsigned long long)limit_, (unsigned long long)total_, (unsigned long long)Budgeted(), (unsigned long long)peak_,
+		(unsigned long long)waits_, (unsigned long long)wait_micros_, (unsigned long long)streamed_);
+	result->append(buf);
+	for(int i=0; i<LDS_MEM_CATEGORIES; i++){
+		snprintf(buf, sizeof(buf), "%s=%llu\n", category_names[i], (unsigned long long)used_[i]);
+		result->append(buf);
+	}
+	pthread_mutex_unlock(&mu_);
+}
+
+}//leveldb
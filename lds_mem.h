@@ -0,0 +1,79 @@
+#ifndef LDS_MEM_H
+#define LDS_MEM_H
+
+#include <stdint.h>
+#include <string>
+
+#include <pthread.h>
+
+namespace leveldb {
+
+/*
+ Accounting of the memory one LDS holds, against lds_options.memory_budget_bytes.
+
+ Every slot buffer (SLOT_SIZE per table being written), log ring, mapping of a table or of
+ a log area being read, the metadata cache and the sealed table cache are counted in their
+ category. The mappings are only reported: their pages are page cache the kernel reclaims,
+ so they do not count against the budget. Only the slot buffers wait for the budget: the sealed table cache gives buffers
+ back first, then a table writer that finds the budget exceeded waits up to
+ LDS_MEM_WAIT_US for other tables to be sealed, then writes its table without a buffer
+ (streamed through a writable mapping of its slots, the mmap write mode, whose pages the
+ kernel writes back and reclaims), so compactions slow down instead of the process
+ running out of memory. The other categories are taken whatever the budget, and except the
+ mappings they count against it for the slot buffers.
+
+ A budget of 0 only counts. "lds.memory" of LDS::get_property reports the usage.
+*/
+
+#define LDS_MEM_WAIT_US 100000 //longest a slot buffer waits for the budget
+
+enum{
+	LDS_MEM_SLOT_BUFFER=0,
+	LDS_MEM_LOG_RING=1,
+	LDS_MEM_TABLE_MAP=2,//mappings of tables and of log areas being read, reported but not against the budget
+	LDS_MEM_META_CACHE=3,
+	LDS_MEM_SEALED_CACHE=4,//slot buffers of sealed tables kept for reads
+	LDS_MEM_CATEGORIES=5
+};
+
+class LDS_MemBudget{
+public:
+	LDS_MemBudget(uint64_t limit);
+	~LDS_MemBudget();
+
+	//bytes of a category that may wait for the budget, false if it is still exceeded after
+	//LDS_MEM_WAIT_US, nothing is counted then
+	bool Reserve(int category, uint64_t bytes);
+
+	//true if bytes more fit in the budget now
+	bool Fits(uint64_t bytes);
+
+	//bytes taken whatever the budget
+	void Charge(int category, uint64_t bytes);
+	void Release(int category, uint64_t bytes);
+
+	void NoteStreamed();//a table was written without a slot buffer
+
+	uint64_t Usage();
+	void Report(std::string *result);
+
+private:
+	pthread_mutex_t mu_;
+	pthread_cond_t cv_;
+
+	uint64_t limit_;//0 is unlimited
+	uint64_t used_[LDS_MEM_CATEGORIES];
+	uint64_t total_;
+	uint64_t peak_;
+
+	uint64_t Budgeted(){ return total_- used_[LDS_MEM_TABLE_MAP]; }//what the budget gates, mu_ held
+
+	//counters
+	uint64_t waits_;
+	uint64_t wait_micros_;
+	uint64_t streamed_;
+};
+
+}//leveldb
+
+#endif
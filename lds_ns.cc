@@ -0,0 +1,164 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+#include "db/lds_ns.h"
+#include "db/lds_dev.h"
+#include "db/lds.h"
+#include "util/coding.h" //in LevelDB
+#include "util/crc32c.h" //in LevelDB
+
+namespace leveldb {
+
+static pthread_mutex_t ns_mu=PTHREAD_MUTEX_INITIALIZER;//serializes the superblock updates
+
+static uint32_t Super_crc(const char *page){
+	char copy[4096];
+	memcpy(copy, page, sizeof(copy));
+	EncodeFixed32(copy+12, 0);
+	return crc32c::Value(copy, sizeof(copy));
+}
+
+static bool Read_super(LDS_Device *dev, char *page){
+	return dev->Read(0, page, 4096)==4096;
+}
+
+int LDS_ReadNamespaces(LDS_Device *dev, std::vector<LDS_Namespace> *result){
+	result->clear();
+	char page[4096];
+	if(!Read_super(dev, page)){
+		return -1;
+	}
+	if(memcmp(page, NS_MAGIC, 4)!=0){
+		return 1;
+	}
+	uint32_t count=DecodeFixed32(page+8);
+	if(DecodeFixed32(page+4)!=NS_VERSION || count>NS_MAX || crc32c::Unmask(DecodeFixed32(page+12))!=Super_crc(page)){
+		return -1;
+	}
+	for(uint32_t i=0; i<count; i++){
+		const char *e=page+16+i*NS_ENTRY_SIZE;
+		LDS_Namespace ns;
+		ns.name.assign(e, strnlen(e, NS_NAME_MAX));
+		ns.offset=DecodeFixed64(e+NS_NAME_MAX);
+		ns.size=DecodeFixed64(e+NS_NAME_MAX+8);
+		ns.index=i;
+		result->push_back(ns);
+	}
+	return 0;
+}
+
+static int Clear_region(LDS_Device *dev, const LDS_Namespace& ns, LDS_Device *log_dev){
+	//the region may hold the data of an earlier use of the device: the record heads of its log
+	//areas and the first page of its slots (slot or pack headers) must not be taken as its own
+	void *page;
+	posix_memalign(&page, 4096, 4096);
+	memset(page, 0, 4096);
+	uint64_t log_base= log_dev==NULL ? ns.offset : (uint64_t)ns.index*(VERSION_LOG_SIZE + BACKUP_SIZE);
+	uint64_t slot_base= log_dev==NULL ? ns.offset+ VERSION_LOG_SIZE + BACKUP_SIZE : ns.offset;
+	LDS_Device *logs= log_dev==NULL ? dev : log_dev;
+	int res=0;
+	if(logs->Write(log_base, page, 4096)!=4096 || logs->Write(log_base+ VERSION_LOG_SIZE, page, 4096)!=4096 ||
+		logs->Sync(log_base, VERSION_LOG_SIZE + BACKUP_SIZE)!=0){
+		res=-1;
+	}
+	for(uint64_t off=slot_base; res==0 && off+ SLOT_SIZE <= ns.offset+ns.size; off+=SLOT_SIZE){
+		if(dev->Write(off, page, 4096)!=4096){
+			res=-1;
+		}
+	}
+	if(res==0 && slot_base < ns.offset+ns.size && dev->Sync(slot_base, ns.offset+ns.size- slot_base)!=0){
+		res=-1;
+	}
+	free(page);
+	return res;
+}
+
+bool LDS_HasNamespaces(LDS_Device *dev){
+	char page[4096];
+	return Read_super(dev, page) && memcmp(page, NS_MAGIC, 4)==0;
+}
+
+int LDS_OpenNamespace(LDS_Device *dev, const std::string& name, uint64_t create_bytes, LDS_Namespace *ns, LDS_Device *log_dev){
+	if(name.empty() || name.size()>=NS_NAME_MAX){
+		fprintf(stderr,"lds_ns.cc, LDS_OpenNamespace, bad namespace name '%s'\n", name.c_str());
+		return -1;
+	}
+	pthread_mutex_lock(&ns_mu);
+	std::vector<LDS_Namespace> all;
+	int res=LDS_ReadNamespaces(dev, &all);
+	if(res<0){
+		pthread_mutex_unlock(&ns_mu);
+		fprintf(stderr,"lds_ns.cc, LDS_OpenNamespace, bad superblock on %s\n", dev->Name().c_str());
+		return -1;
+	}
+	if(res==1){
+		char magic[4];
+		if(dev->Read(0, magic, 4)==4 && memcmp(magic, "LDSX", 4)==0){
+			pthread_mutex_unlock(&ns_mu);
+			fprintf(stderr,"lds_ns.cc, LDS_OpenNamespace, %s holds a database without namespaces\n", dev->Name().c_str());
+			return -1;
+		}
+	}
+	uint64_t end=NS_SUPER_SIZE;
+	for(size_t i=0; i<all.size(); i++){
+		if(all[i].name==name){
+			*ns=all[i];
+			pthread_mutex_unlock(&ns_mu);
+			return 0;
+		}
+		if(all[i].offset+all[i].size > end){
+			end=all[i].offset+all[i].size;
+		}
+	}
+
+	//a new namespace after the last one
+	uint64_t size=(create_bytes+NS_SUPER_SIZE-1)/NS_SUPER_SIZE*NS_SUPER_SIZE;
+	if(create_bytes==0 || all.size()>=NS_MAX || end+size > dev->Size()){
+		pthread_mutex_unlock(&ns_mu);
+		fprintf(stderr,"lds_ns.cc, LDS_OpenNamespace, cannot create namespace %s of %llu bytes on %s (namespace_bytes not set, or no room)\n",
+			name.c_str(), (unsigned long long)create_bytes, dev->Name().c_str());
+		return -1;
+	}
+	LDS_Namespace created;
+	created.name=name;
+	created.offset=end;
+	created.size=size;
+	created.index=all.size();
+	all.push_back(created);
+	if(Clear_region(dev, created, log_dev)!=0){//before the superblock lists it
+		pthread_mutex_unlock(&ns_mu);
+		fprintf(stderr,"lds_ns.cc, LDS_OpenNamespace, cannot clear the region of namespace %s on %s\n", name.c_str(), dev->Name().c_str());
+		return -1;
+	}
+
+	void *buf;
+	posix_memalign(&buf, 4096, 4096);
+	char *page=(char*)buf;
+	memset(page, 0, 4096);
+	memcpy(page, NS_MAGIC, 4);
+	EncodeFixed32(page+4, NS_VERSION);
+	EncodeFixed32(page+8, all.size());
+	for(size_t i=0; i<all.size(); i++){
+		char *e=page+16+i*NS_ENTRY_SIZE;
+		memcpy(e, all[i].name.data(), all[i].name.size());
+		EncodeFixed64(e+NS_NAME_MAX, all[i].offset);
+		EncodeFixed64(e+NS_NAME_MAX+8, all[i].size);
+	}
+	EncodeFixed32(page+12, crc32c::Mask(Super_crc(page)));
+	res= dev->Write(0, page, 4096)==4096 && dev->Sync(0, 4096)==0 ? 0 : -1;
+	free(buf);
+	pthread_mutex_unlock(&ns_mu);
+	if(res!=0){
+		fprintf(stderr,"lds_ns.cc, LDS_OpenNamespace, cannot write the superblock of %s\n", dev->Name().c_str());
+		return -1;
+	}
+	printf("lds_ns.cc, LDS_OpenNamespace, created %s at %llu MB, %llu MB\n", name.c_str(),
+		(unsigned long long)(created.offset>>20), (unsigned long long)(created.size>>20));
+	*ns=created;
+	return 0;
+}
+
+}//leveldb
@@ -0,0 +1,57 @@
+#ifndef LDS_NS_H
+#define LDS_NS_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace leveldb {
+
+class LDS_Device;
+
+/*
+ Namespaces: several databases on one device. The device path "path#name" opens the namespace
+ name of the device at path; each namespace is a region of the device with its own version
+ area, backup area and slots (and its own slot allocator, LDS::slots).
+
+ The superblock in the first NS_SUPER_SIZE of the device lists the namespaces:
+   magic[4], version[4], count[4], crc[4] (masked crc32c of the page with this field 0),
+   then count entries of NS_ENTRY_SIZE: name[NS_NAME_MAX], offset[8], size[8]
+ A namespace is created at the end of the last one on its first open, with
+ lds_options.namespace_bytes. Namespaces are not removed or resized.
+
+ With lds_options.log_path the region holds only the slots, and the version and backup areas
+ of the namespace at index i are at i*(VERSION_LOG_SIZE+BACKUP_SIZE) of the log device.
+
+ The superblock is updated under a mutex of the process, create the namespaces of a device
+ from one process.
+*/
+
+#define NS_SUPER_SIZE 4194304 //SLOT_SIZE, the namespaces stay slot aligned
+#define NS_MAGIC "LDSN"
+#define NS_VERSION 1
+#define NS_ENTRY_SIZE 64
+#define NS_NAME_MAX 40 //with the terminating 0
+#define NS_MAX ((4096-16)/NS_ENTRY_SIZE)
+
+struct LDS_Namespace{
+	std::string name;
+	uint64_t offset;//of the region on the device
+	uint64_t size;
+	uint32_t index;//in the superblock
+};
+
+//the namespaces of dev. 0, 1 if the device has no superblock, -1 if it is bad
+int LDS_ReadNamespaces(LDS_Device *dev, std::vector<LDS_Namespace> *result);
+
+//finds the namespace name of dev, or creates it with create_bytes (0 does not create). A new
+//region gets the heads of its log areas (on log_dev with lds_options.log_path) and the first
+//page of its slots zeroed before it is listed. 0, or -1 with the reason on stderr
+int LDS_OpenNamespace(LDS_Device *dev, const std::string& name, uint64_t create_bytes, LDS_Namespace *ns, LDS_Device *log_dev=NULL);
+
+//true if the device starts with a superblock, a path without #name must not be opened then
+bool LDS_HasNamespaces(LDS_Device *dev);
+
+}//leveldb
+
+#endif
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "db/lds_ratelimit.h"
+
+namespace leveldb {
+
+namespace {
+
+uint64_t MonoMicros(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+void Deadline(uint64_t micros, struct timespec *ts){
+	clock_gettime(CLOCK_REALTIME, ts);
+	uint64_t nsec=ts->tv_nsec + micros*1000;
+	ts->tv_sec+=nsec/1000000000;
+	ts->tv_nsec=nsec%1000000000;
+}
+
+}//namespace
+
+LDS_RateLimiter::LDS_RateLimiter(uint64_t rate_bytes, bool priority, bool auto_tune, uint64_t latency_target_us)
+	: rate_(rate_bytes), min_rate_(rate_bytes/8), max_rate_(rate_bytes*8), tokens_((int64_t)(rate_bytes*LDS_BURST_US/1000000)),
+	  last_refill_(MonoMicros()), high_inflight_(0), priority_(priority), auto_tune_(auto_tune && rate_bytes>0), latency_target_(latency_target_us),
+	  period_start_(last_refill_), period_high_ops_(0), period_high_micros_(0), period_throttled_(0),
+	  low_bytes_(0), low_requests_(0), throttled_requests_(0), throttle_micros_(0),
+	  priority_waits_(0), priority_wait_micros_(0), high_ops_(0), high_micros_(0), rate_changes_(0) {
+	pthread_mutex_init(&mu_, NULL);
+	pthread_cond_init(&cv_, NULL);
+}
+
+LDS_RateLimiter::~LDS_RateLimiter(){
+	pthread_cond_destroy(&cv_);
+	pthread_mutex_destroy(&mu_);
+}
+
+void LDS_RateLimiter::Request(uint64_t bytes){
+	pthread_mutex_lock(&mu_);
+	low_requests_++;
+	low_bytes_+=bytes;
+
+	//foreground I/O first
+	if(priority_ && high_inflight_>0){
+		uint64_t start=MonoMicros();
+		struct timespec ts;
+		Deadline(LDS_PRIORITY_WAIT_US, &ts);
+		while(high_inflight_>0){
+			if(pthread_cond_timedwait(&cv_, &mu_, &ts)!=0){
+				break;//do not starve compaction
+			}
+		}
+		priority_waits_++;
+		priority_wait_micros_+=MonoMicros()-start;
+	}
+
+	uint64_t now=MonoMicros();
+	if(auto_tune_ && now-period_start_ >= LDS_TUNE_PERIOD_US){
+		Tune(now);
+	}
+
+	uint64_t sleep_us=0;
+	if(rate_>0){
+		//refill, the bucket holds at most LDS_BURST_US of the rate. A longer idle time adds nothing
+		//more, and keeps elapsed*rate_ from overflowing.
+		uint64_t elapsed= now-last_refill_ < LDS_BURST_US ? now-last_refill_ : LDS_BURST_US;
+		int64_t burst=(int64_t)(rate_*LDS_BURST_US/1000000);
+		tokens_+= (int64_t)(elapsed*rate_/1000000);
+		if(tokens_>burst){
+			tokens_=burst;
+		}
+		last_refill_=now;
+
+		tokens_-=bytes;
+		if(tokens_<0){
+			sleep_us= (uint64_t)(-tokens_)*1000000/rate_;
+			throttled_requests_++;
+			throttle_micros_+=sleep_us;
+			period_throttled_++;
+		}
+	}
+	pthread_mutex_unlock(&mu_);
+
+	if(sleep_us>0){
+		usleep(sleep_us);
+	}
+}
+
+void LDS_RateLimiter::BeginHigh(){
+	pthread_mutex_lock(&mu_);
+	high_inflight_++;
+	pthread_mutex_unlock(&mu_);
+}
+
+void LDS_RateLimiter::EndHigh(uint64_t micros){
+	pthread_mutex_lock(&mu_);
+	high_inflight_--;
+	high_ops_++;
+	high_micros_+=micros;
+	period_high_ops_++;
+	period_high_micros_+=micros;
+	if(high_inflight_==0){
+		pthread_cond_broadcast(&cv_);
+	}
+	pthread_mutex_unlock(&mu_);
+}
+
+void LDS_RateLimiter::Tune(uint64_t now){
+	uint64_t rate=rate_;
+	if(period_high_ops_>0 && period_high_micros_/period_high_ops_ > latency_target_){
+		rate=rate*4/5;//foreground suffers, slow compaction down
+	}
+	else if(period_throttled_>0 && (period_high_ops_==0 || period_high_micros_/period_high_ops_ < latency_target_/2)){
+		rate=rate*11/10;//room to spare and compaction is held back
+	}
+	if(rate<min_rate_){
+		rate=min_rate_;
+	}
+	if(rate>max_rate_){
+		rate=max_rate_;
+	}
+	if(rate!=rate_){
+		rate_=rate;
+		rate_changes_++;
+	}
+	period_start_=now;
+	period_high_ops_=0;
+	period_high_micros_=0;
+	period_throttled_=0;
+}
+
+uint64_t LDS_RateLimiter::Rate(){
+	pthread_mutex_lock(&mu_);
+	uint64_t rate=rate_;
+	pthread_mutex_unlock(&mu_);
+	return rate;
+}
+
+void LDS_RateLimiter::SetRate(uint64_t rate_bytes){
+	pthread_mutex_lock(&mu_);
+	rate_=rate_bytes;
+	min_rate_=rate_bytes/8;
+	max_rate_=rate_bytes*8;
+	if(rate_bytes==0){
+		auto_tune_=false;
+	}
+	pthread_mutex_unlock(&mu_);
+}
+
+void LDS_RateLimiter::Report(std::string *result){
+	char buf[512];
+	pthread_mutex_lock(&mu_);
+	snprintf(buf, sizeof(buf),
+		"rate_bytes=%llu auto_tune=%d rate_changes=%llu\n"
+		"compaction: requests=%llu bytes=%llu throttled=%llu throttle_micros=%llu priority_waits=%llu priority_wait_micros=%llu\n"
+		"foreground: ops=%llu micros=%llu\n",
+		(unsigned long long)rate_, auto_tune_ ? 1 : 0, (unsigned long long)rate_changes_,
+		(unsigned long long)low_requests_, (unsigned long long)low_bytes_, (unsigned long long)throttled_requests_,
+		(unsigned long long)throttle_micros_, (unsigned long long)priority_waits_, (unsigned long long)priority_wait_micros_,
+		(unsigned long long)high_ops_, (unsigned long long)high_micros_);
+	pthread_mutex_unlock(&mu_);
+	result->append(buf);
+}
+
+}//leveldb
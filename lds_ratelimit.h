@@ -0,0 +1,83 @@
+#ifndef LDS_RATELIMIT_H
+#define LDS_RATELIMIT_H
+
+#include <stdint.h>
+#include <string>
+
+#include <pthread.h>
+
+namespace leveldb {
+
+/*
+ Arbitration between the foreground I/O (WAL and MANIFEST) and the compaction I/O
+ (slot flushes and syncs) of one LDS.
+
+ Compaction writes are paced by a token bucket and, with priority, wait while foreground
+ I/O is in flight (bounded by LDS_PRIORITY_WAIT_US so compaction is never starved).
+ Foreground I/O never waits on the limiter.
+
+ With auto tuning, the rate is lowered while the foreground sync latency is above the
+ target and raised again while it is well below the target and compaction is throttled,
+ within [rate/8, rate*8] of the configured rate.
+*/
+
+#define LDS_RATE_CHUNK (256*1024) //compaction writes are issued in pieces of this size
+#define LDS_PRIORITY_WAIT_US 5000 //longest a compaction I/O waits for foreground I/O
+#define LDS_TUNE_PERIOD_US 1000000
+#define LDS_BURST_US 100000 //the bucket holds 100ms of the rate, and starts full
+
+class LDS_RateLimiter{
+public:
+	//with priority, Request waits for the foreground I/O in flight; rate_bytes 0 does not pace
+	LDS_RateLimiter(uint64_t rate_bytes, bool priority, bool auto_tune, uint64_t latency_target_us);
+	~LDS_RateLimiter();
+
+	//compaction I/O of bytes (0 for a sync), blocks until it may go
+	void Request(uint64_t bytes);
+
+	//foreground I/O
+	void BeginHigh();
+	void EndHigh(uint64_t micros);
+
+	uint64_t Rate();
+	void SetRate(uint64_t rate_bytes);
+
+	void Report(std::string *result);
+
+private:
+	void Tune(uint64_t now);//mu_ held
+
+	pthread_mutex_t mu_;
+	pthread_cond_t cv_;
+
+	uint64_t rate_;//bytes per second, 0 is unlimited
+	uint64_t min_rate_;
+	uint64_t max_rate_;
+	int64_t tokens_;//may become negative, the debt is paid by sleeping
+	uint64_t last_refill_;
+
+	int high_inflight_;
+	bool priority_;
+
+	bool auto_tune_;
+	uint64_t latency_target_;
+	uint64_t period_start_;
+	uint64_t period_high_ops_;
+	uint64_t period_high_micros_;
+	uint64_t period_throttled_;
+
+	//counters
+	uint64_t low_bytes_;
+	uint64_t low_requests_;
+	uint64_t throttled_requests_;
+	uint64_t throttle_micros_;
+	uint64_t priority_waits_;
+	uint64_t priority_wait_micros_;
+	uint64_t high_ops_;
+	uint64_t high_micros_;
+	uint64_t rate_changes_;
+};
+
+}//leveldb
+
+#endif
@@ -0,0 +1,250 @@
+// Replays an LDS trace (see lds_trace.h) against a device.
+//
+// The records of each traced thread are replayed by one thread, in the traced order
+// and, by default, at the traced time offsets. Slot and log writes are replayed as
+// writes of the same size at the same device offsets, syncs as syncs of the same
+// ranges, table opens as the footer read plus a touch of the mapped range.
+//
+//   ./lds_replay --trace=lds.trace --dev=sim:mem?size=64G [--speed=2] [--json=out.json]
+//                [--log_dev=sim:mem?size=128M]
+//
+// --log_dev replays the version and backup area records on their own device, as
+// with lds_options.log_path. Slot offsets are replayed as traced.
+//
+// --speed=0 replays as fast as possible, --speed=N replays N times faster.
+// WARNING: the replay overwrites the device.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "db/lds_dev.h"
+#include "db/lds_trace.h"
+
+using leveldb::LDS_Device;
+using leveldb::LDS_TraceRecord;
+using leveldb::LDS_Tracer;
+
+namespace {
+
+const char* FLAGS_trace=NULL;
+const char* FLAGS_dev=NULL;
+const char* FLAGS_log_dev=NULL;
+const char* FLAGS_json=NULL;
+double FLAGS_speed=1.0;
+
+const char* kTypeNames[leveldb::LDS_TRACE_TYPE_MAX]={
+	"none", "alloc_slot", "slot_write", "slot_flush", "slot_sync", "slot_close",
+	"log_write", "log_flush", "log_sync", "table_open", "table_mmap",
+};
+
+struct Stats{
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t micros;
+	std::vector<uint64_t> lat;
+
+	Stats() : ops(0), bytes(0), micros(0) { }
+};
+
+struct ReplayThread{
+	std::vector<LDS_TraceRecord> records;
+	LDS_Device *dev;
+	LDS_Device *log_dev;
+	uint64_t trace_start;//first timestamp of the whole trace
+	uint64_t replay_start;
+	Stats stats[leveldb::LDS_TRACE_TYPE_MAX];
+	pthread_t thread;
+};
+
+bool ByTime(const LDS_TraceRecord& a, const LDS_TraceRecord& b){
+	return a.micros < b.micros;
+}
+
+void* Replay(void *arg){
+	ReplayThread *rt=reinterpret_cast<ReplayThread*>(arg);
+	std::vector<char> buf;
+	for(size_t i=0; i<rt->records.size(); i++){
+		const LDS_TraceRecord& r=rt->records[i];
+		if(FLAGS_speed>0){
+			uint64_t due=rt->replay_start + (uint64_t)((r.micros - rt->trace_start)/FLAGS_speed);
+			uint64_t now=LDS_Tracer::NowMicros();
+			if(due>now){
+				usleep(due-now);
+			}
+		}
+
+		LDS_Device *dev= r.area==leveldb::LDS_AREA_SLOT ? rt->dev : rt->log_dev;
+		uint64_t t=LDS_Tracer::NowMicros();
+		switch(r.type){
+			case leveldb::LDS_TRACE_SLOT_FLUSH:
+			case leveldb::LDS_TRACE_LOG_FLUSH:
+				if(buf.size()<r.size){
+					buf.resize(r.size, 'r');
+				}
+				dev->Write(r.offset, &buf[0], r.size);
+				break;
+			case leveldb::LDS_TRACE_SLOT_SYNC:
+			case leveldb::LDS_TRACE_LOG_SYNC:
+				dev->Sync(r.offset, r.size);
+				break;
+			case leveldb::LDS_TRACE_TABLE_OPEN:
+				if(buf.size()<r.size){
+					buf.resize(r.size);
+				}
+				dev->Read(r.offset, &buf[0], r.size);
+				break;
+			case leveldb::LDS_TRACE_TABLE_MMAP:{
+				//leveldb reads the footer and the index block at the end of the table first
+				char *base=(char*)dev->Map(r.offset, r.size);
+				if(base!=NULL && base!=MAP_FAILED && r.size>0){
+					volatile char c=base[r.size-1];
+					(void)c;
+					dev->Unmap(base, r.size);
+				}
+				break;
+			}
+			default://buffer-only operations, nothing reaches the device
+				break;
+		}
+		uint64_t d=LDS_Tracer::NowMicros()-t;
+
+		Stats& s=rt->stats[r.type < leveldb::LDS_TRACE_TYPE_MAX ? r.type : 0];
+		s.ops++;
+		s.bytes+=r.size;
+		s.micros+=d;
+		s.lat.push_back(d);
+	}
+	return NULL;
+}
+
+uint64_t Percentile(std::vector<uint64_t>& v, double p){
+	if(v.empty()){
+		return 0;
+	}
+	size_t k=(size_t)(p/100.0*(v.size()-1));
+	std::nth_element(v.begin(), v.begin()+k, v.end());
+	return v[k];
+}
+
+}//namespace
+
+int main(int argc, char** argv){
+	for(int i=1; i<argc; i++){
+		if(strncmp(argv[i], "--trace=", 8)==0){
+			FLAGS_trace=argv[i]+8;
+		}
+		else if(strncmp(argv[i], "--dev=", 6)==0){
+			FLAGS_dev=argv[i]+6;
+		}
+		else if(strncmp(argv[i], "--log_dev=", 10)==0){
+			FLAGS_log_dev=argv[i]+10;
+		}
+		else if(strncmp(argv[i], "--json=", 7)==0){
+			FLAGS_json=argv[i]+7;
+		}
+		else if(strncmp(argv[i], "--speed=", 8)==0){
+			FLAGS_speed=atof(argv[i]+8);
+		}
+		else{
+			fprintf(stderr,"lds_replay.cc, invalid flag '%s'\n", argv[i]);
+			return 1;
+		}
+	}
+	if(FLAGS_trace==NULL || FLAGS_dev==NULL){
+		fprintf(stderr,"usage: lds_replay --trace=<file> --dev=<device> [--log_dev=<device>] [--speed=N] [--json=<file>]\n");
+		return 1;
+	}
+
+	FILE *f=fopen(FLAGS_trace, "r");
+	if(f==NULL){
+		fprintf(stderr,"lds_replay.cc, cannot open %s\n", FLAGS_trace);
+		return 1;
+	}
+	leveldb::LDS_TraceFileHeader header;
+	if(fread(&header, sizeof(header), 1, f)!=1 || memcmp(header.magic, LDS_TRACE_MAGIC, 4)!=0 ||
+		header.version!=LDS_TRACE_VERSION || header.record_size!=sizeof(LDS_TraceRecord)){
+		fprintf(stderr,"lds_replay.cc, %s is not a trace of this version\n", FLAGS_trace);
+		return 1;
+	}
+
+	//one replay thread per traced thread
+	std::map<uint32_t, ReplayThread*> threads;
+	uint64_t trace_start=UINT64_MAX, total=0;
+	LDS_TraceRecord r;
+	while(fread(&r, sizeof(r), 1, f)==1){
+		ReplayThread*& rt=threads[r.tid];
+		if(rt==NULL){
+			rt=new ReplayThread;
+		}
+		rt->records.push_back(r);
+		if(r.micros<trace_start){
+			trace_start=r.micros;
+		}
+		total++;
+	}
+	fclose(f);
+	printf("lds_replay.cc, %llu records, %zu threads\n", (unsigned long long)total, threads.size());
+
+	LDS_Device *dev=leveldb::LDS_OpenDevice(FLAGS_dev);
+	LDS_Device *log_dev= FLAGS_log_dev ? leveldb::LDS_OpenDevice(FLAGS_log_dev) : dev;
+	uint64_t start=LDS_Tracer::NowMicros();
+	for(std::map<uint32_t, ReplayThread*>::iterator it=threads.begin(); it!=threads.end(); ++it){
+		ReplayThread *rt=it->second;
+		std::stable_sort(rt->records.begin(), rt->records.end(), ByTime);
+		rt->dev=dev;
+		rt->log_dev=log_dev;
+		rt->trace_start=trace_start;
+		rt->replay_start=start;
+		pthread_create(&rt->thread, NULL, &Replay, rt);
+	}
+
+	Stats sum[leveldb::LDS_TRACE_TYPE_MAX];
+	for(std::map<uint32_t, ReplayThread*>::iterator it=threads.begin(); it!=threads.end(); ++it){
+		ReplayThread *rt=it->second;
+		pthread_join(rt->thread, NULL);
+		for(int t=0; t<leveldb::LDS_TRACE_TYPE_MAX; t++){
+			sum[t].ops+=rt->stats[t].ops;
+			sum[t].bytes+=rt->stats[t].bytes;
+			sum[t].micros+=rt->stats[t].micros;
+			sum[t].lat.insert(sum[t].lat.end(), rt->stats[t].lat.begin(), rt->stats[t].lat.end());
+		}
+		delete rt;
+	}
+	uint64_t elapsed=LDS_Tracer::NowMicros()-start;
+
+	FILE *json= FLAGS_json ? fopen(FLAGS_json, "a") : NULL;
+	for(int t=1; t<leveldb::LDS_TRACE_TYPE_MAX; t++){
+		if(sum[t].ops==0){
+			continue;
+		}
+		char line[512];
+		snprintf(line, sizeof(line),
+			"{\"replay\":\"%s\",\"ops\":%llu,\"bytes\":%llu,\"micros\":%llu,\"p50\":%llu,\"p99\":%llu,\"max\":%llu,\"elapsed\":%llu}",
+			kTypeNames[t], (unsigned long long)sum[t].ops, (unsigned long long)sum[t].bytes,
+			(unsigned long long)sum[t].micros, (unsigned long long)Percentile(sum[t].lat, 50),
+			(unsigned long long)Percentile(sum[t].lat, 99), (unsigned long long)Percentile(sum[t].lat, 100),
+			(unsigned long long)elapsed);
+		printf("%s\n", line);
+		if(json!=NULL){
+			fprintf(json, "%s\n", line);
+		}
+	}
+	if(json!=NULL){
+		fclose(json);
+	}
+	if(log_dev!=dev){
+		delete log_dev;
+	}
+	delete dev;
+	return 0;
+}
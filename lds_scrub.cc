@@ -0,0 +1,563 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "db/lds_scrub.h"
+#include "db/lds_io.h"
+#include "util/coding.h" //in LevelDB
+#include "util/crc32c.h" //in LevelDB
+
+namespace leveldb {
+
+namespace {
+
+uint64_t MonoMicros(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+uint64_t RoundUp(uint64_t n){
+	return (n+4095)/4096*4096;
+}
+
+bool DecodeHandle(const char **p, const char *limit, uint64_t *offset, uint64_t *size){
+	*p=GetVarint64Ptr(*p, limit, offset);
+	if(*p==NULL){
+		return false;
+	}
+	*p=GetVarint64Ptr(*p, limit, size);
+	return *p!=NULL;
+}
+
+//the checksum in the trailer of the block at [offset, offset+n) of the table
+bool CheckBlock(const char *table, uint64_t size, uint64_t offset, uint64_t n){
+	if(offset + n + LDS_BLOCK_TRAILER_SIZE > size){
+		return false;
+	}
+	const char *block= table + offset;
+	uint32_t expected=crc32c::Unmask(DecodeFixed32(block+n+1));
+	return crc32c::Value(block, n+1)==expected;//the type byte is covered as well
+}
+
+//the values of the entries of an uncompressed block, false if it cannot be parsed
+bool BlockEntries(const char *block, uint64_t n, std::vector<std::pair<std::string, std::string> > *entries){
+	if(n<4){
+		return false;
+	}
+	uint32_t restarts=DecodeFixed32(block+n-4);
+	if((uint64_t)(restarts+1)*4 > n){
+		return false;
+	}
+	const char *limit= block + n - (restarts+1)*4;
+	std::string key;
+	const char *p=block;
+	while(p<limit){
+		uint32_t shared, non_shared, value_len;
+		if((p=GetVarint32Ptr(p, limit, &shared))==NULL || (p=GetVarint32Ptr(p, limit, &non_shared))==NULL ||
+			(p=GetVarint32Ptr(p, limit, &value_len))==NULL || shared>key.size() || p+non_shared+value_len>limit){
+			return false;
+		}
+		key.resize(shared);
+		key.append(p, non_shared);
+		p+=non_shared;
+		entries->push_back(std::make_pair(key, std::string(p, value_len)));
+		p+=value_len;
+	}
+	return true;
+}
+
+//checks every block of the table reachable from its footer. 0 when good, 1 if there is no
+//table footer, -1 when bad
+int CheckBlocks(const char *table, uint64_t size, uint64_t *blocks, std::string *reason){
+	if(size < LDS_TABLE_FOOTER_SIZE){
+		return 1;
+	}
+	const char *footer= table + size - LDS_TABLE_FOOTER_SIZE;
+	uint64_t magic= (uint64_t)DecodeFixed32(footer+40) | ((uint64_t)DecodeFixed32(footer+44) << 32);
+	if(magic!=LDS_TABLE_MAGIC){
+		return 1;
+	}
+	const char *p=footer;
+	uint64_t meta_offset, meta_size, index_offset, index_size;
+	if(!DecodeHandle(&p, footer+40, &meta_offset, &meta_size) || !DecodeHandle(&p, footer+40, &index_offset, &index_size)){
+		*reason="bad footer";
+		return -1;
+	}
+
+	std::vector<std::pair<std::string, uint64_t> > todo;//(what, offset), sizes in todo_size
+	std::vector<uint64_t> todo_size;
+	if(!CheckBlock(table, size, index_offset, index_size)){
+		*reason="bad index block";
+		return -1;
+	}
+	if(!CheckBlock(table, size, meta_offset, meta_size)){
+		*reason="bad metaindex block";
+		return -1;
+	}
+	*blocks+=2;
+
+	//a compressed index or metaindex block is not parsed, its own checksum is all that is checked
+	std::vector<std::pair<std::string, std::string> > entries;
+	if(table[index_offset+index_size]==0 && BlockEntries(table+index_offset, index_size, &entries)){
+		for(size_t i=0; i<entries.size(); i++){
+			todo.push_back(std::make_pair(std::string("data block"), 0));
+			todo_size.push_back(0);
+			const char *v=entries[i].second.data();
+			if(!DecodeHandle(&v, v+entries[i].second.size(), &todo.back().second, &todo_size.back())){
+				*reason="bad index entry";
+				return -1;
+			}
+		}
+	}
+	entries.clear();
+	if(table[meta_offset+meta_size]==0 && BlockEntries(table+meta_offset, meta_size, &entries)){
+		for(size_t i=0; i<entries.size(); i++){
+			todo.push_back(std::make_pair(entries[i].first, 0));
+			todo_size.push_back(0);
+			const char *v=entries[i].second.data();
+			if(!DecodeHandle(&v, v+entries[i].second.size(), &todo.back().second, &todo_size.back())){
+				*reason="bad metaindex entry";
+				return -1;
+			}
+		}
+	}
+
+	for(size_t i=0; i<todo.size(); i++){
+		if(!CheckBlock(table, size, todo[i].second, todo_size[i])){
+			char buf[128];
+			snprintf(buf, sizeof(buf), "bad %s at %llu", todo[i].first.c_str(), (unsigned long long)todo[i].second);
+			*reason=buf;
+			return -1;
+		}
+		(*blocks)++;
+	}
+	return 0;
+}
+
+}//namespace
+
+LDS_Scrubber::LDS_Scrubber(LDS *lds, int threads, uint64_t rate_bytes, bool quarantine)
+	: lds_(lds), threads_(threads>0 ? threads : 1), quarantine_(quarantine), limiter_(NULL),
+	  next_(0), running_(false), stop_(false), started_(false), interval_sec_(0),
+	  passes_(0), tables_(0), tables_unchecked_(0), tables_bad_(0), blocks_(0),
+	  log_records_(0), log_records_unchecked_(0), log_bad_(0), bytes_(0), last_pass_micros_(0) {
+	pthread_mutex_init(&mu_, NULL);
+	pthread_cond_init(&cv_, NULL);
+	if(rate_bytes>0){
+		limiter_=new LDS_RateLimiter(rate_bytes, false, false, 0);//only the token bucket is used
+	}
+}
+
+LDS_Scrubber::~LDS_Scrubber(){
+	Stop();
+	delete limiter_;
+	pthread_cond_destroy(&cv_);
+	pthread_mutex_destroy(&mu_);
+}
+
+void LDS_Scrubber::Start(uint64_t interval_sec){
+	pthread_mutex_lock(&mu_);
+	interval_sec_=interval_sec;
+	if(!started_){
+		started_=true;
+		stop_=false;//after a Stop
+		pthread_create(&background_, NULL, &LDS_Scrubber::BackgroundMain, this);
+	}
+	pthread_mutex_unlock(&mu_);
+}
+
+void LDS_Scrubber::Stop(){
+	pthread_mutex_lock(&mu_);
+	stop_=true;
+	pthread_cond_broadcast(&cv_);
+	bool started=started_;
+	started_=false;
+	pthread_mutex_unlock(&mu_);
+	if(started){
+		pthread_join(background_, NULL);
+	}
+}
+
+void *LDS_Scrubber::BackgroundMain(void *arg){
+	LDS_Scrubber *s=(LDS_Scrubber*)arg;
+	pthread_mutex_lock(&s->mu_);
+	while(!s->stop_){
+		//the first pass waits as well, the files of the db are not known right after start-up
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec+=s->interval_sec_;
+		while(!s->stop_ && pthread_cond_timedwait(&s->cv_, &s->mu_, &ts)==0){
+		}
+		if(s->stop_){
+			break;
+		}
+		pthread_mutex_unlock(&s->mu_);
+		s->RunPass();
+		pthread_mutex_lock(&s->mu_);
+	}
+	pthread_mutex_unlock(&s->mu_);
+	return NULL;
+}
+
+void *LDS_Scrubber::WorkerMain(void *arg){
+	((LDS_Scrubber*)arg)->Work();
+	return NULL;
+}
+
+int LDS_Scrubber::RunPass(){
+	std::vector<std::string> files;
+	lds_->list_files(&files);
+
+	std::vector<Item> items;
+	bool manifest=false, wal=false;
+	for(size_t i=0; i<files.size(); i++){
+		const std::string& name=files[i];
+		if(name.find("MANIFEST")!=std::string::npos){
+			manifest=true;
+		}
+		else if(name.find(".log")!=std::string::npos){
+			wal=true;
+		}
+		else if(name.find(".ldb")!=std::string::npos){
+			Item item;
+			item.log=false;
+			item.name=name;
+			item.number=strtoull(name.c_str(), NULL, 10);
+			item.dev=lds_->dev;
+			item.packed=lds_->locate_packed(item.number, &item.offset, &item.size);
+			items.push_back(item);
+		}
+	}
+	for(int i=0; i<2; i++){
+		if(i==0 ? !manifest : !wal){
+			continue;
+		}
+		Item item;
+		item.log=true;
+		item.name= i==0 ? "version area" : "backup area";
+		item.number=0;
+		item.dev=lds_->log_dev;
+		item.offset= lds_->log_base+ (i==0 ? 0 : VERSION_LOG_SIZE);
+		item.size= i==0 ? VERSION_LOG_SIZE : BACKUP_SIZE;
+		item.packed=false;
+		items.push_back(item);
+	}
+
+	pthread_mutex_lock(&mu_);
+	if(running_){
+		pthread_mutex_unlock(&mu_);
+		return 0;//passes do not overlap
+	}
+	running_=true;
+	items_.swap(items);
+	next_=0;
+	uint64_t bad_before=tables_bad_+log_bad_;
+	pthread_mutex_unlock(&mu_);
+
+	uint64_t start=MonoMicros();
+	std::vector<pthread_t> workers(threads_-1);
+	for(size_t i=0; i<workers.size(); i++){
+		pthread_create(&workers[i], NULL, &LDS_Scrubber::WorkerMain, this);
+	}
+	Work();
+	for(size_t i=0; i<workers.size(); i++){
+		pthread_join(workers[i], NULL);
+	}
+
+	pthread_mutex_lock(&mu_);
+	items_.clear();
+	running_=false;
+	passes_++;
+	last_pass_micros_=MonoMicros()-start;
+	int bad=tables_bad_+log_bad_-bad_before;
+	pthread_mutex_unlock(&mu_);
+	return bad;
+}
+
+void LDS_Scrubber::Work(){
+	while(true){
+		pthread_mutex_lock(&mu_);
+		if(next_>=items_.size() || stop_){
+			pthread_mutex_unlock(&mu_);
+			break;
+		}
+		Item item=items_[next_++];
+		pthread_mutex_unlock(&mu_);
+
+		std::string reason;
+		uint64_t units=0, unchecked=0;//blocks of a table, records of a log
+		int res= item.log ? CheckLog(item, &reason, &units, &unchecked) : CheckTable(item, &reason, &units);
+		if(res<0){
+			//a table deleted meanwhile, or a log record being written, is not an error
+			usleep(LDS_SCRUB_RECHECK_US);
+			if(!StillLive(item)){
+				res=1;
+			}
+			else{
+				reason.clear();
+				units=0;
+				unchecked=0;
+				res= item.log ? CheckLog(item, &reason, &units, &unchecked) : CheckTable(item, &reason, &units);
+			}
+		}
+
+		pthread_mutex_lock(&mu_);
+		if(item.log){
+			log_records_+=units;
+			log_records_unchecked_+=unchecked;
+			if(res<0){
+				log_bad_++;
+			}
+		}
+		else{
+			tables_++;
+			blocks_+=units;
+			if(res==1){
+				tables_unchecked_++;
+			}
+			if(res<0){
+				tables_bad_++;
+			}
+		}
+		if(res<0){
+			bad_.push_back(item.name+": "+reason);
+			if(bad_.size()>16){
+				bad_.erase(bad_.begin());
+			}
+		}
+		pthread_mutex_unlock(&mu_);
+
+		if(res<0){
+			fprintf(stderr,"lds_scrub.cc, Work, %s is bad: %s%s\n", item.name.c_str(), reason.c_str(),
+				!item.log && quarantine_ ? ", quarantined" : "");
+			if(!item.log && quarantine_){
+				lds_->quarantine(item.number);
+			}
+		}
+	}
+}
+
+bool LDS_Scrubber::StillLive(const Item& item){
+	if(item.log){
+		return true;
+	}
+	std::vector<std::string> files;
+	lds_->list_files(&files);
+	if(std::find(files.begin(), files.end(), item.name)==files.end()){
+		return false;
+	}
+	uint64_t offset, size;
+	bool packed=lds_->locate_packed(item.number, &offset, &size);
+	return packed==item.packed && (!packed || offset==item.offset);
+}
+
+bool LDS_Scrubber::ReadRange(LDS_Device *dev, uint64_t offset, char *buf, uint64_t n){
+	for(uint64_t done=0; done<n; ){
+		uint64_t len= n-done < LDS_SCRUB_CHUNK ? n-done : LDS_SCRUB_CHUNK;
+		if(limiter_!=NULL){
+			limiter_->Request(len);
+		}
+		if(dev->ReadUncached(offset+done, buf+done, len)!=(ssize_t)len){
+			return false;
+		}
+		done+=len;
+	}
+	pthread_mutex_lock(&mu_);
+	bytes_+=n;
+	pthread_mutex_unlock(&mu_);
+	return true;
+}
+
+int LDS_Scrubber::CheckTable(const Item& item, std::string *reason, uint64_t *blocks){
+	LDS_Device *dev=item.dev;
+	uint64_t home= lds_->slot_offset(lds_->home_slot(item.number));
+
+	void *page;
+	posix_memalign(&page, 4096, 4096);
+	const char *h=(const char*)page;
+
+	std::vector<std::pair<uint64_t, uint64_t> > extents;
+	uint64_t size=0;
+	uint32_t crc=0;
+	bool has_crc=false, old_slot=false;
+	int res=0;
+	if(item.packed){
+		if(!ReadRange(dev, item.offset-PACK_HEADER_SIZE, (char*)page, PACK_HEADER_SIZE)){
+			*reason="read error";
+			res=-1;
+		}
+		else if(memcmp(h, PACK_MAGIC, 4)!=0 || DecodeFixed64(h+16)!=item.number || DecodeFixed64(h+24)!=item.size){
+			*reason="bad pack header";
+			res=-1;
+		}
+		else{
+			size=item.size;
+			has_crc= DecodeFixed32(h+32)!=0;
+			crc=crc32c::Unmask(DecodeFixed32(h+32));
+			extents.push_back(std::make_pair(item.offset, size));
+		}
+	}
+	else if(!ReadRange(dev, home, (char*)page, SLOT_HEADER_SIZE)){
+		*reason="read error";
+		res=-1;
+	}
+	else{
+		LDS_SlotHeader header;
+		int r=Slot_decode_header(h, &header);
+		if(r==-2){
+			*reason="bad slot header";
+			res=-1;
+		}
+		else if(r==0 && header.number!=item.number){
+			res=1;//the slot was reused, the table is gone
+		}
+		else if(r==0){
+			size=header.size;
+			crc=header.data_crc;
+			has_crc=true;
+			uint64_t first=SLOT_SIZE-SLOT_HEADER_SIZE;
+			uint64_t capacity= first+ header.chain.size()*SLOT_SIZE;
+			if(size>capacity || (!header.chain.empty() && size<=capacity-SLOT_SIZE)){
+				*reason="table size does not match its chain";
+				res=-1;
+			}
+			for(size_t i=0; i<header.chain.size() && res==0; i++){
+				if(header.chain[i]>=lds_->slots.total){
+					*reason="bad chain";
+					res=-1;
+				}
+			}
+			if(res==0){
+				extents.push_back(std::make_pair(home+SLOT_HEADER_SIZE, std::min(size, first)));
+				uint64_t left= size-extents.back().second;
+				for(size_t i=0; i<header.chain.size(); i++){
+					extents.push_back(std::make_pair(lds_->slot_offset(header.chain[i]), std::min(left, (uint64_t)SLOT_SIZE)));
+					left-=extents.back().second;
+				}
+			}
+		}
+		else{
+			//no header: a slot written before the slot header (the size in its last 8 bytes), or a
+			//table not sealed yet
+			old_slot=true;
+			if(!ReadRange(dev, home+SLOT_SIZE-4096, (char*)page, 4096)){
+				*reason="read error";
+				res=-1;
+			}
+			else{
+				size=DecodeFixed64(h+4096-8);
+				if(size==0 || size>SLOT_SIZE-8){
+					res=1;
+				}
+				else{
+					extents.push_back(std::make_pair(home, size));
+				}
+			}
+		}
+	}
+	free(page);
+	if(res!=0){
+		return res;
+	}
+
+	void *table;
+	if(posix_memalign(&table, 4096, RoundUp(size))!=0){
+		*reason="out of memory";
+		return 1;
+	}
+	uint64_t pos=0;
+	for(size_t i=0; i<extents.size() && res==0; i++){
+		if(!ReadRange(dev, extents[i].first, (char*)table+pos, RoundUp(extents[i].second))){
+			*reason="read error";
+			res=-1;
+		}
+		pos+=extents[i].second;
+	}
+	if(res==0 && has_crc && crc32c::Value((const char*)table, size)!=crc){
+		*reason="table crc mismatch";
+		res=-1;
+	}
+	if(res==0){
+		res=CheckBlocks((const char*)table, size, blocks, reason);
+		if(res==1 && !old_slot){
+			*reason="no table footer";
+			res=-1;
+		}
+	}
+	free(table);
+	return res;
+}
+
+int LDS_Scrubber::CheckLog(const Item& item, std::string *reason, uint64_t *records, uint64_t *unchecked){
+	void *chunk;
+	posix_memalign(&chunk, 4096, LDS_SCRUB_CHUNK);
+
+	std::string window;//area bytes [read-window.size(), read), checked up to start
+	uint64_t start=0, read=0;
+	int res=0;
+	while(true){
+		uint64_t len;
+		int r=Log_check_record(window.data()+start, window.size()-start, &len);
+		if(r==LOG_RECORD_SHORT){
+			window.erase(0, start);
+			start=0;
+			if(read>=item.size){
+				if(window.size()>=4){
+					*reason="record beyond the end of the area";
+					res=-1;
+				}
+				break;
+			}
+			uint64_t n= item.size-read < LDS_SCRUB_CHUNK ? item.size-read : LDS_SCRUB_CHUNK;
+			if(!ReadRange(item.dev, item.offset+read, (char*)chunk, n)){
+				*reason="read error";
+				res=-1;
+				break;
+			}
+			read+=n;
+			window.append((const char*)chunk, n);
+			continue;
+		}
+		if(r==LOG_RECORD_END){
+			break;
+		}
+		if(r==LOG_RECORD_BAD){
+			char buf[64];
+			snprintf(buf, sizeof(buf), "bad record at %llu", (unsigned long long)(read-window.size()+start));
+			*reason=buf;
+			res=-1;
+			break;
+		}
+		(*records)++;
+		if(r==LOG_RECORD_UNCHECKED){
+			(*unchecked)++;
+		}
+		start+=len;
+	}
+	free(chunk);
+	return res;
+}
+
+void LDS_Scrubber::Report(std::string *result){
+	char buf[512];
+	pthread_mutex_lock(&mu_);
+	snprintf(buf, sizeof(buf),
+		"passes=%llu last_pass_micros=%llu running=%d bytes=%llu\n"
+		"tables=%llu unchecked=%llu bad=%llu blocks=%llu\n"
+		"log_records=%llu unchecked=%llu bad=%llu\n",
+		(unsigned long long)passes_, (unsigned long long)last_pass_micros_, running_ ? 1 : 0, (unsigned long long)bytes_,
+		(unsigned long long)tables_, (unsigned long long)tables_unchecked_, (unsigned long long)tables_bad_, (unsigned long long)blocks_,
+		(unsigned long long)log_records_, (unsigned long long)log_records_unchecked_, (unsigned long long)log_bad_);
+	result->append(buf);
+	for(size_t i=0; i<bad_.size(); i++){
+		result->append("bad: "+bad_[i]+"\n");
+	}
+	pthread_mutex_unlock(&mu_);
+}
+
+}//leveldb
@@ -0,0 +1,106 @@
+#ifndef LDS_SCRUB_H
+#define LDS_SCRUB_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+namespace leveldb {
+
+class LDS;
+class LDS_Device;
+class LDS_RateLimiter;
+
+/*
+ Background verification of what LDS stores, so that latent media errors are found before
+ a compaction reads a bad table and spreads it.
+
+ A pass walks the live tables (the .ldb files LDS holds) and the version and backup areas
+ with several threads. For a table it checks the slot header (or the pack header), the
+ crc32c of the whole table recorded there, and the checksum of every block reachable from
+ the footer (index, metaindex, filter and data blocks). For a log area it checks the crc of
+ every record up to the end of the log.
+
+ Reads are large (LDS_SCRUB_CHUNK), go through LDS_Device::ReadUncached (O_DIRECT on a block
+ device) so that a pass does not push the hot tables out of the OS buffer, and are paced by
+ a token bucket shared by the threads.
+
+ A failure is checked again after LDS_SCRUB_RECHECK_US, a table that was deleted meanwhile
+ (its slot reused) or a log record that was being written is not reported. Bad tables are
+ reported on stderr and in the "lds.scrub" property, and quarantined with the quarantine
+ option (LDS::quarantine).
+*/
+
+#define LDS_SCRUB_CHUNK (1024*1024)
+#define LDS_SCRUB_RECHECK_US 100000
+
+class LDS_Scrubber{
+public:
+	LDS_Scrubber(LDS *lds, int threads, uint64_t rate_bytes, bool quarantine);
+	~LDS_Scrubber();//stops the background passes
+
+	void Start(uint64_t interval_sec);//a background pass every interval_sec, also after a Stop
+	void Stop();//ends the pass in progress and joins the threads, the destructor and ~LDS call it
+
+	int RunPass();//one pass now, returns the number of bad tables and log records found
+
+	void Report(std::string *result);
+
+private:
+	struct Item{
+		bool log;//a log area, or a table
+		std::string name;
+		uint64_t number;//of the table
+		LDS_Device *dev;
+		uint64_t offset;//of the log area, or of the table data of a packed table
+		uint64_t size;//of the log area, or of a packed table
+		bool packed;
+	};
+
+	static void *WorkerMain(void *arg);
+	static void *BackgroundMain(void *arg);
+
+	void Work();//takes the items of the pass until there are none left
+	bool StillLive(const Item& item);
+
+	//0 when good, 1 when there is nothing to check (not sealed yet, slot reused), -1 when bad
+	int CheckTable(const Item& item, std::string *reason, uint64_t *blocks);
+	int CheckLog(const Item& item, std::string *reason, uint64_t *records, uint64_t *unchecked);
+
+	//reads [offset, offset+n) into the 4KB aligned buf, paced
+	bool ReadRange(LDS_Device *dev, uint64_t offset, char *buf, uint64_t n);
+
+	LDS *lds_;
+	int threads_;
+	bool quarantine_;
+	LDS_RateLimiter *limiter_;//NULL when unlimited
+
+	pthread_mutex_t mu_;
+	pthread_cond_t cv_;
+	std::vector<Item> items_;//of the running pass
+	size_t next_;
+	bool running_;//a pass is running, passes do not overlap
+	bool stop_;
+	bool started_;
+	uint64_t interval_sec_;
+	pthread_t background_;
+
+	//counters
+	uint64_t passes_;
+	uint64_t tables_;
+	uint64_t tables_unchecked_;
+	uint64_t tables_bad_;
+	uint64_t blocks_;
+	uint64_t log_records_;
+	uint64_t log_records_unchecked_;
+	uint64_t log_bad_;
+	uint64_t bytes_;
+	uint64_t last_pass_micros_;
+	std::vector<std::string> bad_;//the last ones found, for Report
+};
+
+}//leveldb
+
+#endif
@@ -0,0 +1,233 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "db/lds_trace.h"
+
+namespace leveldb {
+
+std::atomic<LDS_Tracer*> lds_tracer(NULL);
+
+namespace {
+pthread_mutex_t trace_mu=PTHREAD_MUTEX_INITIALIZER;//serializes start/stop
+}
+
+uint64_t LDS_Tracer::NowMicros(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+LDS_Tracer::LDS_Tracer(FILE *file) : file_(file), retired_dropped_(0), stop_(false), drained_(false) {
+	pthread_key_create(&key_, &LDS_Tracer::RetireRing);
+	pthread_mutex_init(&mu_, NULL);
+	pthread_cond_init(&cv_, NULL);
+
+	LDS_TraceFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, LDS_TRACE_MAGIC, 4);
+	header.version=LDS_TRACE_VERSION;
+	header.record_size=sizeof(LDS_TraceRecord);
+	fwrite(&header, sizeof(header), 1, file_);
+
+	pthread_create(&drain_thread_, NULL, &LDS_Tracer::DrainWrapper, this);
+}
+
+LDS_Tracer::~LDS_Tracer(){
+	for(size_t i=0; i<rings_.size(); i++){
+		delete rings_[i];
+	}
+	pthread_cond_destroy(&cv_);
+	pthread_mutex_destroy(&mu_);
+	pthread_key_delete(key_);
+}
+
+LDS_TraceRing *LDS_Tracer::ThreadRing(){
+	LDS_TraceRing *ring=(LDS_TraceRing*)pthread_getspecific(key_);
+	if(ring==NULL){
+		//first record of this thread, the only time a lock is taken
+		ring=new LDS_TraceRing;
+		ring->tid=syscall(SYS_gettid);
+		ring->tracer=this;
+		pthread_setspecific(key_, ring);
+		pthread_mutex_lock(&mu_);
+		rings_.push_back(ring);
+		pthread_mutex_unlock(&mu_);
+	}
+	return ring;
+}
+
+void LDS_Tracer::Record(uint8_t type, uint8_t area, uint64_t offset, uint64_t size, uint64_t start_micros){
+	LDS_TraceRing *ring=ThreadRing();
+
+	uint64_t head=ring->head;//only this thread writes head
+	uint64_t tail=__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if(head-tail >= LDS_TRACE_RING){
+		ring->dropped++;
+		return;
+	}
+
+	uint64_t now=NowMicros();
+	LDS_TraceRecord *r=&ring->records[head & (LDS_TRACE_RING-1)];
+	r->micros= start_micros ? start_micros : now;
+	r->offset=offset;
+	r->size=size;
+	r->duration= start_micros ? now-start_micros : 0;
+	r->tid=ring->tid;
+	r->type=type;
+	r->area=area;
+	r->pad=0;
+
+	__atomic_store_n(&ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+uint64_t LDS_Tracer::Dropped(){
+	pthread_mutex_lock(&mu_);
+	uint64_t dropped=retired_dropped_;
+	for(size_t i=0; i<rings_.size(); i++){
+		dropped+=rings_[i]->dropped;
+	}
+	pthread_mutex_unlock(&mu_);
+	return dropped;
+}
+
+void LDS_Tracer::DrainRing(LDS_TraceRing *ring){
+	uint64_t tail=ring->tail;//only the drain thread writes tail
+	uint64_t head=__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	while(tail<head){
+		//write the contiguous part up to the end of the ring
+		uint64_t idx=tail & (LDS_TRACE_RING-1);
+		uint64_t n=head-tail;
+		if(n > LDS_TRACE_RING-idx){
+			n=LDS_TRACE_RING-idx;
+		}
+		fwrite(&ring->records[idx], sizeof(LDS_TraceRecord), n, file_);
+		tail+=n;
+	}
+	__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+}
+
+void LDS_Tracer::Drain(){
+	pthread_mutex_lock(&mu_);
+	std::vector<LDS_TraceRing*> rings(rings_);
+	pthread_mutex_unlock(&mu_);
+
+	for(size_t i=0; i<rings.size(); i++){
+		DrainRing(rings[i]);
+	}
+
+	pthread_mutex_lock(&mu_);
+	FreeRetired();
+	pthread_mutex_unlock(&mu_);
+}
+
+void LDS_Tracer::FreeRetired(){
+	//mu_ is held. A retired ring gets no more records, so once it is drained it can go
+	for(size_t i=0; i<rings_.size(); ){
+		LDS_TraceRing *ring=rings_[i];
+		if(ring->retired && ring->tail==ring->head){
+			retired_dropped_+=ring->dropped;
+			delete ring;
+			rings_[i]=rings_.back();
+			rings_.pop_back();
+		}
+		else{
+			i++;
+		}
+	}
+}
+
+void LDS_Tracer::RetireRing(void* arg){
+	LDS_TraceRing *ring=reinterpret_cast<LDS_TraceRing*>(arg);
+	LDS_Tracer *tracer=ring->tracer;
+	pthread_mutex_lock(&tracer->mu_);
+	ring->retired=true;
+	if(tracer->drained_){
+		//the drain thread is gone, there is nobody left to write the records
+		ring->tail=ring->head;
+		tracer->FreeRetired();
+	}
+	pthread_mutex_unlock(&tracer->mu_);
+}
+
+void LDS_Tracer::DrainLoop(){
+	pthread_mutex_lock(&mu_);
+	while(!stop_){
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec+=10*1000*1000;//10ms
+		if(ts.tv_nsec>=1000000000){
+			ts.tv_sec++;
+			ts.tv_nsec-=1000000000;
+		}
+		pthread_cond_timedwait(&cv_, &mu_, &ts);
+		pthread_mutex_unlock(&mu_);
+		Drain();
+		pthread_mutex_lock(&mu_);
+	}
+	pthread_mutex_unlock(&mu_);
+	Drain();
+	pthread_mutex_lock(&mu_);
+	drained_=true;
+	for(size_t i=0; i<rings_.size(); i++){
+		//a ring may have retired after the drain above read it, its owner is gone so
+		//it can be written under the lock. Rings that retire from now on are freed by
+		//RetireRing() without being written
+		if(rings_[i]->retired){
+			DrainRing(rings_[i]);
+		}
+	}
+	FreeRetired();
+	pthread_mutex_unlock(&mu_);
+}
+
+void* LDS_Tracer::DrainWrapper(void* arg){
+	reinterpret_cast<LDS_Tracer*>(arg)->DrainLoop();
+	return NULL;
+}
+
+int LDS_TraceStart(const std::string& path){
+	pthread_mutex_lock(&trace_mu);
+	if(lds_tracer!=NULL){
+		pthread_mutex_unlock(&trace_mu);
+		return -1;
+	}
+	FILE *file=fopen(path.c_str(), "w");
+	if(file==NULL){
+		fprintf(stderr,"lds_trace.cc, LDS_TraceStart, cannot open %s\n", path.c_str());
+		pthread_mutex_unlock(&trace_mu);
+		return -1;
+	}
+	lds_tracer.store(new LDS_Tracer(file), std::memory_order_release);
+	printf("lds_trace.cc, LDS_TraceStart, tracing to %s\n", path.c_str());
+	pthread_mutex_unlock(&trace_mu);
+	return 0;
+}
+
+int LDS_TraceStop(){
+	pthread_mutex_lock(&trace_mu);
+	LDS_Tracer *tracer=lds_tracer.load(std::memory_order_acquire);
+	if(tracer==NULL){
+		pthread_mutex_unlock(&trace_mu);
+		return -1;
+	}
+	lds_tracer.store(NULL, std::memory_order_release);
+
+	pthread_mutex_lock(&tracer->mu_);
+	tracer->stop_=true;
+	pthread_cond_signal(&tracer->cv_);
+	pthread_mutex_unlock(&tracer->mu_);
+	pthread_join(tracer->drain_thread_, NULL);
+
+	uint64_t dropped=tracer->Dropped();
+	fclose(tracer->file_);
+	printf("lds_trace.cc, LDS_TraceStop, dropped records=%llu\n", (unsigned long long)dropped);
+	//the tracer is not freed: a thread may still be inside Record() with the old pointer,
+	//the rings of exiting threads are freed by RetireRing()
+	pthread_mutex_unlock(&trace_mu);
+	return 0;
+}
+
+}//leveldb
@@ -0,0 +1,137 @@
+#ifndef LDS_TRACE_H
+#define LDS_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+
+namespace leveldb {
+
+/*
+ Binary trace of the LDS-level operations.
+
+ Each thread appends fixed-size records to its own single-producer ring buffer, so
+ recording costs a few stores and never takes a lock. A background thread drains the
+ rings into the trace file. When a ring is full the record is dropped and counted.
+ When a thread exits its ring is retired: the drain thread writes what is left in it
+ and frees it, so short-lived threads do not keep their rings around.
+ Records of different threads are not ordered in the file, the replayer sorts them.
+
+ File format: LDS_TraceFileHeader followed by LDS_TraceRecord's, little endian.
+ lds_replay.cc drives a recorded trace against a device.
+*/
+
+enum LDS_TraceType{
+	LDS_TRACE_ALLOC_SLOT=1,//offset=slot offset, size=file number
+	LDS_TRACE_SLOT_WRITE=2,//copy into the slot buffer
+	LDS_TRACE_SLOT_FLUSH=3,//write to the device
+	LDS_TRACE_SLOT_SYNC=4,
+	LDS_TRACE_SLOT_CLOSE=5,
+	LDS_TRACE_LOG_WRITE=6,
+	LDS_TRACE_LOG_FLUSH=7,
+	LDS_TRACE_LOG_SYNC=8,
+	LDS_TRACE_TABLE_OPEN=9,//reads the slot footer, offset/size is the footer
+	LDS_TRACE_TABLE_MMAP=10,//offset/size is the mapped range
+	LDS_TRACE_TYPE_MAX=11,
+};
+
+enum LDS_TraceArea{
+	LDS_AREA_SLOT=0,
+	LDS_AREA_VERSION=1,
+	LDS_AREA_BACKUP=2,
+};
+
+struct LDS_TraceRecord{
+	uint64_t micros;//start time, CLOCK_MONOTONIC
+	uint64_t offset;//absolute device offset
+	uint32_t size;
+	uint32_t duration;//micros
+	uint32_t tid;
+	uint8_t type;
+	uint8_t area;
+	uint16_t pad;
+};
+
+struct LDS_TraceFileHeader{
+	char magic[4];//"LDST"
+	uint32_t version;
+	uint32_t record_size;
+	uint32_t pad;
+};
+
+#define LDS_TRACE_MAGIC "LDST"
+#define LDS_TRACE_VERSION 1
+#define LDS_TRACE_RING 65536 //records per thread, must be a power of 2
+
+class LDS_Tracer;
+
+class LDS_TraceRing{
+public:
+	LDS_TraceRecord records[LDS_TRACE_RING];
+	uint64_t head;//written by the owner thread
+	uint64_t tail;//written by the drain thread
+	uint64_t dropped;
+	uint32_t tid;
+	LDS_Tracer *tracer;
+	bool retired;//the owner thread has exited, protected by the tracer's mu_
+
+	LDS_TraceRing() : head(0), tail(0), dropped(0), tid(0), tracer(NULL), retired(false) { }
+};
+
+class LDS_Tracer{
+public:
+	LDS_Tracer(FILE *file);
+	~LDS_Tracer();
+
+	void Record(uint8_t type, uint8_t area, uint64_t offset, uint64_t size, uint64_t start_micros);
+
+	uint64_t Dropped();
+
+	static uint64_t NowMicros();
+
+private:
+	LDS_TraceRing *ThreadRing();
+	void Drain();
+	void DrainRing(LDS_TraceRing *ring);
+	void DrainLoop();
+	static void* DrainWrapper(void* arg);
+	static void RetireRing(void* arg);//destructor of key_
+	void FreeRetired();
+
+	FILE *file_;
+	pthread_key_t key_;
+	pthread_mutex_t mu_;//protects rings_, retired_dropped_ and the rings' retired flag
+	pthread_cond_t cv_;
+	std::vector<LDS_TraceRing*> rings_;
+	uint64_t retired_dropped_;//dropped records of the freed rings
+	pthread_t drain_thread_;
+	bool stop_;
+	bool drained_;//the drain thread has written its last records
+
+	friend int LDS_TraceStop();
+};
+
+//NULL when tracing is off. A stopped tracer is never freed: a thread may have loaded
+//the pointer just before the stop and still be inside Record().
+extern std::atomic<LDS_Tracer*> lds_tracer;
+
+//start tracing into path, returns 0 on success
+int LDS_TraceStart(const std::string& path);
+
+//drain the remaining records and close the trace file
+int LDS_TraceStop();
+
+#define LDS_TRACE_BEGIN(t) uint64_t t= lds_tracer.load(std::memory_order_acquire)!=NULL ? LDS_Tracer::NowMicros() : 0
+#define LDS_TRACE(type, area, offset, size, t) \
+	do{ \
+		LDS_Tracer *lds_trace_t_=lds_tracer.load(std::memory_order_acquire); \
+		if(lds_trace_t_!=NULL) lds_trace_t_->Record((type), (area), (offset), (size), (t)); \
+	}while(0)
+
+}//leveldb
+
+#endif